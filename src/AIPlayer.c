@@ -84,6 +84,7 @@ static void AIStartGame(Player *AIPlay)
   InitAbilities(AIPlay);
   SetAbility(AIPlay, A_DONEFIGHT, FALSE);
   SendAbilities(AIPlay);
+  SendRoomChoice(AIPlay);
 
   AISetName(AIPlay);
   g_message(_("Connection established\n"));
@@ -102,6 +103,7 @@ static void DisplayConnectStatus(NetworkBuffer *netbuf, NBStatus oldstatus,
 
   switch (status) {
   case NBS_PRECONNECT:
+  case NBS_RESOLVING:
     break;
   case NBS_SOCKSCONNECT:
     switch (sockstat) {
@@ -204,7 +206,7 @@ void AIPlayerLoop(struct CMDLINE *cmdline)
     }
     if (datawaiting && netbuf->status == NBS_CONNECTED) {
       QuitRequest = FALSE;
-      while ((msg = GetWaitingPlayerMessage(AIPlay)) != NULL) {
+      while ((msg = GetWaitingPlayerMessageView(AIPlay)) != NULL) {
         if (HandleAIMessage(msg, AIPlay)) {
           QuitRequest = TRUE;
           break;
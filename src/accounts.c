@@ -0,0 +1,525 @@
+/************************************************************************
+ * accounts.c     Persistent player accounts and statistics             *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <glib.h>
+
+/* The account file is mapped into memory, so is only supported where
+ * mmap is available */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && !defined(CYGWIN)
+#define ACCOUNT_STORE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "accounts.h"
+#include "dopewars.h"
+#include "log.h"
+#include "nls.h"
+#include "util.h"
+
+/* 
+ * The account file starts with a header, followed by a hash table of
+ * fixed-size slots, one per account. An account is found by hashing its
+ * name and probing from there to the first free slot; as the table is
+ * kept no more than half full, this touches only a slot or two however
+ * many accounts there are. All integers are stored little-endian.
+ *
+ * The file is mapped into memory, and changed under a write lock, since
+ * other server workers may have it mapped too. When the table fills up,
+ * a copy twice the size is written and renamed over the file, and the
+ * old file is marked as replaced (Slots = 0), so that other processes
+ * know to reopen it.
+ */
+#define ACCOUNTMAGIC    "DWAC"
+#define ACCOUNTVERSION  1
+#define ACCOUNTNAMELEN  40
+#define ACCOUNTSALTLEN  16
+#define ACCOUNTHASHLEN  32
+#define MINACCOUNTSLOTS 1024
+
+/* Set in AccountSlot.Flags if the account has a password */
+#define ACCOUNT_PASSWORD 1
+
+typedef struct _AccountHeader {
+  gchar Magic[4];               /* ACCOUNTMAGIC */
+  guint32 Version;              /* ACCOUNTVERSION */
+  guint32 Slots;                /* Number of slots (a power of 2), or 0
+                                 * if the file has been replaced */
+  guint32 Used;                 /* Number of accounts */
+  guint8 Reserved[48];
+} AccountHeader;
+
+/* A single account (128 bytes, with no padding) */
+typedef struct _AccountSlot {
+  gchar Name[ACCOUNTNAMELEN];   /* NUL-padded; empty if the slot is free */
+  guint32 Hash;                 /* NameHash(Name) */
+  guint32 Flags;
+  guint8 Salt[ACCOUNTSALTLEN];
+  guint8 PassHash[ACCOUNTHASHLEN];      /* SHA-256 of Salt and password */
+  guint32 Games, Deaths;
+  guint64 Turns;
+  gint64 BestWorth;
+  gint64 LastPlayed;            /* Seconds since the epoch */
+} AccountSlot;
+
+#define TABLESIZE(slots) \
+    (sizeof(AccountHeader) + (gsize)(slots) * sizeof(AccountSlot))
+#define HEADER(map) ((AccountHeader *)(map))
+#define SLOTS(map) ((AccountSlot *)((map) + sizeof(AccountHeader)))
+
+typedef struct _AccountStore {
+  gchar *File;                  /* Name of the account file, or NULL if
+                                 * there is no store */
+  FILE *fp;                     /* The file, if open */
+  gchar *Map;                   /* Where the file is mapped */
+  gsize MapLen;
+  guint32 Slots;                /* Number of slots in the mapped table */
+} AccountStore;
+
+static AccountStore Store;
+
+static guint32 NameHash(const gchar *Name)
+{
+  guint32 hash = 2166136261U;
+
+  for (; *Name; Name++) {
+    hash ^= (guchar)*Name;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/* 
+ * Returns the slot in the table at "map" holding the account called
+ * "Name", or the free slot where it would go.
+ */
+static AccountSlot *FindSlot(gchar *map, guint32 slots, const gchar *Name,
+                             guint32 hash)
+{
+  AccountSlot *table = SLOTS(map);
+  guint32 mask = slots - 1, i = hash & mask;
+
+  while (table[i].Name[0]
+         && (GUINT32_FROM_LE(table[i].Hash) != hash
+             || strncmp(table[i].Name, Name, ACCOUNTNAMELEN) != 0)) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+static void CloseStoreFile(void)
+{
+#ifdef ACCOUNT_STORE
+  if (Store.Map)
+    munmap(Store.Map, Store.MapLen);
+#endif
+  if (Store.fp)
+    fclose(Store.fp);
+  Store.Map = NULL;
+  Store.fp = NULL;
+  Store.Slots = 0;
+}
+
+#ifdef ACCOUNT_STORE
+/* 
+ * Opens "File" for reading and writing, creating it if necessary.
+ */
+static FILE *OpenAccountFile(const gchar *File, int flags)
+{
+  int fd = open(File, O_RDWR | O_CREAT | flags, 0644);
+  FILE *fp;
+
+  if (fd == -1)
+    return NULL;
+  fp = fdopen(fd, "r+");
+  if (!fp)
+    close(fd);
+  return fp;
+}
+
+/* 
+ * Maps the (locked) account file "fp" into memory. If the file is empty,
+ * it is first set up as a table of "newslots" free slots. Returns FALSE
+ * if the file cannot be mapped, or (with errno set to 0) if it is not an
+ * account file.
+ */
+static gboolean MapAccountFile(FILE *fp, guint32 newslots, gchar **map,
+                               gsize *maplen)
+{
+  struct stat st;
+  AccountHeader *hdr;
+  guint32 slots;
+  gboolean fresh = FALSE;
+  int fd = fileno(fp);
+
+  if (fstat(fd, &st) != 0)
+    return FALSE;
+  if (st.st_size == 0) {
+    if (ftruncate(fd, TABLESIZE(newslots)) != 0)
+      return FALSE;
+    st.st_size = TABLESIZE(newslots);
+    fresh = TRUE;
+  } else if (st.st_size < (off_t)sizeof(AccountHeader)) {
+    errno = 0;
+    return FALSE;
+  }
+
+  *maplen = st.st_size;
+  *map = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (*map == MAP_FAILED) {
+    *map = NULL;
+    return FALSE;
+  }
+  hdr = HEADER(*map);
+  if (fresh) {
+    memcpy(hdr->Magic, ACCOUNTMAGIC, sizeof(hdr->Magic));
+    hdr->Version = GUINT32_TO_LE(ACCOUNTVERSION);
+    hdr->Slots = GUINT32_TO_LE(newslots);
+  }
+  slots = GUINT32_FROM_LE(hdr->Slots);
+  if (memcmp(hdr->Magic, ACCOUNTMAGIC, sizeof(hdr->Magic)) != 0
+      || GUINT32_FROM_LE(hdr->Version) != ACCOUNTVERSION
+      || (slots & (slots - 1)) != 0 || TABLESIZE(slots) > *maplen) {
+    munmap(*map, *maplen);
+    *map = NULL;
+    errno = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+#endif /* ACCOUNT_STORE */
+
+/* 
+ * Opens the account file, if it is not already open, and takes a write
+ * lock on it. If the file has been replaced by a larger copy, the copy
+ * is opened instead. Returns FALSE on failure.
+ */
+static gboolean LockAccountStore(void)
+{
+#ifdef ACCOUNT_STORE
+  if (!Store.File)
+    return FALSE;
+  while (TRUE) {
+    if (!Store.fp) {
+      Store.fp = OpenAccountFile(Store.File, 0);
+      if (!Store.fp || WriteLock(Store.fp) != 0
+          || !MapAccountFile(Store.fp, MINACCOUNTSLOTS, &Store.Map,
+                             &Store.MapLen)) {
+        int err = errno;
+
+        CloseStoreFile();
+        errno = err;
+        return FALSE;
+      }
+    } else if (WriteLock(Store.fp) != 0) {
+      return FALSE;
+    }
+    Store.Slots = GUINT32_FROM_LE(HEADER(Store.Map)->Slots);
+    if (Store.Slots > 0)
+      return TRUE;
+    CloseStoreFile();
+  }
+#else
+  return FALSE;
+#endif
+}
+
+static void UnlockAccountStore(void)
+{
+  ReleaseLock(Store.fp);
+}
+
+/* 
+ * Replaces the (locked) account file with a copy with twice as many
+ * slots, and leaves the copy locked. Returns FALSE on failure, in which
+ * case the original file is still in use.
+ */
+static gboolean GrowAccountStore(void)
+{
+#ifdef ACCOUNT_STORE
+  gchar *newfile, *map = NULL;
+  gsize maplen = 0;
+  guint32 slots = Store.Slots * 2, i;
+  AccountSlot *table = SLOTS(Store.Map);
+  gboolean ok = FALSE;
+  FILE *fp;
+
+  newfile = g_strdup_printf("%s.new", Store.File);
+  fp = OpenAccountFile(newfile, O_TRUNC);
+  if (fp && WriteLock(fp) == 0 && MapAccountFile(fp, slots, &map, &maplen)) {
+    for (i = 0; i < Store.Slots; i++) {
+      if (table[i].Name[0]) {
+        *FindSlot(map, slots, table[i].Name,
+                  GUINT32_FROM_LE(table[i].Hash)) = table[i];
+      }
+    }
+    HEADER(map)->Used = HEADER(Store.Map)->Used;
+    ok = (msync(map, maplen, MS_SYNC) == 0
+          && rename(newfile, Store.File) == 0);
+  }
+
+  if (ok) {
+    HEADER(Store.Map)->Slots = 0;
+    msync(Store.Map, sizeof(AccountHeader), MS_SYNC);
+    CloseStoreFile();
+    Store.fp = fp;
+    Store.Map = map;
+    Store.MapLen = maplen;
+    Store.Slots = slots;
+  } else {
+    dopelog(0, LF_SERVER, _("Cannot enlarge account file %s: %s"),
+            Store.File, g_strerror(errno));
+    if (map)
+      munmap(map, maplen);
+    if (fp) {
+      fclose(fp);
+      unlink(newfile);
+    }
+  }
+  g_free(newfile);
+  return ok;
+#else
+  return FALSE;
+#endif
+}
+
+/* 
+ * Adds a new account called "Name" to the (locked) store, and returns
+ * its slot, or NULL if the table is full.
+ */
+static AccountSlot *AddAccount(const gchar *Name, guint32 hash)
+{
+  AccountSlot *slot;
+  guint32 used = GUINT32_FROM_LE(HEADER(Store.Map)->Used);
+
+  /* Keep going if the table cannot be enlarged, as long as there is
+   * still a free slot to end each search */
+  if ((used + 1) * 2 > Store.Slots && !GrowAccountStore()
+      && used + 2 > Store.Slots) {
+    return NULL;
+  }
+  slot = FindSlot(Store.Map, Store.Slots, Name, hash);
+  memset(slot, 0, sizeof(AccountSlot));
+  strncpy(slot->Name, Name, ACCOUNTNAMELEN);
+  slot->Hash = GUINT32_TO_LE(hash);
+  HEADER(Store.Map)->Used = GUINT32_TO_LE(used + 1);
+  return slot;
+}
+
+/* 
+ * Returns the slot of the account called "Name" in the (locked) store,
+ * adding the account if it does not exist and "Create" is TRUE.
+ */
+static AccountSlot *GetAccount(const gchar *Name, gboolean Create)
+{
+  guint32 hash = NameHash(Name);
+  AccountSlot *slot = FindSlot(Store.Map, Store.Slots, Name, hash);
+
+  if (slot->Name[0])
+    return slot;
+  else
+    return Create ? AddAccount(Name, hash) : NULL;
+}
+
+static void HashPassword(const gchar *Password, const guint8 *Salt,
+                         guint8 *Hash)
+{
+  GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+  gsize len = ACCOUNTHASHLEN;
+
+  g_checksum_update(sum, Salt, ACCOUNTSALTLEN);
+  g_checksum_update(sum, (const guchar *)Password, strlen(Password));
+  g_checksum_get_digest(sum, Hash, &len);
+  g_checksum_free(sum);
+}
+
+static void SetPassword(AccountSlot *slot, const gchar *Password)
+{
+  guint32 rnd;
+  int i;
+
+  for (i = 0; i < ACCOUNTSALTLEN; i += sizeof(rnd)) {
+    rnd = g_random_int();
+    memcpy(&slot->Salt[i], &rnd, sizeof(rnd));
+  }
+  HashPassword(Password, slot->Salt, slot->PassHash);
+  slot->Flags |= GUINT32_TO_LE(ACCOUNT_PASSWORD);
+}
+
+static gboolean CheckPassword(const AccountSlot *slot,
+                              const gchar *Password)
+{
+  guint8 hash[ACCOUNTHASHLEN], diff = 0;
+  int i;
+
+  HashPassword(Password, slot->Salt, hash);
+  for (i = 0; i < ACCOUNTHASHLEN; i++) {
+    diff |= hash[i] ^ slot->PassHash[i];
+  }
+  return diff == 0;
+}
+
+/* 
+ * Opens the account store kept in "File", creating it if necessary.
+ * Returns FALSE on failure, with errno set (to 0 if the file is not an
+ * account file).
+ */
+gboolean OpenAccountStore(const gchar *File)
+{
+#ifdef ACCOUNT_STORE
+  CloseAccountStore();
+  Store.File = g_strdup(File);
+  if (!LockAccountStore()) {
+    int err = errno;
+
+    CloseAccountStore();
+    errno = err;
+    return FALSE;
+  }
+  UnlockAccountStore();
+  return TRUE;
+#else
+  g_warning(_("Player accounts are not supported on this system"));
+  return TRUE;
+#endif
+}
+
+void CloseAccountStore(void)
+{
+#ifdef ACCOUNT_STORE
+  if (Store.Map)
+    msync(Store.Map, Store.MapLen, MS_SYNC);
+#endif
+  CloseStoreFile();
+  g_free(Store.File);
+  Store.File = NULL;
+}
+
+gboolean IsAccountStoreOpen(void)
+{
+  return Store.File != NULL;
+}
+
+/* 
+ * Logs in to the account called "Name", creating it if it does not yet
+ * exist. A password given when the account is created is set as its
+ * password, and an account with a password can then only be used by
+ * giving that password. An account created without one never gets one,
+ * so that it cannot be claimed by whoever happens to give one first.
+ */
+AccountLogin AccountLogIn(const gchar *Name, const gchar *Password)
+{
+  AccountSlot *slot;
+  AccountLogin result = ACCOUNT_OK;
+  guint32 hash;
+
+  if (strlen(Name) >= ACCOUNTNAMELEN || !LockAccountStore())
+    return ACCOUNT_NONE;
+  hash = NameHash(Name);
+  slot = FindSlot(Store.Map, Store.Slots, Name, hash);
+  if (!slot->Name[0]) {
+    slot = AddAccount(Name, hash);
+    result = ACCOUNT_NEW;
+    if (slot && Password && Password[0])
+      SetPassword(slot, Password);
+  } else if (!(GUINT32_FROM_LE(slot->Flags) & ACCOUNT_PASSWORD)) {
+    result = ACCOUNT_NOPASSWORD;
+  } else if (!Password || !CheckPassword(slot, Password)) {
+    result = ACCOUNT_BADPASSWORD;
+  }
+  if (!slot)
+    result = ACCOUNT_NONE;
+  UnlockAccountStore();
+  return result;
+}
+
+/* 
+ * Adds a finished game to the statistics of the account called "Name".
+ */
+void AccountFinishGame(const gchar *Name, price_t Worth, int Turns,
+                       gboolean Dead)
+{
+  AccountSlot *slot;
+  guint32 games;
+
+  if (strlen(Name) >= ACCOUNTNAMELEN || !LockAccountStore())
+    return;
+  slot = GetAccount(Name, TRUE);
+  if (slot) {
+    games = GUINT32_FROM_LE(slot->Games);
+    if (games == 0 || Worth > GINT64_FROM_LE(slot->BestWorth))
+      slot->BestWorth = GINT64_TO_LE((gint64)Worth);
+    slot->Games = GUINT32_TO_LE(games + 1);
+    if (Dead)
+      slot->Deaths = GUINT32_TO_LE(GUINT32_FROM_LE(slot->Deaths) + 1);
+    slot->Turns = GUINT64_TO_LE(GUINT64_FROM_LE(slot->Turns)
+                                + MAX(Turns, 0));
+    slot->LastPlayed = GINT64_TO_LE((gint64)time(NULL));
+  }
+  UnlockAccountStore();
+}
+
+/* 
+ * Fills in "stats" for the account called "Name". Returns FALSE if there
+ * is no such account.
+ */
+gboolean GetAccountStats(const gchar *Name, AccountStats *stats)
+{
+  AccountSlot *slot;
+
+  if (strlen(Name) >= ACCOUNTNAMELEN || !LockAccountStore())
+    return FALSE;
+  slot = GetAccount(Name, FALSE);
+  if (slot) {
+    stats->Games = GUINT32_FROM_LE(slot->Games);
+    stats->Deaths = GUINT32_FROM_LE(slot->Deaths);
+    stats->Turns = GUINT64_FROM_LE(slot->Turns);
+    stats->BestWorth = (price_t)GINT64_FROM_LE(slot->BestWorth);
+    stats->LastPlayed = GINT64_FROM_LE(slot->LastPlayed);
+    stats->HasPassword = (GUINT32_FROM_LE(slot->Flags) & ACCOUNT_PASSWORD)
+                         != 0;
+  }
+  UnlockAccountStore();
+  return slot != NULL;
+}
+
+guint CountAccounts(void)
+{
+  guint count;
+
+  if (!LockAccountStore())
+    return 0;
+  count = GUINT32_FROM_LE(HEADER(Store.Map)->Used);
+  UnlockAccountStore();
+  return count;
+}
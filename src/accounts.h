@@ -0,0 +1,65 @@
+/************************************************************************
+ * accounts.h     Header file for the server's player account store     *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_ACCOUNTS_H__
+#define __DP_ACCOUNTS_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include "dopewars.h"
+
+/* The result of logging in to an account */
+typedef enum {
+  ACCOUNT_NONE,                 /* No account store, or the name is too
+                                 * long to have an account */
+  ACCOUNT_OK,                   /* Logged in to an existing account
+                                 * with its password */
+  ACCOUNT_NOPASSWORD,           /* Logged in to an existing account
+                                 * that has no password */
+  ACCOUNT_NEW,                  /* A new account was created, with the
+                                 * password given (if any) */
+  ACCOUNT_BADPASSWORD           /* The account's password was not given */
+} AccountLogin;
+
+/* What is known about a player's past games */
+typedef struct _AccountStats {
+  guint Games;                  /* Games finished */
+  guint Deaths;                 /* Games that ended in death */
+  guint64 Turns;                /* Turns played, over all games */
+  price_t BestWorth;            /* Best final net worth */
+  gint64 LastPlayed;            /* When a game was last finished (or 0) */
+  gboolean HasPassword;         /* TRUE if the account is protected */
+} AccountStats;
+
+gboolean OpenAccountStore(const gchar *File);
+void CloseAccountStore(void);
+gboolean IsAccountStoreOpen(void);
+AccountLogin AccountLogIn(const gchar *Name, const gchar *Password);
+void AccountFinishGame(const gchar *Name, price_t Worth, int Turns,
+                       gboolean Dead);
+gboolean GetAccountStats(const gchar *Name, AccountStats *stats);
+guint CountAccounts(void);
+
+#endif /* __DP_ACCOUNTS_H__ */
@@ -0,0 +1,177 @@
+/************************************************************************
+ * admission.c    Per-host rate limiting of new server connections      *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "admission.h"
+#include "dopewars.h"
+#include "timers.h"
+
+/* 
+ * New connections from each host are limited by a token bucket, which
+ * holds up to AdmitBurst tokens and is refilled at AdmitRate tokens per
+ * minute; each connection uses up one token. No more than MaxHostClients
+ * connections from each host may be open at once. A zero AdmitBurst or
+ * MaxHostClients disables that limit.
+ */
+typedef struct _HostAdmission {
+  gdouble Tokens;               /* Connections the host can make now */
+  gint64 LastRefill;            /* When Tokens was last brought up to
+                                 * date (see TimerNow) */
+  gint Connections;             /* Currently open connections */
+} HostAdmission;
+
+static GHashTable *Hosts = NULL;
+static AdmissionStats Stats;
+
+/* How many connections to handle between sweeps of idle hosts */
+#define SWEEPINTERVAL 256
+static guint SinceSweep = 0;
+
+/* 
+ * Brings the host's token count up to date.
+ */
+static void RefillTokens(HostAdmission *ha, gint64 now)
+{
+  if (AdmitBurst > 0) {
+    ha->Tokens += (gdouble)(now - ha->LastRefill) * AdmitRate / 60000.0;
+    if (ha->Tokens > AdmitBurst)
+      ha->Tokens = AdmitBurst;
+  }
+  ha->LastRefill = now;
+}
+
+static gboolean IsIdleHost(gpointer key, gpointer value, gpointer data)
+{
+  HostAdmission *ha = (HostAdmission *)value;
+
+  RefillTokens(ha, *(gint64 *)data);
+  return ha->Connections == 0 && (AdmitBurst <= 0
+                                  || ha->Tokens >= AdmitBurst);
+}
+
+/* 
+ * Returns the limits of "host", creating them if necessary.
+ */
+static HostAdmission *GetHostAdmission(const gchar *host, gint64 now)
+{
+  HostAdmission *ha;
+
+  if (!Hosts) {
+    Hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  }
+
+  /* Hosts with no open connections and a full bucket can be forgotten,
+   * as a new entry for them would behave identically */
+  if (++SinceSweep >= SWEEPINTERVAL) {
+    SinceSweep = 0;
+    g_hash_table_foreach_remove(Hosts, IsIdleHost, &now);
+  }
+
+  ha = g_hash_table_lookup(Hosts, host);
+  if (!ha) {
+    ha = g_new(HostAdmission, 1);
+    ha->Tokens = AdmitBurst;
+    ha->LastRefill = now;
+    ha->Connections = 0;
+    g_hash_table_insert(Hosts, g_strdup(host), ha);
+  }
+  return ha;
+}
+
+/* 
+ * Decides whether a new connection from "host" (a printable address)
+ * should be accepted. If so, it is counted against the host's limits,
+ * and ReleaseConnection must be called when it is closed.
+ */
+gboolean AdmitConnection(const gchar *host)
+{
+  HostAdmission *ha;
+  gint64 now = TimerNow();
+
+  ha = GetHostAdmission(host, now);
+  RefillTokens(ha, now);
+
+  if (MaxHostClients > 0 && ha->Connections >= MaxHostClients) {
+    Stats.TooMany++;
+    return FALSE;
+  }
+  if (AdmitBurst > 0) {
+    if (ha->Tokens < 1.0) {
+      Stats.RateLimited++;
+      return FALSE;
+    }
+    ha->Tokens -= 1.0;
+  }
+  ha->Connections++;
+  Stats.Admitted++;
+  return TRUE;
+}
+
+/* 
+ * Counts a connection from "host" that was admitted elsewhere (e.g. by
+ * another server worker) without checking it against the limits.
+ * ReleaseConnection must be called when it is closed.
+ */
+void TrackConnection(const gchar *host)
+{
+  HostAdmission *ha;
+
+  ha = GetHostAdmission(host, TimerNow());
+  ha->Connections++;
+}
+
+/* 
+ * Notes that a connection from "host", previously accepted by
+ * AdmitConnection or TrackConnection, has been closed.
+ */
+void ReleaseConnection(const gchar *host)
+{
+  HostAdmission *ha;
+
+  if (!Hosts || !host)
+    return;
+  ha = g_hash_table_lookup(Hosts, host);
+  if (ha && ha->Connections > 0)
+    ha->Connections--;
+}
+
+void GetAdmissionStats(AdmissionStats *stats)
+{
+  *stats = Stats;
+  stats->Hosts = Hosts ? g_hash_table_size(Hosts) : 0;
+}
+
+/* 
+ * Forgets all hosts (e.g. when the server shuts down).
+ */
+void ClearAdmission(void)
+{
+  if (Hosts) {
+    g_hash_table_destroy(Hosts);
+    Hosts = NULL;
+  }
+}
@@ -0,0 +1,47 @@
+/************************************************************************
+ * admission.h    Header file for server connection admission control   *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_ADMISSION_H__
+#define __DP_ADMISSION_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+/* Counts of connections that have been admitted or refused */
+typedef struct _AdmissionStats {
+  guint Admitted;               /* Connections accepted */
+  guint RateLimited;            /* Refused; too many recent connections */
+  guint TooMany;                /* Refused; too many concurrent
+                                 * connections from one host */
+  guint Hosts;                  /* Hosts currently being tracked */
+} AdmissionStats;
+
+gboolean AdmitConnection(const gchar *host);
+void TrackConnection(const gchar *host);
+void ReleaseConnection(const gchar *host);
+void GetAdmissionStats(AdmissionStats *stats);
+void ClearAdmission(void);
+
+#endif /* __DP_ADMISSION_H__ */
@@ -563,6 +563,7 @@ static void DisplayConnectStatus(NetworkBuffer *netbuf,
 
   switch (status) {
   case NBS_PRECONNECT:
+  case NBS_RESOLVING:
     break;
   case NBS_SOCKSCONNECT:
     switch (sockstat) {
@@ -2475,6 +2476,8 @@ static void Curses_DoGame(Player *Play)
 
   InitAbilities(Play);
   SendAbilities(Play);
+  SendRoomChoice(Play);
+  SendAccountPassword(Play);
   StripTerminators(buf);
   SetPlayerName(Play, buf);
   SendNullClientMessage(Play, C_NONE, C_NAME, NULL, buf);
@@ -2574,9 +2577,8 @@ static void Curses_DoGame(Player *Play)
       if (justconnected) {
         /* Deal with any messages that came in while we were connect()ing */
         justconnected = FALSE;
-        while ((pt = GetWaitingPlayerMessage(Play)) != NULL) {
+        while ((pt = GetWaitingPlayerMessageView(Play)) != NULL) {
           HandleClientMessage(pt, Play);
-          g_free(pt);
         }
         if (QuitRequest)
           return;
@@ -2594,9 +2596,8 @@ static void Curses_DoGame(Player *Play)
     }
     if (Client) {
       if (RespondToSelect(&Play->NetBuf, &readfs, &writefs, NULL, &DoneOK)) {
-        while ((pt = GetWaitingPlayerMessage(Play)) != NULL) {
+        while ((pt = GetWaitingPlayerMessageView(Play)) != NULL) {
           HandleClientMessage(pt, Play);
-          g_free(pt);
         }
         if (QuitRequest)
           return;
@@ -45,6 +45,7 @@
 #include "convert.h"
 #include "dopewars.h"
 #include "admin.h"
+#include "gameroom.h"
 #include "log.h"
 #include "message.h"
 #include "nls.h"
@@ -82,6 +83,9 @@ int Port = 7902;
 gboolean Sanitized, ConfigVerbose, DrugValue, Antique = FALSE;
 gchar *HiScoreFile = NULL, *ServerName = NULL;
 gchar *ServerMOTD = NULL, *BindAddress = NULL, *PlayerName = NULL;
+gchar *RoomName = NULL;
+gchar *AccountFile = NULL, *AccountPassword = NULL, *SaveDir = NULL;
+gchar *RoomDir = NULL;
 
 struct DATE StartDate = {
   1, 12, 1984
@@ -110,7 +114,10 @@ Player Noone;
 int LoanSharkLoc, BankLoc, GunShopLoc, RoughPubLoc;
 int DrugSortMethod = DS_ATOZ;
 int FightTimeout = 5, IdleTimeout = 14400, ConnectTimeout = 300;
+int ScoreFlushDelay = 10;
 int MaxClients = 20, AITurnPause = 5;
+int AdmitBurst = 10, AdmitRate = 60, MaxHostClients = 10, ListenBacklog = 10;
+int MaxRooms = 50;
 price_t StartCash = 2000, StartDebt = 5500;
 GSList *ServerList = NULL;
 
@@ -247,6 +254,21 @@ struct GLOBALS Globals[] = {
   {NULL, NULL, NULL, &BindAddress, NULL, "BindAddress",
    N_("Network address for the server to listen on"), NULL, NULL, 0, "",
    NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &RoomName, NULL, "Room",
+   N_("Game room to join on the server (blank for the main game)"), NULL,
+   NULL, 0, "", NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &AccountPassword, NULL, "Password",
+   N_("Password for your player name's account on the server"), NULL,
+   NULL, 0, "", NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &AccountFile, NULL, "AccountFile",
+   N_("File in which the server keeps player accounts (blank for none)"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &SaveDir, NULL, "SaveDir",
+   N_("Directory in which the server saves players' games (blank for none)"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &RoomDir, NULL, "RoomDir",
+   N_("Directory holding game rooms' own settings and high scores"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
 #ifdef NETWORKING
   {NULL, &UseSocks, NULL, NULL, NULL, "Socks.Active",
    N_("TRUE if a SOCKS server should be used for networking"),
@@ -448,9 +470,27 @@ struct GLOBALS Globals[] = {
   {&ConnectTimeout, NULL, NULL, NULL, NULL, "ConnectTimeout",
    N_("Time in seconds for connections to be made or broken"),
    NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&ScoreFlushDelay, NULL, NULL, NULL, NULL, "ScoreFlushDelay",
+   N_("Seconds for which new high scores wait to be written to disk"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
   {&MaxClients, NULL, NULL, NULL, NULL, "MaxClients",
    N_("Maximum number of TCP/IP connections"),
    NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&MaxHostClients, NULL, NULL, NULL, NULL, "MaxHostClients",
+   N_("Maximum number of TCP/IP connections from each host"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&AdmitBurst, NULL, NULL, NULL, NULL, "AdmitBurst",
+   N_("No. of connections each host can make in quick succession"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&AdmitRate, NULL, NULL, NULL, NULL, "AdmitRate",
+   N_("No. of connections per minute each host can make in the long run"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&ListenBacklog, NULL, NULL, NULL, NULL, "ListenBacklog",
+   N_("Maximum number of connections waiting to be accepted"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 1, -1},
+  {&MaxRooms, NULL, NULL, NULL, NULL, "MaxRooms",
+   N_("Maximum number of game rooms, besides the main game"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
   {&AITurnPause, NULL, NULL, NULL, NULL, "AITurnPause",
    N_("Seconds between turns of AI players"),
    NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
@@ -834,45 +874,219 @@ int CountPlayers(GSList *First)
 }
 
 /* 
- * Adds the new Player structure "NewPlayer" to the linked list
- * pointed to by "First", and initializes all fields. Returns the new
- * start of the list. If this function is called by the server, then
- * it should pass the file descriptor of the socket used to
- * communicate with the client player.
+ * Index of the players in one list (FirstServer or FirstClient), so
+ * that players can be found by ID or name without walking the list.
+ * Every player in the list points to the same registry. Both tables
+ * map a key to a GSList of players, as IDs and names are not always
+ * unique (e.g. clients before they are told their IDs, or cops).
+ * Serials, unlike IDs, are never reused, so a (pointer, serial) pair
+ * can be checked in constant time even after the player is freed.
  */
-GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
+struct _PlayerRegistry {
+  GHashTable *ByID, *ByName, *BySerial;
+  GArray *FreeIDs;              /* IDs released by removed players */
+  guint NextID;                 /* Lowest never-allocated ID */
+  gint NumPlayers;
+};
+
+static guint NextPlayerSerial = 1;
+
+static PlayerRegistry *PlayerRegistryNew(void)
 {
-  Player *tmp;
-  GSList *list;
+  PlayerRegistry *reg = g_new(PlayerRegistry, 1);
+
+  reg->ByID = g_hash_table_new(g_direct_hash, g_direct_equal);
+  reg->ByName = NameIndexNew();
+  reg->BySerial = g_hash_table_new(g_direct_hash, g_direct_equal);
+  reg->FreeIDs = g_array_new(FALSE, FALSE, sizeof(guint));
+  reg->NextID = 0;
+  reg->NumPlayers = 0;
+  return reg;
+}
+
+static void PlayerRegistryFree(PlayerRegistry *reg)
+{
+  g_assert(reg->NumPlayers == 0);
+  g_hash_table_destroy(reg->ByID);
+  g_hash_table_destroy(reg->ByName);
+  g_hash_table_destroy(reg->BySerial);
+  g_array_free(reg->FreeIDs, TRUE);
+  g_free(reg);
+}
+
+static void RegisterID(PlayerRegistry *reg, Player *Play)
+{
+  gpointer key = GUINT_TO_POINTER(Play->ID);
+  GSList *bucket = g_hash_table_lookup(reg->ByID, key);
+
+  g_hash_table_insert(reg->ByID, key, g_slist_append(bucket, Play));
+}
+
+/* 
+ * Removes "Play" from the ID table. If no other player is using the
+ * ID, it is made available for reuse.
+ */
+static void UnregisterID(PlayerRegistry *reg, Player *Play)
+{
+  gpointer key = GUINT_TO_POINTER(Play->ID);
+  GSList *bucket = g_hash_table_lookup(reg->ByID, key);
+
+  bucket = g_slist_remove(bucket, Play);
+  if (bucket) {
+    g_hash_table_insert(reg->ByID, key, bucket);
+  } else {
+    g_hash_table_remove(reg->ByID, key);
+    if (Play->ID < reg->NextID)
+      g_array_append_val(reg->FreeIDs, Play->ID);
+  }
+}
+
+/* 
+ * Returns a new, empty index of players by name (used by the registry,
+ * and by each game room). Each value is a GSList of players, as names
+ * are not always unique (e.g. cops, or players in different rooms).
+ */
+GHashTable *NameIndexNew(void)
+{
+  return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+/* 
+ * Adds "Play" (if it has a name) to the name index "Index".
+ */
+void NameIndexAdd(GHashTable *Index, Player *Play)
+{
+  GSList *bucket;
+
+  if (!Play->Name || !Play->Name[0])
+    return;
+  bucket = g_hash_table_lookup(Index, Play->Name);
+  if (bucket) {
+    bucket = g_slist_append(bucket, Play);
+  } else {
+    g_hash_table_insert(Index, g_strdup(Play->Name),
+                        g_slist_append(NULL, Play));
+  }
+}
+
+/* 
+ * Removes "Play" from the name index "Index".
+ */
+void NameIndexRemove(GHashTable *Index, Player *Play)
+{
+  GSList *bucket;
+
+  if (!Play->Name || !Play->Name[0])
+    return;
+  bucket = g_hash_table_lookup(Index, Play->Name);
+  bucket = g_slist_remove(bucket, Play);
+  if (bucket) {
+    /* The head of the bucket may have changed, so store it again; the
+     * table keeps its existing copy of the key */
+    g_hash_table_insert(Index, g_strdup(Play->Name), bucket);
+  } else {
+    g_hash_table_remove(Index, Play->Name);
+  }
+}
+
+/* 
+ * Returns the (non-cop) player called "Name" in the name index "Index",
+ * or NULL if there is none.
+ */
+Player *NameIndexFind(GHashTable *Index, const gchar *Name)
+{
+  GSList *bucket;
+  Player *Play;
+
+  bucket = g_hash_table_lookup(Index, Name);
+  for (; bucket; bucket = g_slist_next(bucket)) {
+    Play = (Player *)bucket->data;
+    if (!IsCop(Play))
+      return Play;
+  }
+  return NULL;
+}
+
+/* 
+ * Returns an ID that no player in the registry is currently using,
+ * preferring IDs released by players that have since left.
+ */
+static guint AllocatePlayerID(PlayerRegistry *reg)
+{
+  guint ID;
+
+  while (reg->FreeIDs->len > 0) {
+    ID = g_array_index(reg->FreeIDs, guint, reg->FreeIDs->len - 1);
+    g_array_set_size(reg->FreeIDs, reg->FreeIDs->len - 1);
+    if (!g_hash_table_lookup(reg->ByID, GUINT_TO_POINTER(ID)))
+      return ID;
+  }
+  while (g_hash_table_lookup(reg->ByID, GUINT_TO_POINTER(reg->NextID)))
+    reg->NextID++;
+  return reg->NextID++;
+}
+
+/* 
+ * Allocates the inventories and date of player "Play", unless this
+ * has already been done.
+ */
+void AllocPlayerData(Player *Play)
+{
+  if (Play->date)
+    return;
+  Play->Guns = (Inventory *)g_malloc0(NumGun * sizeof(Inventory));
+  Play->Drugs = (Inventory *)g_malloc0(NumDrug * sizeof(Inventory));
+  Play->date = g_date_new_dmy(StartDate.day, StartDate.month,
+                              StartDate.year);
+}
+
+/* 
+ * Returns TRUE if player "Play" has had its inventories allocated.
+ */
+gboolean HasPlayerData(Player *Play)
+{
+  return (Play->date != NULL);
+}
+
+static GSList *DoAddPlayer(int fd, Player *NewPlayer, GSList *First,
+                           gboolean AllocData)
+{
+  PlayerRegistry *reg;
+
+  if (First)
+    reg = ((Player *)First->data)->Registry;
+  else
+    reg = PlayerRegistryNew();
 
-  list = First;
-  NewPlayer->ID = 0;
   /* Generate a unique player ID, if we're the server (clients get their
    * IDs from the server, so don't need to generate IDs) */
-  if (Server) {
-    while (list) {
-      tmp = (Player *)list->data;
-      if (tmp->ID == NewPlayer->ID) {
-        NewPlayer->ID++;
-        list = First;
-      } else {
-        list = g_slist_next(list);
-      }
-    }
-  }
+  NewPlayer->ID = Server ? AllocatePlayerID(reg) : 0;
+  NewPlayer->Registry = reg;
+  reg->NumPlayers++;
+  NewPlayer->Serial = NextPlayerSerial++;
+  if (NextPlayerSerial == 0)
+    NextPlayerSerial = 1;
+  NewPlayer->Room = NULL;
+  NewPlayer->Password = NULL;
+  NewPlayer->Authenticated = FALSE;
+  NewPlayer->SaveLock = NULL;
+  g_hash_table_insert(reg->BySerial, GUINT_TO_POINTER(NewPlayer->Serial),
+                      NewPlayer);
+  RegisterID(reg, NewPlayer);
   NewPlayer->Name = NULL;
   SetPlayerName(NewPlayer, NULL);
   NewPlayer->IsAt = 0;
   NewPlayer->EventNum = E_NONE;
-  NewPlayer->FightTimeout = NewPlayer->ConnectTimeout =
-      NewPlayer->IdleTimeout = 0;
-  NewPlayer->Guns = (Inventory *)g_malloc0(NumGun * sizeof(Inventory));
-  NewPlayer->Drugs = (Inventory *)g_malloc0(NumDrug * sizeof(Inventory));
+  TimerInit(&NewPlayer->FightTimer, NewPlayer);
+  TimerInit(&NewPlayer->IdleTimer, NewPlayer);
+  TimerInit(&NewPlayer->ConnectTimer, NewPlayer);
+  NewPlayer->Guns = NewPlayer->Drugs = NULL;
+  NewPlayer->date = NULL;
+  if (AllocData)
+    AllocPlayerData(NewPlayer);
   InitList(&(NewPlayer->SpyList));
   InitList(&(NewPlayer->TipList));
   NewPlayer->Turn = 1;
-  NewPlayer->date = g_date_new_dmy(StartDate.day, StartDate.month,
-                                   StartDate.year);
   NewPlayer->Cash = StartCash;
   NewPlayer->Debt = StartDebt;
   NewPlayer->Bank = 0;
@@ -888,11 +1102,37 @@ GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
     BindNetworkBufferToSocket(&NewPlayer->NetBuf, fd);
 #endif
   InitAbilities(NewPlayer);
+  NewPlayer->Shadow = NULL;
+  NewPlayer->ShadowLen = 0;
+  NewPlayer->UpdatePending = FALSE;
+  NewPlayer->DropPending = FALSE;
   NewPlayer->FightArray = NULL;
   NewPlayer->Attacking = NULL;
   return g_slist_append(First, (gpointer)NewPlayer);
 }
 
+/* 
+ * Adds the new Player structure "NewPlayer" to the linked list
+ * pointed to by "First", and initializes all fields. Returns the new
+ * start of the list. If this function is called by the server, then
+ * it should pass the file descriptor of the socket used to
+ * communicate with the client player.
+ */
+GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
+{
+  return DoAddPlayer(fd, NewPlayer, First, TRUE);
+}
+
+/* 
+ * As AddPlayer, but doesn't allocate the player's inventories until
+ * AllocPlayerData is called. Used by the server for connections that
+ * may never get as far as joining the game.
+ */
+GSList *AddPendingPlayer(int fd, Player *NewPlayer, GSList *First)
+{
+  return DoAddPlayer(fd, NewPlayer, First, FALSE);
+}
+
 /* 
  * Returns TRUE only if the given player has properly connected (i.e. has
  * a valid name).
@@ -907,6 +1147,8 @@ gboolean IsConnectedPlayer(Player *play)
  */
 void UpdatePlayer(Player *Play)
 {
+  if (!HasPlayerData(Play))
+    return;
   Play->Guns =
       (Inventory *)g_realloc(Play->Guns, NumGun * sizeof(Inventory));
   Play->Drugs =
@@ -924,16 +1166,30 @@ GSList *RemovePlayer(Player *Play, GSList *First)
   g_assert(First);
 
   First = g_slist_remove(First, (gpointer)Play);
+  DiscardPlayerData(Play);
+  LeaveGameRoom(Play);
+  UnregisterID(Play->Registry, Play);
+  NameIndexRemove(Play->Registry->ByName, Play);
+  g_hash_table_remove(Play->Registry->BySerial,
+                      GUINT_TO_POINTER(Play->Serial));
+  if (--Play->Registry->NumPlayers == 0)
+    PlayerRegistryFree(Play->Registry);
+  TimerCancel(&Play->FightTimer);
+  TimerCancel(&Play->IdleTimer);
+  TimerCancel(&Play->ConnectTimer);
 #ifdef NETWORKING
   if (!IsCop(Play))
     ShutdownNetworkBuffer(&Play->NetBuf);
 #endif
   ClearList(&(Play->SpyList));
   ClearList(&(Play->TipList));
-  g_date_free(Play->date);
+  if (Play->date)
+    g_date_free(Play->date);
   g_free(Play->Name);
+  g_free(Play->Password);
   g_free(Play->Guns);
   g_free(Play->Drugs);
+  g_free(Play->Shadow);
   g_free(Play);
   return First;
 }
@@ -955,8 +1211,7 @@ void CopyPlayer(Player *Dest, Player *Src)
   AddInventory(Dest->Drugs, Src->Drugs, NumDrug);
   Dest->CoatSize = Src->CoatSize;
   Dest->IsAt = Src->IsAt;
-  g_free(Dest->Name);
-  Dest->Name = g_strdup(Src->Name);
+  SetPlayerName(Dest, Src->Name);
   Dest->Bitches.Carried = Src->Bitches.Carried;
   Dest->Flags = Src->Flags;
 }
@@ -974,52 +1229,99 @@ char *GetPlayerName(Player *Play)
     return "";
 }
 
+/* 
+ * Sets the name of player "Play", keeping the registry of the player's
+ * list (if any) up to date.
+ */
 void SetPlayerName(Player *Play, char *Name)
 {
+  if (Play->Registry)
+    NameIndexRemove(Play->Registry->ByName, Play);
+  if (Play->Room)
+    NameIndexRemove(Play->Room->Names, Play);
   if (Play->Name)
     g_free(Play->Name);
   if (!Name)
     Play->Name = g_strdup("");
   else
     Play->Name = g_strdup(Name);
+  if (Play->Registry)
+    NameIndexAdd(Play->Registry->ByName, Play);
+  if (Play->Room)
+    NameIndexAdd(Play->Room->Names, Play);
 }
 
 /* 
- * Searches the linked list starting at "First" for a Player structure
- * with the given ID. Returns a pointer to this structure, or NULL if
- * no match can be found.
+ * Sets the ID of player "Play" (clients are told IDs by the server).
+ */
+void SetPlayerID(Player *Play, guint ID)
+{
+  if (Play->Registry)
+    UnregisterID(Play->Registry, Play);
+  Play->ID = ID;
+  if (Play->Registry)
+    RegisterID(Play->Registry, Play);
+}
+
+/* 
+ * Returns the Player structure with the given ID in the list starting
+ * at "First", or NULL if no match can be found.
  */
 Player *GetPlayerByID(guint ID, GSList *First)
 {
-  GSList *list;
-  Player *Play;
+  GSList *bucket;
 
-  for (list = First; list; list = g_slist_next(list)) {
-    Play = (Player *)list->data;
-    if (Play->ID == ID)
-      return Play;
-  }
-  return NULL;
+  if (!First)
+    return NULL;
+  bucket = g_hash_table_lookup(((Player *)First->data)->Registry->ByID,
+                               GUINT_TO_POINTER(ID));
+  return bucket ? (Player *)bucket->data : NULL;
 }
 
 /* 
- * Searches the linked list starting at "First" for a Player structure
- * with the name "Name". Returns a pointer to this structure, or NULL
- * if no match can be found.
+ * Returns TRUE if "Play" is still in the list starting at "First", and
+ * is the same player that had the given serial number. "Play" is not
+ * dereferenced, so it may point to a player that has since been freed.
  */
-Player *GetPlayerByName(char *Name, GSList *First)
+gboolean IsLivePlayer(Player *Play, guint Serial, GSList *First)
 {
-  GSList *list;
-  Player *Play;
+  if (!Play || !First)
+    return FALSE;
+  return g_hash_table_lookup(((Player *)First->data)->Registry->BySerial,
+                             GUINT_TO_POINTER(Serial)) == Play;
+}
 
+/* 
+ * Returns the (non-cop) Player structure with the name "Name" in the
+ * list starting at "First", or NULL if no match can be found.
+ */
+Player *GetPlayerByName(char *Name, GSList *First)
+{
   if (Name == NULL || Name[0] == 0)
     return &Noone;
-  for (list = First; list; list = g_slist_next(list)) {
-    Play = (Player *)list->data;
-    if (!IsCop(Play) && strcmp(GetPlayerName(Play), Name) == 0)
-      return Play;
+  if (!First)
+    return NULL;
+  return NameIndexFind(((Player *)First->data)->Registry->ByName, Name);
+}
+
+/* 
+ * Returns the number of (non-cop) players called "Name" in the list
+ * starting at "First" (e.g. in different game rooms).
+ */
+int CountPlayersByName(char *Name, GSList *First)
+{
+  GSList *bucket;
+  int count = 0;
+
+  if (Name == NULL || Name[0] == 0 || !First)
+    return 0;
+  bucket = g_hash_table_lookup(((Player *)First->data)->Registry->ByName,
+                               Name);
+  for (; bucket; bucket = g_slist_next(bucket)) {
+    if (!IsCop((Player *)bucket->data))
+      count++;
   }
-  return NULL;
+  return count;
 }
 
 /* 
@@ -1867,6 +2169,358 @@ static gboolean ReadConfigFile(char *FileName, gchar **encoding)
   }
 }
 
+/* 
+ * A copy of all of the variables in Globals. A game room with its own
+ * settings keeps them in a snapshot, which is swapped with the variables
+ * themselves while the room's players are being dealt with (see
+ * UseConfigSnapshot), so that the game code needs no changes.
+ */
+typedef enum {
+  CS_INT, CS_BOOL, CS_PRICE, CS_STRING, CS_STRINGLIST, CS_STRUCTLIST
+} ConfigSlotType;
+
+/* One variable (or list of structures) held in a snapshot */
+typedef struct _ConfigSlot {
+  gpointer Var;                 /* Address of the variable */
+  ConfigSlotType Type;
+  int Global;                   /* Index of (one of) its Globals entries */
+  int Length;                   /* For lists, the slot holding the length */
+} ConfigSlot;
+
+typedef union _ConfigValue {
+  int IntVal;
+  gboolean BoolVal;
+  price_t PriceVal;
+  gpointer Pt;                  /* A string, or a list */
+} ConfigValue;
+
+struct _ConfigSnapshot {
+  ConfigValue *Values;          /* One for each of ConfigSlots */
+};
+
+static ConfigSlot *ConfigSlots = NULL;
+static int NumConfigSlots = 0;
+
+/* The snapshot currently swapped with the variables, or NULL */
+static ConfigSnapshot *ActiveSnapshot = NULL;
+
+/* TRUE while a snapshot's configuration file is being read */
+static gboolean ReadingSnapshot = FALSE;
+
+/* Settings that belong to the server as a whole, rather than to any one
+ * game room; these are left out of snapshots */
+static gpointer ServerScopeVars[] = {
+  &Port, &BindAddress, &HiScoreFile, &AccountFile, &SaveDir, &RoomDir,
+  &MaxClients, &MaxRooms, &MaxHostClients, &AdmitBurst, &AdmitRate,
+  &ListenBacklog, &ConnectTimeout, &ScoreFlushDelay,
+  &Log.File, &Log.Level, &Log.Timestamp,
+#ifdef NETWORKING
+  &MetaServer.Active, &MetaServer.URL, &MetaServer.LocalName,
+  &MetaServer.Password, &MetaServer.Comment,
+#endif
+#ifdef CYGWIN
+  &MinToSysTray
+#else
+  &Daemonize
+#endif
+};
+
+/* 
+ * Returns TRUE if Globals[GlobalIndex] is one of the server-wide
+ * settings, which a game room cannot change.
+ */
+static gboolean IsServerScopeGlobal(int GlobalIndex)
+{
+  struct GLOBALS *glob = &Globals[GlobalIndex];
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS(ServerScopeVars); i++) {
+    if (ServerScopeVars[i] == (gpointer)glob->IntVal
+        || ServerScopeVars[i] == (gpointer)glob->BoolVal
+        || ServerScopeVars[i] == (gpointer)glob->StringVal) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static int FindConfigSlot(gpointer Var)
+{
+  int i;
+
+  for (i = 0; i < NumConfigSlots; i++) {
+    if (ConfigSlots[i].Var == Var)
+      return i;
+  }
+  return -1;
+}
+
+static void AddConfigSlot(gpointer Var, ConfigSlotType Type, int Global)
+{
+  ConfigSlot *slot;
+
+  /* Some variables have more than one name, but are only stored once */
+  if (FindConfigSlot(Var) >= 0)
+    return;
+  ConfigSlots = g_renew(ConfigSlot, ConfigSlots, NumConfigSlots + 1);
+  slot = &ConfigSlots[NumConfigSlots++];
+  slot->Var = Var;
+  slot->Type = Type;
+  slot->Global = Global;
+  slot->Length = -1;
+}
+
+/* 
+ * Works out which variables go in a snapshot, the first time that one is
+ * needed. Each list of structures (e.g. Location) is a single slot, and
+ * server-wide settings are left out.
+ */
+static void InitConfigSlots(void)
+{
+  int i;
+  ConfigSlot *slot;
+
+  if (ConfigSlots)
+    return;
+  for (i = 0; i < NUMGLOB; i++) {
+    if (IsServerScopeGlobal(i)) {
+      continue;
+    } else if (Globals[i].StructListPt) {
+      AddConfigSlot(Globals[i].StructListPt, CS_STRUCTLIST, i);
+    } else if (Globals[i].IntVal) {
+      AddConfigSlot(Globals[i].IntVal, CS_INT, i);
+    } else if (Globals[i].BoolVal) {
+      AddConfigSlot(Globals[i].BoolVal, CS_BOOL, i);
+    } else if (Globals[i].PriceVal) {
+      AddConfigSlot(Globals[i].PriceVal, CS_PRICE, i);
+    } else if (Globals[i].StringVal) {
+      AddConfigSlot(Globals[i].StringVal, CS_STRING, i);
+    } else if (Globals[i].StringList) {
+      AddConfigSlot(Globals[i].StringList, CS_STRINGLIST, i);
+    }
+  }
+  for (i = 0; i < NumConfigSlots; i++) {
+    slot = &ConfigSlots[i];
+    if (slot->Type == CS_STRINGLIST || slot->Type == CS_STRUCTLIST) {
+      slot->Length = FindConfigSlot(Globals[slot->Global].MaxIndex);
+      g_assert(slot->Length >= 0);
+    }
+  }
+}
+
+/* 
+ * Copies (if "Copy" is TRUE) or frees the strings in the "Num"
+ * structures at "List", which is a copy of the list in "slot".
+ */
+static void StructListStrings(ConfigSlot *slot, gpointer List, int Num,
+                              gboolean Copy)
+{
+  int i, j;
+  gsize offset;
+  gchar **str;
+
+  for (i = 0; i < NUMGLOB; i++) {
+    if (Globals[i].StructListPt != slot->Var || !Globals[i].StringVal)
+      continue;
+    offset = (gchar *)Globals[i].StringVal
+        - (gchar *)Globals[i].StructStaticPt;
+    for (j = 0; j < Num; j++) {
+      str = (gchar **)((gchar *)List + j * Globals[i].LenStruct + offset);
+      if (Copy)
+        *str = g_strdup(*str);
+      else
+        g_free(*str);
+    }
+  }
+}
+
+/* 
+ * Returns a new snapshot, holding a copy of the current configuration.
+ */
+static ConfigSnapshot *CopyConfigSnapshot(void)
+{
+  ConfigSnapshot *snap;
+  ConfigSlot *slot;
+  ConfigValue *val;
+  gchar **list;
+  int i, j, num;
+
+  InitConfigSlots();
+  snap = g_new(ConfigSnapshot, 1);
+  snap->Values = g_new(ConfigValue, NumConfigSlots);
+  for (i = 0; i < NumConfigSlots; i++) {
+    slot = &ConfigSlots[i];
+    val = &snap->Values[i];
+    switch (slot->Type) {
+    case CS_INT:
+      val->IntVal = *(int *)slot->Var;
+      break;
+    case CS_BOOL:
+      val->BoolVal = *(gboolean *)slot->Var;
+      break;
+    case CS_PRICE:
+      val->PriceVal = *(price_t *)slot->Var;
+      break;
+    case CS_STRING:
+      val->Pt = g_strdup(*(gchar **)slot->Var);
+      break;
+    case CS_STRINGLIST:
+      num = *Globals[slot->Global].MaxIndex;
+      list = g_new(gchar *, num);
+      for (j = 0; j < num; j++)
+        list[j] = g_strdup((*(gchar ***)slot->Var)[j]);
+      val->Pt = list;
+      break;
+    case CS_STRUCTLIST:
+      num = *Globals[slot->Global].MaxIndex;
+      val->Pt = g_malloc(num * Globals[slot->Global].LenStruct);
+      memcpy(val->Pt, *(gpointer *)slot->Var,
+             num * Globals[slot->Global].LenStruct);
+      StructListStrings(slot, val->Pt, num, TRUE);
+      break;
+    }
+  }
+  return snap;
+}
+
+/* 
+ * Exchanges the values in "snap" with those of the variables.
+ */
+static void SwapConfigSnapshot(ConfigSnapshot *snap)
+{
+  ConfigSlot *slot;
+  ConfigValue *val, old;
+  int i;
+
+  for (i = 0; i < NumConfigSlots; i++) {
+    slot = &ConfigSlots[i];
+    val = &snap->Values[i];
+    switch (slot->Type) {
+    case CS_INT:
+      old.IntVal = *(int *)slot->Var;
+      *(int *)slot->Var = val->IntVal;
+      break;
+    case CS_BOOL:
+      old.BoolVal = *(gboolean *)slot->Var;
+      *(gboolean *)slot->Var = val->BoolVal;
+      break;
+    case CS_PRICE:
+      old.PriceVal = *(price_t *)slot->Var;
+      *(price_t *)slot->Var = val->PriceVal;
+      break;
+    default:
+      old.Pt = *(gpointer *)slot->Var;
+      *(gpointer *)slot->Var = val->Pt;
+      break;
+    }
+    *val = old;
+  }
+}
+
+/* 
+ * Makes the configuration in "snap" (or, if it is NULL, the server's own
+ * configuration) the one in use, and returns the snapshot that was in
+ * use before. Swapping is cheap, as only pointers to strings and lists
+ * are exchanged.
+ */
+ConfigSnapshot *UseConfigSnapshot(ConfigSnapshot *snap)
+{
+  ConfigSnapshot *old = ActiveSnapshot;
+
+  if (snap == old)
+    return old;
+  if (old)
+    SwapConfigSnapshot(old);
+  if (snap)
+    SwapConfigSnapshot(snap);
+  ActiveSnapshot = snap;
+  return old;
+}
+
+/* 
+ * Returns a snapshot of the current configuration, as changed by the
+ * configuration file "FileName", or NULL if there is no such file. The
+ * configuration in use is not changed.
+ */
+ConfigSnapshot *ReadConfigSnapshot(gchar *FileName)
+{
+  ConfigSnapshot *snap, *old;
+  gboolean *modified, ok;
+  int i;
+
+  if (!g_file_test(FileName, G_FILE_TEST_IS_REGULAR))
+    return NULL;
+  old = UseConfigSnapshot(NULL);
+  snap = CopyConfigSnapshot();
+
+  /* Don't let the file's settings be written out by the "save" command */
+  modified = g_new(gboolean, NUMGLOB);
+  for (i = 0; i < NUMGLOB; i++)
+    modified[i] = Globals[i].Modified;
+
+  UseConfigSnapshot(snap);
+  ReadingSnapshot = TRUE;
+  ok = ReadConfigFile(FileName, NULL);
+  ReadingSnapshot = FALSE;
+  UseConfigSnapshot(old);
+
+  for (i = 0; i < NUMGLOB; i++)
+    Globals[i].Modified = modified[i];
+  g_free(modified);
+  if (!ok) {
+    FreeConfigSnapshot(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+/* 
+ * Frees a snapshot made by ReadConfigSnapshot. If it is in use, the
+ * server's own configuration is put back first.
+ */
+void FreeConfigSnapshot(ConfigSnapshot *snap)
+{
+  ConfigSlot *slot;
+  ConfigValue *val;
+  int i, j, num;
+
+  if (!snap)
+    return;
+  if (snap == ActiveSnapshot)
+    UseConfigSnapshot(NULL);
+  for (i = 0; i < NumConfigSlots; i++) {
+    slot = &ConfigSlots[i];
+    val = &snap->Values[i];
+    if (slot->Type == CS_STRING) {
+      g_free(val->Pt);
+    } else if (slot->Type == CS_STRINGLIST) {
+      num = snap->Values[slot->Length].IntVal;
+      for (j = 0; j < num; j++)
+        g_free(((gchar **)val->Pt)[j]);
+      g_free(val->Pt);
+    } else if (slot->Type == CS_STRUCTLIST) {
+      num = snap->Values[slot->Length].IntVal;
+      StructListStrings(slot, val->Pt, num, FALSE);
+      g_free(val->Pt);
+    }
+  }
+  g_free(snap->Values);
+  g_free(snap);
+}
+
+/* 
+ * Skips the rest of the current line of a configuration file.
+ */
+static void SkipConfigLine(GScanner *scanner)
+{
+  guint line = g_scanner_cur_line(scanner);
+
+  while (g_scanner_peek_next_token(scanner) != G_TOKEN_EOF
+         && scanner->next_line == line) {
+    g_scanner_get_next_token(scanner);
+  }
+}
+
 gboolean ParseNextConfig(GScanner *scanner, Converter *conv,
                          gchar **encoding, gboolean print)
 {
@@ -1953,7 +2607,11 @@ gboolean ParseNextConfig(GScanner *scanner, Converter *conv,
     PrintConfigValue(GlobalIndex, (int)ind, IndexGiven, scanner);
     return TRUE;
   } else if (token == G_TOKEN_EQUAL_SIGN) {
-    if (CountPlayers(FirstServer) > 0) {
+    if (ReadingSnapshot && IsServerScopeGlobal(GlobalIndex)) {
+      g_scanner_warn(scanner, _("%s cannot be set for a single game room "
+                                "- ignoring!"), Globals[GlobalIndex].Name);
+      SkipConfigLine(scanner);
+    } else if (CountPlayers(FirstServer) > 0 && !ReadingSnapshot) {
       g_warning(_("Configuration can only be changed interactively "
                   "when no\nplayers are logged on. Wait for all "
                   "players to log off, or remove\nthem with the "
@@ -2425,6 +3083,11 @@ static void SetupParameters(GSList *extraconfigs, gboolean antique)
   AssignName(&ServerName, "localhost");
   AssignName(&ServerMOTD, "");
   AssignName(&BindAddress, "");
+  AssignName(&RoomName, "");
+  AssignName(&AccountPassword, "");
+  AssignName(&AccountFile, "");
+  AssignName(&SaveDir, "");
+  AssignName(&RoomDir, "");
   AssignName(&OurWebBrowser, "/usr/bin/firefox");
 
   AssignName(&Sounds.FightHit, SNDPATH"colt.wav");
@@ -2588,6 +3251,7 @@ Drug dealing game based on \"Drug Wars\" by John E. Dell\n\
                             this file is read immediately when the -g option\n\
                             is encountered\n\
   -r, --pidfile=FILE      maintain pid file \"FILE\" while running the server\n\
+  -W, --workers=N         run the server as N processes sharing the same port\n\
   -l, --logfile=FILE      write log information to \"FILE\"\n\
   -A, --admin             connect to a locally-running server for administration\n\
   -c, --ai-player         create and run a computer player\n\
@@ -2624,6 +3288,7 @@ Drug dealing game based on \"Drug Wars\" by John E. Dell\n\
   -g file  specify the pathname of a dopewars configuration file; this file\n\
               is read immediately when the -g option is encountered\n\
   -r file  maintain pid file \"file\" while running the server\n\
+  -W n     run the server as n processes sharing the same port\n\
   -l file  write log information to \"file\"\n\
   -c       create and run a computer player\n\
   -w       force the use of a graphical (windowed) client (GTK+ or Win32)\n\
@@ -2645,7 +3310,7 @@ struct CMDLINE *ParseCmdLine(int argc, char *argv[])
 {
   int c;
   struct CMDLINE *cmdline = g_new0(struct CMDLINE, 1);
-  static const gchar *options = "anbchvf:o:sSp:g:r:wtC:l:NAu:P:";
+  static const gchar *options = "anbchvf:o:sSp:g:r:wtC:l:NAu:P:W:";
 
 #ifdef HAVE_GETOPT_LONG
   static const struct option long_options[] = {
@@ -2660,6 +3325,7 @@ struct CMDLINE *ParseCmdLine(int argc, char *argv[])
     {"port", required_argument, NULL, 'p'},
     {"configfile", required_argument, NULL, 'g'},
     {"pidfile", required_argument, NULL, 'r'},
+    {"workers", required_argument, NULL, 'W'},
     {"ai-player", no_argument, NULL, 'c'},
     {"windowed-client", no_argument, NULL, 'w'},
     {"text-client", no_argument, NULL, 't'},
@@ -2736,6 +3402,9 @@ struct CMDLINE *ParseCmdLine(int argc, char *argv[])
     case 'l':
       AssignName(&cmdline->logfile, optarg);
       break;
+    case 'W':
+      cmdline->workers = atoi(optarg);
+      break;
     case 'u':
       AssignName(&cmdline->plugin, optarg);
       break;
@@ -46,6 +46,7 @@
 #include "convert.h"
 #include "error.h"
 #include "network.h"
+#include "timers.h"
 #include "util.h"
 
 /* Make price_t be a long long if the type is supported by the compiler */
@@ -71,6 +72,8 @@ typedef enum {
                                  * UTF-8 (Unicode) encoding */
   A_DATE,                       /* We can understand "proper" dd-mm-yy dates
                                  * rather than just turn numbers */
+  A_DELTAUPDATE,                /* C_UPDATE messages about the player
+                                 * itself contain only changed fields */
   A_NUM                         /* N.B. Must be last */
 } AbilType;
 
@@ -177,7 +180,8 @@ extern int NumLocation, NumGun, NumCop, NumDrug, NumSubway, NumPlaying,
            NumStoppedTo;
 extern int DebtInterest, BankInterest;
 extern gchar *HiScoreFile, *ServerName, *ConvertFile, *ServerMOTD,
-	     *BindAddress, *PlayerName;
+	     *BindAddress, *PlayerName, *RoomName, *AccountFile,
+	     *AccountPassword, *SaveDir, *RoomDir;
 #ifdef CYGWIN
 extern gboolean MinToSysTray;
 #else
@@ -186,7 +190,10 @@ extern gboolean Daemonize;
 extern gchar *OurWebBrowser;
 extern int LoanSharkLoc, BankLoc, GunShopLoc, RoughPubLoc;
 extern int DrugSortMethod, FightTimeout, IdleTimeout, ConnectTimeout;
+extern int ScoreFlushDelay;
 extern int MaxClients, AITurnPause;
+extern int AdmitBurst, AdmitRate, MaxHostClients, ListenBacklog;
+extern int MaxRooms;
 extern struct CURRENCY Currency;
 extern struct PRICES Prices;
 extern struct BITCH Bitch;
@@ -274,6 +281,10 @@ typedef struct INVENTORY Inventory;
 
 struct PLAYER_T;
 typedef struct PLAYER_T Player;
+typedef struct _PlayerRegistry PlayerRegistry;
+typedef struct _GameRoom GameRoom;
+typedef struct _ConfigSnapshot ConfigSnapshot;
+typedef struct _ScoreTable ScoreTable;
 
 struct TDopeEntry {
   Player *Play;
@@ -289,6 +300,16 @@ typedef struct TDopeList DopeList;
 
 struct PLAYER_T {
   guint ID;
+  PlayerRegistry *Registry;      /* Index of the list this player is in */
+  guint Serial;                 /* Never reused, unlike ID */
+  GameRoom *Room;               /* On the server, the game this player
+                                 * is in (NULL until they log in) */
+  gchar *Password;              /* On the server, the account password
+                                 * sent before logging in (if any) */
+  gboolean Authenticated;       /* On the server, TRUE if the player gave
+                                 * their account's password */
+  FILE *SaveLock;               /* On the server, the claim on the
+                                 * player's saved game (if they have it) */
   int Turn;
   GDate *date;
   price_t Cash, Debt, Bank;
@@ -299,19 +320,28 @@ struct PLAYER_T {
   gchar *Name;
   Inventory *Guns, *Drugs, Bitches;
   EventCode EventNum, ResyncNum;
-  time_t FightTimeout, IdleTimeout, ConnectTimeout;
+  Timer FightTimer, IdleTimer, ConnectTimer;
   guint tiebreak;
   price_t DocPrice;
   DopeList SpyList, TipList;
   Player *OnBehalfOf;
+  guint OnBehalfOfSerial;
 #ifdef NETWORKING
   NetworkBuffer NetBuf;
 #endif
   Abilities Abil;
+  price_t *Shadow;              /* The player data last sent to the client,
+                                 * if it has the A_DELTAUPDATE ability */
+  gint ShadowLen;
+  gboolean UpdatePending;       /* TRUE if SendPlayerData has been called
+                                 * but the update not yet sent */
+  gboolean DropPending;         /* TRUE if the write buffer filled, and the
+                                 * player is waiting to be dropped */
   GPtrArray *FightArray;        /* If non-NULL, a list of players
                                  * in a fight */
   Player *Attacking;            /* The player that this player
                                  * is attacking */
+  guint AttackingSerial;
   gint CopIndex;                /* if >0, then this player is a cop,
                                  * described by Cop[CopIndex-1];
                                  * if ==0, this is a normal player that
@@ -356,6 +386,7 @@ struct CMDLINE {
   gchar *scorefile, *servername, *pidfile, *logfile, *plugin, *convertfile;
   gchar *playername;
   unsigned port;
+  gint workers;
   ClientType client;
   GSList *configs;
 };  
@@ -375,9 +406,18 @@ extern gboolean LocaleIsUTF8;
 
 GSList *RemovePlayer(Player *Play, GSList *First);
 Player *GetPlayerByID(guint ID, GSList *First);
+GHashTable *NameIndexNew(void);
+void NameIndexAdd(GHashTable *Index, Player *Play);
+void NameIndexRemove(GHashTable *Index, Player *Play);
+Player *NameIndexFind(GHashTable *Index, const gchar *Name);
 Player *GetPlayerByName(gchar *Name, GSList *First);
+int CountPlayersByName(gchar *Name, GSList *First);
+gboolean IsLivePlayer(Player *Play, guint Serial, GSList *First);
 int CountPlayers(GSList *First);
 GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First);
+GSList *AddPendingPlayer(int fd, Player *NewPlayer, GSList *First);
+void AllocPlayerData(Player *Play);
+gboolean HasPlayerData(Player *Play);
 void UpdatePlayer(Player *Play);
 void CopyPlayer(Player *Dest, Player *Src);
 void ClearInventory(Inventory *Guns, Inventory *Drugs);
@@ -425,6 +465,7 @@ gchar *InitialCaps(gchar *string);
 char StartsWithVowel(char *string);
 char *GetPlayerName(Player *Play);
 void SetPlayerName(Player *Play, char *Name);
+void SetPlayerID(Player *Play, guint ID);
 struct CMDLINE *ParseCmdLine(int argc, char *argv[]);
 void FreeCmdLine(struct CMDLINE *cmdline);
 void InitConfiguration(struct CMDLINE *cmdline);
@@ -447,6 +488,9 @@ void GetDateString(GString *str, Player *Play);
 void ScannerErrorHandler(GScanner *scanner, gchar *msg, gint error);
 gboolean IsConnectedPlayer(Player *play);
 void BackupConfig(void);
+ConfigSnapshot *ReadConfigSnapshot(gchar *FileName);
+void FreeConfigSnapshot(ConfigSnapshot *snap);
+ConfigSnapshot *UseConfigSnapshot(ConfigSnapshot *snap);
 gchar *GetDocRoot(void);
 gchar *GetDocIndex(void);
 gchar *GetGlobalConfigFile(void);
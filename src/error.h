@@ -47,6 +47,9 @@ extern ErrorType *ET_CUSTOM, *ET_ERRNO;
 extern ErrorType *ET_WIN32, *ET_WINSOCK;
 #else
 extern ErrorType *ET_HERRNO;
+#ifdef HAVE_GETADDRINFO
+extern ErrorType *ET_GAI;
+#endif
 #endif
 
 typedef enum {
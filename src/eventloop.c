@@ -0,0 +1,514 @@
+/************************************************************************
+ * eventloop.c    Socket event loop for the dopewars server             *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef NETWORKING
+
+#ifdef CYGWIN
+#include <winsock2.h>           /* For select() */
+#include <windows.h>
+#else
+#include <sys/types.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>          /* For epoll_create() etc. */
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>             /* For close() */
+#endif
+#endif /* CYGWIN */
+
+#include <glib.h>
+#include <errno.h>              /* For errno */
+#include <stdio.h>              /* For perror() */
+
+#include "eventloop.h"
+#include "network.h"
+
+/* A descriptor that the event loop is watching */
+typedef struct _EventWatch {
+  int fd;
+  guint serial;                 /* Distinguishes successive users of
+                                 * the same descriptor */
+  gboolean Read, Write;         /* Conditions we're interested in */
+  EventFunc func;               /* Function to call when ready */
+  gpointer data;                /* Data to pass to the above function */
+} EventWatch;
+
+/* A descriptor reported ready by the last EventLoopWait() */
+typedef struct _EventReady {
+  int fd;
+  guint serial;
+  gboolean Read, Write, Exception;
+} EventReady;
+
+typedef enum {
+  EO_ADD, EO_MODIFY, EO_REMOVE
+} EventOp;
+
+/* The operations an event loop backend must provide */
+typedef struct _EventBackend {
+  const gchar *name;
+  gboolean (*init) (EventLoop *loop);
+  void (*free) (EventLoop *loop);
+  gboolean (*canwatch) (EventLoop *loop, int fd);
+  void (*update) (EventLoop *loop, EventWatch *watch, EventOp op);
+  int (*wait) (EventLoop *loop, CURLM *multi, long timeout_ms);
+} EventBackend;
+
+struct _EventLoop {
+  const EventBackend *backend;
+  GPtrArray *watches;           /* EventWatch structures, indexed by fd */
+  guint serial;                 /* Serial number of the last new watch */
+  GArray *ready;                /* Results of the last EventLoopWait() */
+
+  /* select() backend state */
+  fd_set readfs, writefs, errorfs;
+  int topsock;
+  int numselect;                /* Number of descriptors in the sets */
+
+#ifdef HAVE_SYS_EPOLL_H
+  /* epoll backend state */
+  int epfd;
+  struct epoll_event *events;
+  int maxevents;
+#endif
+};
+
+static EventWatch *GetWatch(EventLoop *loop, int fd)
+{
+  if (fd < 0 || fd >= loop->watches->len)
+    return NULL;
+  return (EventWatch *)g_ptr_array_index(loop->watches, fd);
+}
+
+static void AddReady(EventLoop *loop, int fd, guint serial, gboolean Read,
+                     gboolean Write, gboolean Exception)
+{
+  EventReady ready;
+
+  ready.fd = fd;
+  ready.serial = serial;
+  ready.Read = Read;
+  ready.Write = Write;
+  ready.Exception = Exception;
+  g_array_append_val(loop->ready, ready);
+}
+
+/*
+ * The portable backend. The descriptor sets are kept up to date as
+ * watches change, so they need only be copied (not rebuilt) before
+ * each select() call. Waking up is still O(n) in the highest
+ * descriptor, and descriptors are limited to FD_SETSIZE.
+ */
+static gboolean SelectInit(EventLoop *loop)
+{
+  FD_ZERO(&loop->readfs);
+  FD_ZERO(&loop->writefs);
+  FD_ZERO(&loop->errorfs);
+  loop->topsock = 0;
+  loop->numselect = 0;
+  return TRUE;
+}
+
+static void SelectFree(EventLoop *loop)
+{
+}
+
+/*
+ * An fd_set is a bitmap of FD_SETSIZE descriptors on Unix, so larger
+ * descriptors cannot be watched at all; on Windows it is instead an
+ * array of up to FD_SETSIZE sockets.
+ */
+static gboolean SelectCanWatch(EventLoop *loop, int fd)
+{
+#ifdef CYGWIN
+  return GetWatch(loop, fd) || loop->numselect < FD_SETSIZE;
+#else
+  return fd < FD_SETSIZE;
+#endif
+}
+
+static void SelectUpdate(EventLoop *loop, EventWatch *watch, EventOp op)
+{
+  int fd = watch->fd;
+
+  FD_CLR(fd, &loop->readfs);
+  FD_CLR(fd, &loop->writefs);
+  FD_CLR(fd, &loop->errorfs);
+  if (op == EO_ADD) {
+    loop->numselect++;
+  } else if (op == EO_REMOVE) {
+    loop->numselect--;
+    if (fd + 1 == loop->topsock) {
+      do {
+        loop->topsock--;
+      } while (loop->topsock > 0 && !GetWatch(loop, loop->topsock - 1));
+    }
+    return;
+  }
+  if (watch->Read)
+    FD_SET(fd, &loop->readfs);
+  if (watch->Write)
+    FD_SET(fd, &loop->writefs);
+  FD_SET(fd, &loop->errorfs);
+  loop->topsock = MAX(loop->topsock, fd + 1);
+}
+
+static int SelectWait(EventLoop *loop, CURLM *multi, long timeout_ms)
+{
+  fd_set readfs, writefs, errorfs;
+  struct timeval timeout;
+  int topsock, curlsock = -1, fd, retval;
+
+  readfs = loop->readfs;
+  writefs = loop->writefs;
+  errorfs = loop->errorfs;
+  if (multi) {
+    curl_multi_fdset(multi, &readfs, &writefs, &errorfs, &curlsock);
+  }
+  topsock = MAX(loop->topsock, curlsock + 1);
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  }
+  retval = select(topsock, &readfs, &writefs, &errorfs,
+                  timeout_ms >= 0 ? &timeout : NULL);
+  if (retval <= 0)
+    return retval;
+
+  for (fd = 0; fd < loop->topsock; fd++) {
+    EventWatch *watch = GetWatch(loop, fd);
+
+    if (watch && (FD_ISSET(fd, &readfs) || FD_ISSET(fd, &writefs)
+                  || FD_ISSET(fd, &errorfs))) {
+      AddReady(loop, fd, watch->serial, FD_ISSET(fd, &readfs),
+               FD_ISSET(fd, &writefs), FD_ISSET(fd, &errorfs));
+    }
+  }
+  return retval;
+}
+
+static const EventBackend SelectBackend = {
+  "select", SelectInit, SelectFree, SelectCanWatch, SelectUpdate,
+  SelectWait
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * The Linux backend. Each descriptor is registered with the kernel
+ * once, and modified only when its write interest changes, so waking
+ * up costs only as much as the number of descriptors that are ready.
+ */
+#define EPOLL_DATA(fd, serial) (((guint64)(serial) << 32) | (guint32)(fd))
+
+static gboolean EpollInit(EventLoop *loop)
+{
+  loop->epfd = epoll_create(64);
+  if (loop->epfd == -1) {
+    perror("epoll_create");
+    return FALSE;
+  }
+  loop->maxevents = 64;
+  loop->events = g_new(struct epoll_event, loop->maxevents);
+  return TRUE;
+}
+
+static void EpollFree(EventLoop *loop)
+{
+  close(loop->epfd);
+  g_free(loop->events);
+}
+
+static void EpollUpdate(EventLoop *loop, EventWatch *watch, EventOp op)
+{
+  struct epoll_event ev;
+
+  ev.events = (watch->Read ? EPOLLIN : 0) | (watch->Write ? EPOLLOUT : 0);
+  ev.data.u64 = EPOLL_DATA(watch->fd, watch->serial);
+  if (epoll_ctl(loop->epfd, op == EO_ADD ? EPOLL_CTL_ADD :
+                op == EO_MODIFY ? EPOLL_CTL_MOD : EPOLL_CTL_DEL,
+                watch->fd, &ev) == -1) {
+    perror("epoll_ctl");
+  }
+}
+
+/*
+ * Temporarily registers any descriptors that curl wants watched. These
+ * get serial number 0, which no watch ever has, so they are never
+ * dispatched; the caller drives curl itself after the wait.
+ */
+static GArray *EpollAddCurl(EventLoop *loop, CURLM *multi)
+{
+  fd_set readfs, writefs, errorfs;
+  int curlsock = -1, fd;
+  GArray *curlfds;
+  struct epoll_event ev;
+
+  FD_ZERO(&readfs);
+  FD_ZERO(&writefs);
+  FD_ZERO(&errorfs);
+  curl_multi_fdset(multi, &readfs, &writefs, &errorfs, &curlsock);
+  curlfds = g_array_new(FALSE, FALSE, sizeof(int));
+  for (fd = 0; fd <= curlsock; fd++) {
+    ev.events = (FD_ISSET(fd, &readfs) ? EPOLLIN : 0)
+        | (FD_ISSET(fd, &writefs) ? EPOLLOUT : 0);
+    ev.data.u64 = EPOLL_DATA(fd, 0);
+    if (ev.events && !GetWatch(loop, fd)
+        && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+      g_array_append_val(curlfds, fd);
+    }
+  }
+  return curlfds;
+}
+
+static void EpollRemoveCurl(EventLoop *loop, GArray *curlfds)
+{
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < curlfds->len; i++) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, g_array_index(curlfds, int, i),
+              &ev);
+  }
+  g_array_free(curlfds, TRUE);
+}
+
+static int EpollWait(EventLoop *loop, CURLM *multi, long timeout_ms)
+{
+  GArray *curlfds = NULL;
+  int i, nev, saveerr;
+
+  if (multi) {
+    curlfds = EpollAddCurl(loop, multi);
+  }
+  nev = epoll_wait(loop->epfd, loop->events, loop->maxevents,
+                   timeout_ms >= 0 ? (int)timeout_ms : -1);
+  saveerr = errno;
+  if (curlfds) {
+    EpollRemoveCurl(loop, curlfds);
+  }
+  if (nev == -1) {
+    errno = saveerr;
+    return -1;
+  }
+
+  for (i = 0; i < nev; i++) {
+    guint32 events = loop->events[i].events;
+    guint64 data = loop->events[i].data.u64;
+
+    /* A hangup is reported as readable, so the following read sees EOF */
+    AddReady(loop, (int)(data & 0xFFFFFFFF), (guint)(data >> 32),
+             (events & (EPOLLIN | EPOLLHUP)) != 0,
+             (events & EPOLLOUT) != 0, (events & EPOLLERR) != 0);
+  }
+
+  /* If we filled the event array, make room for more next time */
+  if (nev == loop->maxevents) {
+    loop->maxevents *= 2;
+    loop->events = g_renew(struct epoll_event, loop->events,
+                           loop->maxevents);
+  }
+  return nev;
+}
+
+static const EventBackend EpollBackend = {
+  "epoll", EpollInit, EpollFree, NULL, EpollUpdate, EpollWait
+};
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* Available backends, in order of preference */
+static const EventBackend *Backends[] = {
+#ifdef HAVE_SYS_EPOLL_H
+  &EpollBackend,
+#endif
+  &SelectBackend
+};
+
+/*
+ * Creates a new event loop. If "backend" is non-NULL and names an
+ * available backend, that is used; otherwise the best available backend
+ * that can be initialized is chosen.
+ */
+EventLoop *EventLoopNew(const gchar *backend)
+{
+  EventLoop *loop;
+  int i, first = 0;
+
+  loop = g_new0(EventLoop, 1);
+  loop->watches = g_ptr_array_new();
+  loop->ready = g_array_new(FALSE, FALSE, sizeof(EventReady));
+
+  if (backend) {
+    for (i = 0; i < G_N_ELEMENTS(Backends); i++) {
+      if (g_ascii_strcasecmp(Backends[i]->name, backend) == 0) {
+        first = i;
+        break;
+      }
+    }
+  }
+  for (i = first; i < G_N_ELEMENTS(Backends); i++) {
+    if (Backends[i]->init(loop)) {
+      loop->backend = Backends[i];
+      break;
+    }
+  }
+  /* select() always initializes OK, so we must have a backend by now */
+  g_assert(loop->backend);
+  return loop;
+}
+
+/*
+ * Frees the event loop and all of its watches. The watched descriptors
+ * themselves are not closed.
+ */
+void EventLoopFree(EventLoop *loop)
+{
+  int fd;
+
+  for (fd = 0; fd < loop->watches->len; fd++) {
+    g_free(g_ptr_array_index(loop->watches, fd));
+  }
+  loop->backend->free(loop);
+  g_ptr_array_free(loop->watches, TRUE);
+  g_array_free(loop->ready, TRUE);
+  g_free(loop);
+}
+
+const gchar *EventLoopBackendName(EventLoop *loop)
+{
+  return loop->backend->name;
+}
+
+/*
+ * Returns TRUE if descriptor "fd" can be watched by the event loop. The
+ * select() backend cannot watch more than FD_SETSIZE descriptors, so new
+ * connections should be checked with this and refused if it fails.
+ */
+gboolean EventLoopCanWatch(EventLoop *loop, int fd)
+{
+  return fd >= 0 && (!loop->backend->canwatch
+                     || loop->backend->canwatch(loop, fd));
+}
+
+/*
+ * Starts (or changes) the watch on descriptor "fd". When it becomes
+ * readable and/or writable (as requested by "Read" and "Write")
+ * EventLoopDispatch() will call "func". Errors are always reported. If
+ * neither "Read" nor "Write" is set, the watch is removed. Nothing is
+ * passed to the backend unless the requested conditions have changed.
+ * Returns FALSE (and watches nothing) if "fd" cannot be watched; see
+ * EventLoopCanWatch().
+ */
+gboolean EventLoopWatch(EventLoop *loop, int fd, gboolean Read,
+                        gboolean Write, EventFunc func, gpointer data)
+{
+  EventWatch *watch;
+
+  if (!Read && !Write) {
+    EventLoopUnwatch(loop, fd);
+    return TRUE;
+  }
+  if (!EventLoopCanWatch(loop, fd))
+    return FALSE;
+  if (fd >= loop->watches->len) {
+    g_ptr_array_set_size(loop->watches, fd + 1);
+  }
+
+  watch = GetWatch(loop, fd);
+  if (watch) {
+    watch->func = func;
+    watch->data = data;
+    if (watch->Read != Read || watch->Write != Write) {
+      watch->Read = Read;
+      watch->Write = Write;
+      loop->backend->update(loop, watch, EO_MODIFY);
+    }
+  } else {
+    watch = g_new(EventWatch, 1);
+    watch->fd = fd;
+    if (++loop->serial == 0) {
+      loop->serial++;
+    }
+    watch->serial = loop->serial;
+    watch->Read = Read;
+    watch->Write = Write;
+    watch->func = func;
+    watch->data = data;
+    g_ptr_array_index(loop->watches, fd) = watch;
+    loop->backend->update(loop, watch, EO_ADD);
+  }
+  return TRUE;
+}
+
+/*
+ * Stops watching descriptor "fd". This must be called before the
+ * descriptor is closed.
+ */
+void EventLoopUnwatch(EventLoop *loop, int fd)
+{
+  EventWatch *watch;
+
+  watch = GetWatch(loop, fd);
+  if (watch) {
+    g_ptr_array_index(loop->watches, fd) = NULL;
+    loop->backend->update(loop, watch, EO_REMOVE);
+    g_free(watch);
+  }
+}
+
+/*
+ * Waits for up to "timeout_ms" milliseconds (or forever, if negative)
+ * for any watched descriptor to become ready. If "multi" is non-NULL,
+ * the descriptors of that curl handle are also waited on. Returns -1
+ * on error (with errno set), or else the number of ready descriptors.
+ */
+int EventLoopWait(EventLoop *loop, CURLM *multi, long timeout_ms)
+{
+  g_array_set_size(loop->ready, 0);
+  return loop->backend->wait(loop, multi, timeout_ms);
+}
+
+/*
+ * Calls the functions for all descriptors found ready by the last
+ * EventLoopWait(). The functions are free to add or remove watches;
+ * any watch removed (or replaced) before its turn is not called.
+ */
+void EventLoopDispatch(EventLoop *loop)
+{
+  int i;
+
+  for (i = 0; i < loop->ready->len; i++) {
+    EventReady *ready = &g_array_index(loop->ready, EventReady, i);
+    EventWatch *watch = GetWatch(loop, ready->fd);
+
+    if (watch && watch->serial == ready->serial) {
+      watch->func(ready->fd, ready->Read, ready->Write, ready->Exception,
+                  watch->data);
+    }
+  }
+  g_array_set_size(loop->ready, 0);
+}
+
+#endif /* NETWORKING */
@@ -0,0 +1,54 @@
+/************************************************************************
+ * eventloop.h    Header file for the server's socket event loop        *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_EVENTLOOP_H__
+#define __DP_EVENTLOOP_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "network.h"
+
+#ifdef NETWORKING
+
+typedef struct _EventLoop EventLoop;
+
+/* Called when a watched descriptor is ready for reading and/or writing */
+typedef void (*EventFunc) (int fd, gboolean Read, gboolean Write,
+                           gboolean Exception, gpointer data);
+
+EventLoop *EventLoopNew(const gchar *backend);
+void EventLoopFree(EventLoop *loop);
+const gchar *EventLoopBackendName(EventLoop *loop);
+gboolean EventLoopCanWatch(EventLoop *loop, int fd);
+gboolean EventLoopWatch(EventLoop *loop, int fd, gboolean Read,
+                        gboolean Write, EventFunc func, gpointer data);
+void EventLoopUnwatch(EventLoop *loop, int fd);
+int EventLoopWait(EventLoop *loop, CURLM *multi, long timeout_ms);
+void EventLoopDispatch(EventLoop *loop);
+
+#endif /* NETWORKING */
+
+#endif /* __DP_EVENTLOOP_H__ */
@@ -0,0 +1,179 @@
+/************************************************************************
+ * gameroom.c     Separate games hosted by a single server              *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "dopewars.h"
+#include "gameroom.h"
+#include "nls.h"
+#include "savegame.h"
+#include "serverside.h"
+
+/* All rooms that currently have players, keyed by name */
+static GHashTable *Rooms = NULL;
+
+/* 
+ * Returns a new, empty room called "Name". If RoomDir is set, a named
+ * room reads its own settings from NAME.cfg in that directory (if there
+ * is such a file), and keeps its own high scores in NAME.sco.
+ */
+static GameRoom *NewGameRoom(const gchar *Name)
+{
+  GameRoom *Room = g_new0(GameRoom, 1);
+  gchar *file;
+
+  Room->Name = g_strdup(Name);
+  Room->Names = NameIndexNew();
+  if (Name[0] && RoomDir && RoomDir[0]) {
+    file = SafeFileName(RoomDir, Name, ".cfg");
+    Room->Config = ReadConfigSnapshot(file);
+    g_free(file);
+    file = SafeFileName(RoomDir, Name, ".sco");
+    Room->Scores = OpenScoreTable(file);
+    g_free(file);
+  }
+  return Room;
+}
+
+static void FreeGameRoom(GameRoom *Room)
+{
+  CloseScoreTable(Room->Scores);
+  FreeConfigSnapshot(Room->Config);
+  g_hash_table_destroy(Room->Names);
+  g_free(Room->Name);
+  g_slist_free(Room->Players);
+  g_free(Room);
+}
+
+/* 
+ * Moves "Play" into the room called "Name", creating it if necessary.
+ * Returns FALSE (leaving the player where they were) if the room does not
+ * exist and no more rooms can be created (see MaxRooms).
+ */
+gboolean JoinGameRoom(Player *Play, const gchar *Name)
+{
+  GameRoom *Room = NULL;
+
+  if (Rooms) {
+    Room = (GameRoom *)g_hash_table_lookup(Rooms, Name);
+  }
+  if (Room && Room == Play->Room) {
+    return TRUE;
+  }
+  if (!Room) {
+    if (Name[0] && MaxRooms > 0 && CountGameRooms() >= MaxRooms) {
+      return FALSE;
+    }
+    if (!Rooms) {
+      Rooms = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    Room = NewGameRoom(Name);
+    g_hash_table_insert(Rooms, Room->Name, Room);
+  }
+  LeaveGameRoom(Play);
+  Room->Players = g_slist_append(Room->Players, Play);
+  Room->NumPlayers++;
+  Play->Room = Room;
+  NameIndexAdd(Room->Names, Play);
+  return TRUE;
+}
+
+/* 
+ * Removes "Play" from their room (if any). The room is freed if it is
+ * now empty, so idle rooms take up no memory.
+ */
+void LeaveGameRoom(Player *Play)
+{
+  GameRoom *Room = Play->Room;
+
+  if (!Room)
+    return;
+  NameIndexRemove(Room->Names, Play);
+  Play->Room = NULL;
+  Room->Players = g_slist_remove(Room->Players, Play);
+  Room->NumPlayers--;
+  if (Room->NumPlayers == 0) {
+    g_hash_table_remove(Rooms, Room->Name);
+    FreeGameRoom(Room);
+    if (g_hash_table_size(Rooms) == 0) {
+      g_hash_table_destroy(Rooms);
+      Rooms = NULL;
+    }
+  }
+}
+
+/* 
+ * Returns the room called "Name", or NULL if it has no players.
+ */
+GameRoom *GetGameRoom(const gchar *Name)
+{
+  return Rooms ? (GameRoom *)g_hash_table_lookup(Rooms, Name) : NULL;
+}
+
+/* 
+ * Returns the player in "Room" with the given name, &Noone for a blank
+ * name, or NULL if there is no such player.
+ */
+Player *GetRoomPlayerByName(GameRoom *Room, const gchar *Name)
+{
+  if (Name == NULL || Name[0] == 0)
+    return &Noone;
+  if (!Room)
+    return NULL;
+  return NameIndexFind(Room->Names, Name);
+}
+
+/* 
+ * Puts the settings of "Room" (or, if it has none of its own, those of
+ * the server) in use, before dealing with one of its players. Returns
+ * the settings that were in use before (see UseConfigSnapshot).
+ */
+ConfigSnapshot *UseGameRoom(GameRoom *Room)
+{
+  return UseConfigSnapshot(Room ? Room->Config : NULL);
+}
+
+/* 
+ * Returns a printable name for "Room", for the server log and admin
+ * commands.
+ */
+const gchar *GetGameRoomLabel(GameRoom *Room)
+{
+  if (!Room)
+    return _("(none)");
+  else if (!Room->Name[0])
+    return _("(main)");
+  else
+    return Room->Name;
+}
+
+/* 
+ * Returns the number of rooms that currently have players.
+ */
+guint CountGameRooms(void)
+{
+  return Rooms ? g_hash_table_size(Rooms) : 0;
+}
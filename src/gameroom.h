@@ -0,0 +1,63 @@
+/************************************************************************
+ * gameroom.h     Header file for game rooms                            *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+
+#ifndef __DP_GAMEROOM_H__
+#define __DP_GAMEROOM_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include "dopewars.h"
+
+/* 
+ * A game room is one game hosted by the server. Players only see, talk
+ * to and fight other players in the same room. If RoomDir is set, each
+ * named room can have its own settings, and has its own high score
+ * table; otherwise, those of the server are used. Rooms are created
+ * when the first player joins, and freed when the last one leaves.
+ */
+struct _GameRoom {
+  gchar *Name;                  /* Room name; "" for the main game */
+  GSList *Players;              /* Players in this room, which are also
+                                 * in FirstServer */
+  gint NumPlayers;              /* Length of the "Players" list */
+  GHashTable *Names;            /* The players, keyed by name; each value
+                                 * is a GSList, as cops share names */
+  ConfigSnapshot *Config;       /* The room's own settings, or NULL */
+  ScoreTable *Scores;           /* The room's own high scores, or NULL */
+};
+
+/* Longest room name a client may ask for */
+#define MAXROOMNAME 32
+
+gboolean JoinGameRoom(Player *Play, const gchar *Name);
+void LeaveGameRoom(Player *Play);
+GameRoom *GetGameRoom(const gchar *Name);
+Player *GetRoomPlayerByName(GameRoom *Room, const gchar *Name);
+ConfigSnapshot *UseGameRoom(GameRoom *Room);
+const gchar *GetGameRoomLabel(GameRoom *Room);
+guint CountGameRooms(void);
+
+#endif /* __DP_GAMEROOM_H__ */
@@ -398,9 +398,8 @@ gboolean GetClientMessage(GIOChannel *source, GIOCondition condition,
   }
 
   if (status == NBS_CONNECTED && datawaiting) {
-    while ((pt = GetWaitingPlayerMessage(ClientData.Play)) != NULL) {
+    while ((pt = GetWaitingPlayerMessageView(ClientData.Play)) != NULL) {
       HandleClientMessage(pt, ClientData.Play);
-      g_free(pt);
     }
   }
   if (!DoneOK) {
@@ -1972,6 +1971,8 @@ void GuiStartGame(void)
   StripTerminators(GetPlayerName(Play));
   InitAbilities(Play);
   SendAbilities(Play);
+  SendRoomChoice(Play);
+  SendAccountPassword(Play);
   SendNullClientMessage(Play, C_NONE, C_NAME, NULL, GetPlayerName(Play));
   InGame = TRUE;
   UpdateMenus();
@@ -292,6 +292,7 @@ void DisplayConnectStatus(NBStatus oldstatus, NBSocksStatus oldsocks)
 
   switch (status) {
   case NBS_PRECONNECT:
+  case NBS_RESOLVING:
     break;
   case NBS_SOCKSCONNECT:
     switch (sockstat) {
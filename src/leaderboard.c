@@ -0,0 +1,292 @@
+/************************************************************************
+ * leaderboard.c  Indexed store of every game's final score             *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "dopewars.h"
+#include "leaderboard.h"
+
+/* The games played under a single name */
+typedef struct _LeaderName {
+  LeaderEntry *Best;            /* The highest-ranked of them */
+  guint Games;                  /* How many there are */
+} LeaderName;
+
+#define SUBTREE_SIZE(entry) ((entry) ? (entry)->Size : 0)
+
+Leaderboard *LeaderboardNew(void)
+{
+  Leaderboard *board;
+
+  board = g_new(Leaderboard, 1);
+  board->Root = NULL;
+  board->Names = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                       g_free, g_free);
+  board->ByDate = g_ptr_array_new();
+  board->Serial = 0;
+  return board;
+}
+
+/* 
+ * Removes all entries from the board.
+ */
+void LeaderboardClear(Leaderboard *board)
+{
+  guint i;
+
+  for (i = 0; i < board->ByDate->len; i++) {
+    LeaderEntry *entry = LeaderboardByDate(board, i);
+
+    g_free(entry->Score.Name);
+    g_free(entry->Score.Time);
+    g_free(entry);
+  }
+  g_ptr_array_set_size(board->ByDate, 0);
+  g_hash_table_remove_all(board->Names);
+  board->Root = NULL;
+  board->Serial = 0;
+}
+
+void LeaderboardFree(Leaderboard *board)
+{
+  if (!board)
+    return;
+  LeaderboardClear(board);
+  g_hash_table_destroy(board->Names);
+  g_ptr_array_free(board->ByDate, TRUE);
+  g_free(board);
+}
+
+guint LeaderboardSize(Leaderboard *board)
+{
+  return board ? SUBTREE_SIZE(board->Root) : 0;
+}
+
+/* 
+ * Returns TRUE if "a" ranks above "b": it has more money, or the same
+ * amount but was added first.
+ */
+static gboolean RanksAbove(const LeaderEntry *a, const LeaderEntry *b)
+{
+  return (a->Score.Money > b->Score.Money
+          || (a->Score.Money == b->Score.Money && a->Serial < b->Serial));
+}
+
+static LeaderEntry *RotateRight(LeaderEntry *entry)
+{
+  LeaderEntry *left = entry->Left;
+
+  entry->Left = left->Right;
+  left->Right = entry;
+  left->Size = entry->Size;
+  entry->Size = SUBTREE_SIZE(entry->Left) + SUBTREE_SIZE(entry->Right) + 1;
+  return left;
+}
+
+static LeaderEntry *RotateLeft(LeaderEntry *entry)
+{
+  LeaderEntry *right = entry->Right;
+
+  entry->Right = right->Left;
+  right->Left = entry;
+  right->Size = entry->Size;
+  entry->Size = SUBTREE_SIZE(entry->Left) + SUBTREE_SIZE(entry->Right) + 1;
+  return right;
+}
+
+/* 
+ * Inserts "newent" into the subtree rooted at "entry", and returns the
+ * new root of the subtree. "rank" is increased by the number of
+ * entries in the subtree that rank above "newent".
+ */
+static LeaderEntry *TreapInsert(LeaderEntry *entry, LeaderEntry *newent,
+                                guint *rank)
+{
+  if (!entry)
+    return newent;
+  entry->Size++;
+  if (RanksAbove(newent, entry)) {
+    entry->Left = TreapInsert(entry->Left, newent, rank);
+    if (entry->Left->Priority > entry->Priority)
+      entry = RotateRight(entry);
+  } else {
+    *rank += SUBTREE_SIZE(entry->Left) + 1;
+    entry->Right = TreapInsert(entry->Right, newent, rank);
+    if (entry->Right->Priority > entry->Priority)
+      entry = RotateLeft(entry);
+  }
+  return entry;
+}
+
+/* 
+ * Returns the index in board->ByDate of the first entry dated after
+ * "date".
+ */
+static guint DateIndexAfter(Leaderboard *board, guint32 date)
+{
+  guint low = 0, high = board->ByDate->len;
+
+  while (low < high) {
+    guint mid = (low + high) / 2;
+
+    if (LeaderboardByDate(board, mid)->Date <= date)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* 
+ * Adds a copy of "Score" to the board, and returns its rank (0 for the
+ * top score). O(log n), plus the cost of keeping the entries in date
+ * order, which is O(1) when (as usual) they are added in that order.
+ */
+guint LeaderboardAdd(Leaderboard *board, const struct HISCORE *Score)
+{
+  LeaderEntry *entry;
+  LeaderName *name;
+  GPtrArray *dates = board->ByDate;
+  guint rank = 0, pos;
+
+  entry = g_new(LeaderEntry, 1);
+  entry->Score.Name = g_strdup(Score->Name ? Score->Name : "");
+  entry->Score.Time = g_strdup(Score->Time ? Score->Time : "");
+  entry->Score.Money = Score->Money;
+  entry->Score.Dead = Score->Dead;
+  entry->Date = LeaderboardParseDate(entry->Score.Time);
+  entry->Serial = board->Serial++;
+  entry->Priority = g_random_int();
+  entry->Size = 1;
+  entry->Left = entry->Right = NULL;
+  board->Root = TreapInsert(board->Root, entry, &rank);
+
+  pos = DateIndexAfter(board, entry->Date);
+  g_ptr_array_add(dates, entry);
+  if (pos < dates->len - 1) {
+    memmove(&dates->pdata[pos + 1], &dates->pdata[pos],
+            (dates->len - 1 - pos) * sizeof(gpointer));
+    dates->pdata[pos] = entry;
+  }
+
+  name = g_hash_table_lookup(board->Names, entry->Score.Name);
+  if (!name) {
+    name = g_new0(LeaderName, 1);
+    g_hash_table_insert(board->Names, g_strdup(entry->Score.Name), name);
+  }
+  name->Games++;
+  if (!name->Best || RanksAbove(entry, name->Best))
+    name->Best = entry;
+  return rank;
+}
+
+/* 
+ * Returns the entry with the given rank (0 for the top score), or NULL
+ * if there are not that many entries. O(log n).
+ */
+LeaderEntry *LeaderboardNth(Leaderboard *board, guint rank)
+{
+  LeaderEntry *entry = board ? board->Root : NULL;
+
+  while (entry) {
+    guint above = SUBTREE_SIZE(entry->Left);
+
+    if (rank < above) {
+      entry = entry->Left;
+    } else if (rank == above) {
+      return entry;
+    } else {
+      rank -= above + 1;
+      entry = entry->Right;
+    }
+  }
+  return NULL;
+}
+
+/* 
+ * Returns the rank of "entry", which must be on the board. O(log n).
+ */
+guint LeaderboardRank(Leaderboard *board, const LeaderEntry *entry)
+{
+  LeaderEntry *node = board->Root;
+  guint rank = 0;
+
+  while (node && node != entry) {
+    if (RanksAbove(entry, node)) {
+      node = node->Left;
+    } else {
+      rank += SUBTREE_SIZE(node->Left) + 1;
+      node = node->Right;
+    }
+  }
+  return rank + (node ? SUBTREE_SIZE(node->Left) : 0);
+}
+
+/* 
+ * Returns the best entry for the player called "Name", or NULL if they
+ * have no entries. If "games" is non-NULL, it is set to the number of
+ * games they have played.
+ */
+LeaderEntry *LeaderboardBest(Leaderboard *board, const gchar *Name,
+                             guint *games)
+{
+  LeaderName *name = g_hash_table_lookup(board->Names, Name);
+
+  if (games)
+    *games = name ? name->Games : 0;
+  return name ? name->Best : NULL;
+}
+
+/* 
+ * Finds the entries dated from "from" to "to" inclusive (in the form
+ * returned by LeaderboardParseDate). They are those in board->ByDate
+ * starting at index "*first"; the number of them is returned.
+ */
+guint LeaderboardDateRange(Leaderboard *board, guint32 from, guint32 to,
+                           guint *first)
+{
+  guint last;
+
+  *first = (from > 0 ? DateIndexAfter(board, from - 1) : 0);
+  last = DateIndexAfter(board, to);
+  return last > *first ? last - *first : 0;
+}
+
+/* 
+ * Converts a date in the form used in the high score tables (dd-mm-yyyy)
+ * to a number that sorts in date order, or 0 if it is not in that form.
+ */
+guint32 LeaderboardParseDate(const gchar *date)
+{
+  guint day, month, year;
+
+  if (!date || sscanf(date, "%u-%u-%u", &day, &month, &year) != 3
+      || day < 1 || day > 31 || month < 1 || month > 12 || year > 9999)
+    return 0;
+  return year * 10000 + month * 100 + day;
+}
@@ -0,0 +1,74 @@
+/************************************************************************
+ * leaderboard.h  Header file for the indexed high score store          *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+
+#ifndef __DP_LEADERBOARD_H__
+#define __DP_LEADERBOARD_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include "dopewars.h"
+
+typedef struct _LeaderEntry LeaderEntry;
+
+/* A single finished game. Entries are kept in a treap (a binary search
+ * tree that is also a heap on a random priority), ordered by score,
+ * where each node knows the size of its subtree, so that the rank of
+ * an entry, or the entry with a given rank, can be found in O(log n) */
+struct _LeaderEntry {
+  struct HISCORE Score;
+  guint32 Date;                 /* Score.Time as yyyymmdd, or 0 */
+  guint Serial;                 /* Order in which entries were added */
+  guint32 Priority;             /* Random heap priority */
+  guint Size;                   /* Number of entries in this subtree */
+  LeaderEntry *Left;            /* Entries ranked above this one */
+  LeaderEntry *Right;           /* Entries ranked below this one */
+};
+
+/* Every game played in one mode (normal or antique) */
+typedef struct _Leaderboard {
+  LeaderEntry *Root;            /* Top of the treap */
+  GHashTable *Names;            /* Player names, to LeaderName */
+  GPtrArray *ByDate;            /* All entries, by Date then Serial */
+  guint Serial;                 /* Serial number for the next entry */
+} Leaderboard;
+
+Leaderboard *LeaderboardNew(void);
+void LeaderboardFree(Leaderboard *board);
+void LeaderboardClear(Leaderboard *board);
+guint LeaderboardSize(Leaderboard *board);
+guint LeaderboardAdd(Leaderboard *board, const struct HISCORE *Score);
+LeaderEntry *LeaderboardNth(Leaderboard *board, guint rank);
+guint LeaderboardRank(Leaderboard *board, const LeaderEntry *entry);
+LeaderEntry *LeaderboardBest(Leaderboard *board, const gchar *Name,
+                             guint *games);
+guint LeaderboardDateRange(Leaderboard *board, guint32 from, guint32 to,
+                           guint *first);
+guint32 LeaderboardParseDate(const gchar *date);
+
+#define LeaderboardByDate(board, i) \
+    ((LeaderEntry *)g_ptr_array_index((board)->ByDate, i))
+
+#endif /* __DP_LEADERBOARD_H__ */
@@ -39,6 +39,7 @@
 
 #include "convert.h"
 #include "dopewars.h"
+#include "gameroom.h"
 #include "message.h"
 #include "network.h"
 #include "nls.h"
@@ -104,6 +105,11 @@ GSList *FirstClient = NULL;
 
 static Converter *netconv = NULL;
 
+#ifdef NETWORKING
+/* Number of messages not sent to clients that were not keeping up */
+guint SkippedMessages = 0;
+#endif
+
 void (*ClientMessageHandlerPt)(char *, Player *) = NULL;
 
 /* 
@@ -164,6 +170,7 @@ void DoSendClientMessage(Player *From, AICode AI, MsgCode Code,
       FirstServer = AddPlayer(0, ServerFrom, FirstServer);
     }
     HandleServerMessage(text->str, ServerFrom);
+    FlushAllPlayerData();
 #ifdef NETWORKING
   } else {
     QueuePlayerMessageForSend(BufOwn, text->str);
@@ -191,6 +198,71 @@ void SendQuestion(Player *From, AICode AI, Player *To, char *Data)
   SendServerMessage(From, AI, C_QUESTION, To, Data);
 }
 
+/* 
+ * Formats a message from server to client in the form understood by
+ * clients with the A_PLAYERID ability. This form does not depend on
+ * the recipient, so can be shared between all such clients.
+ */
+static void FormatPlayerIDMessage(GString *text, Player *From, AICode AI,
+                                  MsgCode Code, char *Data)
+{
+  if (From)
+    g_string_append_printf(text, "%d", From->ID);
+  g_string_append_printf(text, "^%c%c%s", AI, Code, Data ? Data : "");
+}
+
+#ifdef NETWORKING
+/* 
+ * Returns TRUE if a message with code "Code" should not be sent to "To",
+ * as it is not keeping up with the messages it has already been sent.
+ * Only chat is skipped, leaving room for the messages that run the game
+ * itself (C_QUESTION, C_FIGHTPRINT, C_UPDATE and so on). News of other
+ * players joining or leaving is still sent, as the client would otherwise
+ * have the wrong list of players.
+ */
+static gboolean SkipForLaggingClient(Player *To, MsgCode Code)
+{
+  if (Network && (Code == C_MSG || Code == C_MSGTO)
+      && IsNetworkBufferCongested(&To->NetBuf)) {
+    SkippedMessages++;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* Server players whose write buffers filled, waiting to be dropped */
+static GPtrArray *FullPlayers = NULL;
+
+/* 
+ * Arranges for player "Play" to be dropped by the server if the last
+ * message could not be queued for it because its write buffer is full.
+ * Such a client may never become readable or writable again, so would
+ * otherwise stay connected until it timed out.
+ */
+static void CheckPlayerBufferFull(Player *Play)
+{
+  if (!Server || Play->DropPending || !IsNetworkBufferFull(&Play->NetBuf))
+    return;
+  if (!FullPlayers)
+    FullPlayers = g_ptr_array_new();
+  Play->DropPending = TRUE;
+  g_ptr_array_add(FullPlayers, Play);
+}
+
+/* 
+ * Returns the next player whose write buffer filled up, or NULL if there
+ * are none. The server should remove each such player once it has
+ * finished handling each batch of events.
+ */
+Player *TakeFullPlayer(void)
+{
+  if (!FullPlayers || FullPlayers->len == 0)
+    return NULL;
+  return (Player *)g_ptr_array_remove_index_fast(FullPlayers,
+                                                 FullPlayers->len - 1);
+}
+#endif
+
 /* 
  * Sends a message from the server to client player "To" with computer
  * code "AI", human-readable code "Code" and data "Data", claiming
@@ -203,11 +275,15 @@ void SendServerMessage(Player *From, AICode AI, MsgCode Code,
 
   if (IsCop(To))
     return;
+#ifdef NETWORKING
+  if (SkipForLaggingClient(To, Code))
+    return;
+#endif
+  if (Code != C_UPDATE)
+    FlushPlayerData(To);
   text = g_string_new(NULL);
   if (HaveAbility(To, A_PLAYERID)) {
-    if (From)
-      g_string_append_printf(text, "%d", From->ID);
-    g_string_append_printf(text, "^%c%c%s", AI, Code, Data ? Data : "");
+    FormatPlayerIDMessage(text, From, AI, Code, Data);
   } else {
     g_string_printf(text, "%s^%s^%c%c%s", From ? GetPlayerName(From) : "",
                      To ? GetPlayerName(To) : "", AI, Code,
@@ -253,6 +329,7 @@ void InitAbilities(Player *Play)
   Play->Abil.Local[A_DONEFIGHT] = TRUE;
   Play->Abil.Local[A_UTF8] = TRUE;
   Play->Abil.Local[A_DATE] = TRUE;
+  Play->Abil.Local[A_DELTAUPDATE] = TRUE;
 
   if (!Network) {
     for (i = 0; i < A_NUM; i++) {
@@ -284,6 +361,30 @@ void SendAbilities(Player *Play)
   }
 }
 
+/* 
+ * Asks the server to put client player "Play" in the game room named by
+ * the "Room" config variable, if any. Must be called before the first
+ * C_NAME message is sent.
+ */
+void SendRoomChoice(Player *Play)
+{
+  if (!Network || !RoomName || !RoomName[0])
+    return;
+  SendNullClientMessage(Play, C_NONE, C_JOINROOM, NULL, RoomName);
+}
+
+/* 
+ * Sends the server the password for the account of client player "Play",
+ * given by the "Password" config variable, if any. Must be called before
+ * the first C_NAME message is sent.
+ */
+void SendAccountPassword(Player *Play)
+{
+  if (!Network || !AccountPassword || !AccountPassword[0])
+    return;
+  SendNullClientMessage(Play, C_NONE, C_PASSWORD, NULL, AccountPassword);
+}
+
 /* 
  * Fills in the "remote" abilities of player "Play" using the message data
  * in "Data". These are the abilities of the server/client at the other
@@ -385,6 +486,34 @@ gchar *GetWaitingPlayerMessage(Player *Play)
   }
 }
 
+/* 
+ * Returns the next complete message waiting on the player's connection,
+ * or NULL if there is none. The message is not a copy, and so must not
+ * be freed. It points either into the connection's read buffer or (if
+ * it had to be converted to the internal codeset) to a copy kept with
+ * the connection, and so is valid only until the next call to this
+ * function for the same player (which, when it returns NULL, may also
+ * release the read buffer), until more data are read from the wire, or
+ * until the connection is shut down. Callers that need the message for
+ * longer must copy it, or use GetWaitingPlayerMessage. The message may
+ * be modified in place, e.g. by ProcessMessage.
+ */
+gchar *GetWaitingPlayerMessageView(Player *Play)
+{
+  NetworkBuffer *NetBuf = &Play->NetBuf;
+  gchar *unconv;
+
+  g_free(NetBuf->ConvMessage);
+  NetBuf->ConvMessage = NULL;
+  unconv = GetWaitingMessageView(NetBuf, NULL);
+  if (unconv && Conv_Needed(netconv)) {
+    NetBuf->ConvMessage = Conv_ToInternal(netconv, unconv, -1);
+    return NetBuf->ConvMessage;
+  } else {
+    return unconv;
+  }
+}
+
 gboolean ReadPlayerDataFromWire(Player *Play)
 {
   return ReadDataFromWire(&Play->NetBuf);
@@ -399,6 +528,7 @@ void QueuePlayerMessageForSend(Player *Play, gchar *data)
   } else {
     QueueMessageForSend(&Play->NetBuf, data);
   }
+  CheckPlayerBufferFull(Play);
 }
 
 gboolean WritePlayerDataToWire(Player *Play)
@@ -533,20 +663,49 @@ void AddURLEnc(GString *str, gchar *unenc)
 /* 
  * Sends the message made up of AI,Code and Data to all players except
  * "Except" (if non-NULL). It will be sent by the server, and on behalf of
- * player "From".
+ * player "From"; if "From" is non-NULL, only players in the same game room
+ * receive it.
  */
 void BroadcastToClients(AICode AI, MsgCode Code, char *Data,
                         Player *From, Player *Except)
 {
   Player *tmp;
   GSList *list;
+  GString *text = NULL;
+  gchar *conv = NULL;
 
-  for (list = FirstServer; list; list = g_slist_next(list)) {
+  list = (From && From->Room) ? From->Room->Players : FirstServer;
+  for (; list; list = g_slist_next(list)) {
     tmp = (Player *)list->data;
-    if (IsConnectedPlayer(tmp) && tmp != Except) {
-      SendServerMessage(From, AI, Code, tmp, Data);
+    if (!IsConnectedPlayer(tmp) || tmp == Except || IsCop(tmp)
+        || (From && tmp->Room != From->Room))
+      continue;
+#ifdef NETWORKING
+    if (SkipForLaggingClient(tmp, Code))
+      continue;
+    /* Clients that understand player IDs all get an identical message,
+     * so format (and convert) it only once, and just copy the result
+     * into each client's write buffer. Older clients' messages include
+     * their own name, so must be built individually. */
+    if (Network && HaveAbility(tmp, A_PLAYERID)) {
+      if (!text) {
+        text = g_string_new(NULL);
+        FormatPlayerIDMessage(text, From, AI, Code, Data);
+        if (Conv_Needed(netconv)) {
+          conv = Conv_ToExternal(netconv, text->str, -1);
+        }
+      }
+      FlushPlayerData(tmp);
+      QueueMessageForSend(&tmp->NetBuf, conv ? conv : text->str);
+      CheckPlayerBufferFull(tmp);
+      continue;
     }
+#endif
+    SendServerMessage(From, AI, Code, tmp, Data);
   }
+  g_free(conv);
+  if (text)
+    g_string_free(text, TRUE);
 }
 
 /* 
@@ -592,13 +751,228 @@ void ReceiveInventory(char *Data, Inventory *Guns, Inventory *Drugs)
   }
 }
 
+/* Players with an update waiting to be sent by FlushAllPlayerData */
+static GPtrArray *PendingUpdates = NULL;
+
 /* 
- * Sends all pertinent data about player "To" from the server
- * to player "To".
+ * Arranges for all pertinent data about player "To" to be sent from the
+ * server to player "To". Handlers often change a player's data several
+ * times while processing a single message, so the update is not sent
+ * until FlushAllPlayerData is called, or another message is sent to the
+ * player (so that clients still see messages in the same order).
  */
 void SendPlayerData(Player *To)
 {
-  SendSpyReport(To, To);
+  if (To->UpdatePending || IsCop(To))
+    return;
+  if (!PendingUpdates)
+    PendingUpdates = g_ptr_array_new();
+  To->UpdatePending = TRUE;
+  g_ptr_array_add(PendingUpdates, To);
+}
+
+static void SendPlayerDataNow(Player *To)
+{
+  /* The update may be sent while dealing with another room's player */
+  ConfigSnapshot *config = UseGameRoom(To->Room);
+
+  To->UpdatePending = FALSE;
+  if (HaveAbility(To, A_DELTAUPDATE))
+    SendPlayerDelta(To);
+  else
+    SendSpyReport(To, To);
+  UseConfigSnapshot(config);
+}
+
+/* 
+ * Sends player "To" any update waiting from SendPlayerData.
+ */
+void FlushPlayerData(Player *To)
+{
+  if (To->UpdatePending) {
+    g_ptr_array_remove_fast(PendingUpdates, To);
+    SendPlayerDataNow(To);
+  }
+}
+
+/* 
+ * Sends all updates waiting from SendPlayerData. This should be called
+ * by the server once it has finished handling each batch of events.
+ */
+void FlushAllPlayerData(void)
+{
+  Player *To;
+
+  while (PendingUpdates && PendingUpdates->len > 0) {
+    To = (Player *)g_ptr_array_remove_index_fast(PendingUpdates,
+                                                 PendingUpdates->len - 1);
+    SendPlayerDataNow(To);
+  }
+}
+
+/* 
+ * Drops any update, or pending disconnection, waiting for player "To"
+ * (e.g. because it is being removed).
+ */
+void DiscardPlayerData(Player *To)
+{
+  if (To->UpdatePending) {
+    g_ptr_array_remove_fast(PendingUpdates, To);
+    To->UpdatePending = FALSE;
+  }
+#ifdef NETWORKING
+  if (To->DropPending) {
+    g_ptr_array_remove_fast(FullPlayers, To);
+    To->DropPending = FALSE;
+  }
+#endif
+}
+
+/* 
+ * Fields of the player data, as sent in a delta update; guns, drugs and
+ * (with A_DRUGVALUE) drug values follow these, in that order.
+ */
+typedef enum {
+  PF_CASH, PF_DEBT, PF_BANK, PF_HEALTH, PF_COATSIZE, PF_ISAT, PF_TURN,
+  PF_FLAGS, PF_DAY, PF_MONTH, PF_YEAR, PF_BITCHES,
+  PF_NUM
+} PlayerField;
+
+/* 
+ * Fills "Fields" with the current values of all of player "Play"'s
+ * data that are sent to player "To", and returns the number of fields.
+ * "Fields" must be large enough to hold them.
+ */
+static gint GetPlayerFields(Player *Play, Player *To, price_t *Fields)
+{
+  gint i, num = PF_NUM;
+
+  Fields[PF_CASH] = Play->Cash;
+  Fields[PF_DEBT] = Play->Debt;
+  Fields[PF_BANK] = Play->Bank;
+  Fields[PF_HEALTH] = Play->Health;
+  Fields[PF_COATSIZE] = Play->CoatSize;
+  Fields[PF_ISAT] = Play->IsAt;
+  Fields[PF_TURN] = Play->Turn;
+  Fields[PF_FLAGS] = Play->Flags;
+  Fields[PF_DAY] = g_date_get_day(Play->date);
+  Fields[PF_MONTH] = g_date_get_month(Play->date);
+  Fields[PF_YEAR] = g_date_get_year(Play->date);
+  Fields[PF_BITCHES] = Play->Bitches.Carried;
+  for (i = 0; i < NumGun; i++) {
+    Fields[num++] = Play->Guns[i].Carried;
+  }
+  for (i = 0; i < NumDrug; i++) {
+    Fields[num++] = Play->Drugs[i].Carried;
+  }
+  if (HaveAbility(To, A_DRUGVALUE)) {
+    for (i = 0; i < NumDrug; i++) {
+      Fields[num++] = Play->Drugs[i].TotalValue;
+    }
+  }
+  return num;
+}
+
+/* 
+ * Sets field number "Field" (see GetPlayerFields) of player "Play"'s data.
+ */
+static void SetPlayerField(Player *Play, Player *To, gint Field,
+                           price_t Value)
+{
+  if (Field < 0)
+    return;
+  switch (Field) {
+  case PF_CASH:
+    Play->Cash = Value;
+    return;
+  case PF_DEBT:
+    Play->Debt = Value;
+    return;
+  case PF_BANK:
+    Play->Bank = Value;
+    return;
+  case PF_HEALTH:
+    Play->Health = (int)Value;
+    return;
+  case PF_COATSIZE:
+    Play->CoatSize = (int)Value;
+    return;
+  case PF_ISAT:
+    Play->IsAt = (int)Value;
+    return;
+  case PF_TURN:
+    Play->Turn = (int)Value;
+    return;
+  case PF_FLAGS:
+    Play->Flags = (PlayerFlags)Value;
+    return;
+  case PF_DAY:
+    g_date_set_day(Play->date, (GDateDay)Value);
+    return;
+  case PF_MONTH:
+    g_date_set_month(Play->date, (GDateMonth)Value);
+    return;
+  case PF_YEAR:
+    g_date_set_year(Play->date, (GDateYear)Value);
+    return;
+  case PF_BITCHES:
+    Play->Bitches.Carried = (int)Value;
+    return;
+  }
+  Field -= PF_NUM;
+  if (Field < NumGun) {
+    Play->Guns[Field].Carried = (int)Value;
+    return;
+  }
+  Field -= NumGun;
+  if (Field < NumDrug) {
+    Play->Drugs[Field].Carried = (int)Value;
+    return;
+  }
+  Field -= NumDrug;
+  if (Field < NumDrug && HaveAbility(To, A_DRUGVALUE)) {
+    Play->Drugs[Field].TotalValue = Value;
+  }
+}
+
+/* 
+ * Sends player "To" only those parts of its data that have changed
+ * since the last update, as a list of field number and value pairs. The
+ * connection is reliable and ordered, so the client will have applied
+ * every previous update by the time it sees this one, and the last data
+ * sent can be used as the baseline.
+ */
+void SendPlayerDelta(Player *To)
+{
+  price_t *Fields;
+  gint i, num;
+  GString *text;
+  gchar *valstr;
+
+  Fields = g_new(price_t, PF_NUM + NumGun + NumDrug * 2);
+  num = GetPlayerFields(To, To, Fields);
+
+  /* If the number of guns or drugs has changed, start again */
+  if (To->Shadow && To->ShadowLen != num) {
+    g_free(To->Shadow);
+    To->Shadow = NULL;
+  }
+
+  text = g_string_new(NULL);
+  for (i = 0; i < num; i++) {
+    if (!To->Shadow || To->Shadow[i] != Fields[i]) {
+      valstr = pricetostr(Fields[i]);
+      g_string_append_printf(text, "%s%d^%s", text->len ? "^" : "",
+                             i, valstr);
+      g_free(valstr);
+    }
+  }
+  g_free(To->Shadow);
+  To->Shadow = Fields;
+  To->ShadowLen = num;
+
+  SendServerMessage(NULL, C_NONE, C_UPDATE, To, text->str);
+  g_string_free(text, TRUE);
 }
 
 /* 
@@ -732,7 +1106,7 @@ void ReceiveInitialData(Player *Play, char *Data)
     g_free(date);
   }
   if (HaveAbility(Play, A_PLAYERID))
-    Play->ID = GetNextInt(&pt, 0);
+    SetPlayerID(Play, GetNextInt(&pt, 0));
 
   /* Servers up to version 1.4.8 don't send the following names, so
    * default to the existing values if they haven't been sent */
@@ -862,6 +1236,13 @@ void ReceivePlayerData(Player *Play, char *text, Player *From)
   int i;
 
   cp = text;
+  if (From == Play && HaveAbility(Play, A_DELTAUPDATE)) {
+    while (*cp) {
+      i = GetNextInt(&cp, -1);
+      SetPlayerField(From, Play, i, GetNextPrice(&cp, (price_t)0));
+    }
+    return;
+  }
   From->Cash = GetNextPrice(&cp, (price_t)0);
   From->Debt = GetNextPrice(&cp, (price_t)0);
   From->Bank = GetNextPrice(&cp, (price_t)0);
@@ -1070,7 +1451,7 @@ gboolean HandleGenericClientMessage(Player *From, AICode AI, MsgCode Code,
     pt = Data;
     SetPlayerName(tmp, GetNextWord(&pt, NULL));
     if (HaveAbility(To, A_PLAYERID))
-      tmp->ID = GetNextInt(&pt, 0);
+      SetPlayerID(tmp, GetNextInt(&pt, 0));
     break;
   case C_DATA:
     ReceiveMiscData(Data);
@@ -42,7 +42,7 @@ typedef enum {
   C_RENAME, C_NAME, C_SACKBITCH, C_TIPOFF, C_SPYON, C_WANTQUIT,
   C_CONTACTSPY, C_KILL, C_REQUESTSCORE, C_INIT, C_DATA,
   C_FIGHTPRINT, C_FIGHTACT, C_TRADE, C_CHANGEDISP,
-  C_NETMESSAGE, C_ABILITIES
+  C_NETMESSAGE, C_ABILITIES, C_JOINROOM, C_PASSWORD
 } MsgCode;
 
 typedef enum {
@@ -93,6 +93,7 @@ gboolean ReadPlayerDataFromWire(Player *Play);
 void QueuePlayerMessageForSend(Player *Play, gchar *data);
 gboolean WritePlayerDataToWire(Player *Play);
 gchar *GetWaitingPlayerMessage(Player *Play);
+gchar *GetWaitingPlayerMessageView(Player *Play);
 
 gboolean OpenMetaHttpConnection(CurlConnection *conn, GError **err);
 gboolean HandleWaitingMetaServerData(CurlConnection *conn, GSList **listpt,
@@ -102,6 +103,12 @@ void ClearServerList(GSList **listpt);
 
 extern GSList *FirstClient;
 
+#ifdef NETWORKING
+extern guint SkippedMessages;
+
+Player *TakeFullPlayer(void);
+#endif
+
 extern void (*ClientMessageHandlerPt) (char *, Player *);
 
 void InitNetwork(void);
@@ -113,6 +120,10 @@ void SendInventory(Player *From, AICode AI, MsgCode Code, Player *To,
                    Inventory *Guns, Inventory *Drugs);
 void ReceiveInventory(char *Data, Inventory *Guns, Inventory *Drugs);
 void SendPlayerData(Player *To);
+void FlushPlayerData(Player *To);
+void FlushAllPlayerData(void);
+void DiscardPlayerData(Player *To);
+void SendPlayerDelta(Player *To);
 void SendSpyReport(Player *To, Player *SpiedOn);
 void ReceivePlayerData(Player *Play, char *text, Player *From);
 void SendInitialData(Player *To);
@@ -133,6 +144,8 @@ gboolean HandleGenericClientMessage(Player *From, AICode AI, MsgCode Code,
                                     DispMode *DisplayMode);
 void InitAbilities(Player *Play);
 void SendAbilities(Player *Play);
+void SendRoomChoice(Player *Play);
+void SendAccountPassword(Player *Play);
 void ReceiveAbilities(Player *Play, gchar *Data);
 void CombineAbilities(Player *Play);
 void SetAbility(Player *Play, gint Type, gboolean Set);
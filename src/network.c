@@ -35,6 +35,7 @@
 #include <sys/socket.h>         /* For struct sockaddr etc. */
 #include <netinet/in.h>         /* For struct sockaddr_in etc. */
 #include <arpa/inet.h>          /* For socklen_t */
+#include <netinet/tcp.h>        /* For TCP_NODELAY */
 #include <pwd.h>                /* For getpwuid */
 #include <string.h>             /* For memcpy, strlen etc. */
 #ifdef HAVE_UNISTD_H
@@ -44,7 +45,7 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>              /* For fcntl() */
 #endif
-#include <netdb.h>              /* For gethostbyname() */
+#include <netdb.h>              /* For gethostbyname(), getaddrinfo() */
 #endif /* CYGWIN */
 
 #include <glib.h>
@@ -61,6 +62,26 @@
 #define MAXREADBUF   (32768)
 #define MAXWRITEBUF  (65536)
 
+/* Read and write buffers come in power-of-two sizes from MINCONNBUF up
+ * to MAXWRITEBUF, and are returned to a pool shared by all connections
+ * once drained, so that idle connections hold no buffer memory. At most
+ * MAXPOOLBYTES of buffers of each size are kept in the pool. */
+#define MINCONNBUF   (256)
+#define NUMBUFSIZES  (9)
+#define MAXPOOLBYTES (262144)
+
+/* Once this many bytes are waiting to be written, the other end of the
+ * connection is not keeping up (see IsNetworkBufferCongested); the rest
+ * of the write buffer is kept for messages that it cannot do without */
+#define CONGESTEDWRITEBUF (MAXWRITEBUF / 4)
+
+guint FullWriteBuffers = 0;
+
+/* While CorkDepth is non-zero, network buffers that are written to are
+ * kept in CorkedBuffers, to be sent to the wire all at once */
+static gint CorkDepth = 0;
+static GSList *CorkedBuffers = NULL;
+
 /* SOCKS5 authentication method codes */
 typedef enum {
   SM_NOAUTH = 0,                /* No authentication required */
@@ -68,9 +89,16 @@ typedef enum {
   SM_USERPASSWD = 2             /* Username/password authentication */
 } SocksMethods;
 
+/* Host names are looked up on a helper thread where possible */
+#if !defined(CYGWIN) && defined(HAVE_GETADDRINFO)
+#define ASYNC_RESOLVE
+#endif
+
+static gboolean WriteBufToWire(NetworkBuffer *NetBuf, ConnBuf *conn);
 static gboolean StartSocksNegotiation(NetworkBuffer *NetBuf,
                                       gchar *RemoteHost,
-                                      unsigned RemotePort);
+                                      unsigned RemotePort,
+                                      const struct in_addr *haddr);
 static gboolean StartConnect(int *fd, const gchar *bindaddr, gchar *RemoteHost,
                              unsigned RemotePort, gboolean *doneOK,
                              LastError **error);
@@ -111,6 +139,13 @@ void SetReuse(SOCKET sock)
   }
 }
 
+void SetNoDelay(SOCKET sock)
+{
+  BOOL i = TRUE;
+
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&i, sizeof(i));
+}
+
 void SetBlocking(SOCKET sock, gboolean blocking)
 {
   unsigned long param;
@@ -139,6 +174,35 @@ void SetReuse(int sock)
   }
 }
 
+/* 
+ * Sends data on the given TCP socket as soon as they are written,
+ * rather than waiting for earlier data to be acknowledged. Messages
+ * are gathered into the write buffer while corked (see
+ * CorkNetworkBuffers) so this does not result in lots of tiny packets.
+ */
+void SetNoDelay(int sock)
+{
+  int i = 1;
+
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+}
+
+/* 
+ * Allows several processes to bind the same port, with the kernel
+ * sharing incoming connections between them. Returns FALSE if this is
+ * not supported.
+ */
+gboolean SetReusePort(int sock)
+{
+#ifdef SO_REUSEPORT
+  int i = 1;
+
+  return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) == 0;
+#else
+  return FALSE;
+#endif
+}
+
 void SetBlocking(int sock, gboolean blocking)
 {
   fcntl(sock, F_SETFL, blocking ? 0 : O_NONBLOCK);
@@ -167,16 +231,173 @@ static void NetBufCallBackStop(NetworkBuffer *NetBuf)
   }
 }
 
+/* Unused buffers of each size, linked through their first bytes */
+static gpointer BufPool[NUMBUFSIZES];
+static gint BufPoolCount[NUMBUFSIZES];
+
+/* 
+ * Returns the index in BufPool of buffers of size "length".
+ */
+static gint BufPoolIndex(gint length)
+{
+  gint i;
+
+  for (i = 0; length > MINCONNBUF; i++)
+    length >>= 1;
+  g_assert(i < NUMBUFSIZES);
+  return i;
+}
+
+/* 
+ * Returns a buffer of "length" bytes, which must be one of the buffer
+ * sizes, from the pool if possible.
+ */
+static gchar *GetPoolBuffer(gint length)
+{
+  gint i = BufPoolIndex(length);
+  gpointer buf = BufPool[i];
+
+  if (buf) {
+    memcpy(&BufPool[i], buf, sizeof(gpointer));
+    BufPoolCount[i]--;
+    return (gchar *)buf;
+  } else {
+    return g_new(gchar, length);
+  }
+}
+
+/* 
+ * Returns a buffer obtained from GetPoolBuffer to the pool, or frees it
+ * if the pool already has enough of that size.
+ */
+static void ReturnPoolBuffer(gchar *buf, gint length)
+{
+  gint i = BufPoolIndex(length);
+
+  if (BufPoolCount[i] * length >= MAXPOOLBYTES) {
+    g_free(buf);
+  } else {
+    memcpy(buf, &BufPool[i], sizeof(gpointer));
+    BufPool[i] = buf;
+    BufPoolCount[i]++;
+  }
+}
+
 static void InitConnBuf(ConnBuf *buf)
 {
   buf->Data = NULL;
   buf->Length = 0;
+  buf->Start = 0;
   buf->DataPresent = 0;
 }
 
+/* 
+ * Replaces the buffer's memory with a (pooled) buffer of "length" bytes,
+ * moving any waiting data to the start of it.
+ */
+static void ResizeConnBuf(ConnBuf *buf, gint length)
+{
+  gchar *data = GetPoolBuffer(length);
+
+  if (buf->DataPresent > 0)
+    memcpy(data, &buf->Data[buf->Start], buf->DataPresent);
+  if (buf->Data)
+    ReturnPoolBuffer(buf->Data, buf->Length);
+  buf->Data = data;
+  buf->Length = length;
+  buf->Start = 0;
+}
+
+/* 
+ * Returns the buffer's memory to the pool if no data are waiting in it.
+ */
+static void ReleaseConnBuf(ConnBuf *buf)
+{
+  if (buf->Data && buf->DataPresent == 0) {
+    ReturnPoolBuffer(buf->Data, buf->Length);
+    InitConnBuf(buf);
+  }
+}
+
+/* 
+ * Moves any waiting data to the start of the buffer, reclaiming the
+ * space used by data that have already been consumed.
+ */
+static void CompactConnBuf(ConnBuf *buf)
+{
+  if (buf->Start > 0) {
+    if (buf->DataPresent > 0) {
+      memmove(buf->Data, &buf->Data[buf->Start], buf->DataPresent);
+    }
+    buf->Start = 0;
+  }
+}
+
+/* 
+ * Discards the first "numbytes" bytes of waiting data. Rather than
+ * moving the remaining data, the start offset is simply advanced, so
+ * that draining many messages from a full buffer stays linear.
+ */
+static void ConsumeConnBuf(ConnBuf *buf, int numbytes)
+{
+  buf->DataPresent -= numbytes;
+  if (buf->DataPresent > 0) {
+    buf->Start += numbytes;
+  } else {
+    buf->Start = 0;
+  }
+}
+
+static void InitMsgIndex(MsgIndex *idx)
+{
+  idx->Lens = NULL;
+  idx->Size = idx->Head = idx->Count = 0;
+  idx->Indexed = idx->Scanned = 0;
+}
+
+static void FreeMsgIndex(MsgIndex *idx)
+{
+  g_free(idx->Lens);
+  InitMsgIndex(idx);
+}
+
+/* 
+ * Forgets all message boundaries found so far, so that the read buffer
+ * will be scanned again from the start.
+ */
+static void ClearMsgIndex(MsgIndex *idx)
+{
+  idx->Head = idx->Count = 0;
+  idx->Indexed = idx->Scanned = 0;
+}
+
+/* 
+ * Records a complete message of "len" bytes, immediately following those
+ * already indexed.
+ */
+static void AddIndexedMessage(MsgIndex *idx, gint len)
+{
+  gint *lens, i;
+
+  if (idx->Count == idx->Size) {
+    lens = g_new(gint, MAX(idx->Size * 2, 16));
+    for (i = 0; i < idx->Count; i++)
+      lens[i] = idx->Lens[(idx->Head + i) % idx->Size];
+    g_free(idx->Lens);
+    idx->Lens = lens;
+    idx->Size = MAX(idx->Size * 2, 16);
+    idx->Head = 0;
+  }
+  idx->Lens[(idx->Head + idx->Count) % idx->Size] = len;
+  idx->Count++;
+  idx->Indexed += len;
+  idx->Scanned = idx->Indexed;
+}
+
 static void FreeConnBuf(ConnBuf *buf)
 {
-  g_free(buf->Data);
+  if (buf->Data)
+    ReturnPoolBuffer(buf->Data, buf->Length);
   InitConnBuf(buf);
 }
 
@@ -197,12 +418,17 @@ void InitNetworkBuffer(NetworkBuffer *NetBuf, char Terminator,
   NetBuf->Terminator = Terminator;
   NetBuf->StripChar = StripChar;
   InitConnBuf(&NetBuf->ReadBuf);
+  InitMsgIndex(&NetBuf->ReadIndex);
+  NetBuf->ConvMessage = NULL;
   InitConnBuf(&NetBuf->WriteBuf);
   InitConnBuf(&NetBuf->negbuf);
+  NetBuf->WriteWaitStart = 0;
+  NetBuf->Corked = FALSE;
   NetBuf->WaitConnect = FALSE;
   NetBuf->status = NBS_PRECONNECT;
   NetBuf->socks = socks;
   NetBuf->host = NULL;
+  NetBuf->resolver = NULL;
   NetBuf->userpasswd = NULL;
   NetBuf->error = NULL;
 }
@@ -253,13 +479,284 @@ gboolean IsNetworkBufferActive(NetworkBuffer *NetBuf)
   return (NetBuf && NetBuf->fd >= 0);
 }
 
+#ifdef ASYNC_RESOLVE
+/* 
+ * Looks up the addresses for a connect on a helper thread, so that a
+ * slow name server doesn't stall the event loop. Until the lookup is
+ * done, the network buffer is in the NBS_RESOLVING state, and watches
+ * the read end of "pipe" (to which the thread writes a single byte when
+ * it finishes) in place of a socket. The structure is shared with the
+ * thread, and so is freed by whichever of the two lets go of it last.
+ */
+struct _Resolver {
+  gint refcount;                /* Number of users of the structure */
+  int pipe[2];                  /* Signals that the lookup is done */
+  gchar *host;                  /* The host (or SOCKS server) to connect
+                                 * to, and its port */
+  gchar *service;
+  gchar *bindaddr;              /* If non-NULL, local address to bind to */
+  gchar *sockshost;             /* If non-NULL, the host that a SOCKS4
+                                 * server should connect us to */
+  gchar *RemoteHost;            /* The host and port to ask the SOCKS
+                                 * server (if any) to connect us to */
+  unsigned RemotePort;
+  struct addrinfo *addrs;       /* Addresses of "host" */
+  struct addrinfo *bindaddrs;   /* Addresses of "bindaddr" */
+  struct addrinfo *socksaddrs;  /* IPv4 addresses of "sockshost" */
+  struct addrinfo *next;        /* The next of "addrs" to try */
+  int gaierr;                   /* Error from getaddrinfo(), if any */
+  int syserr;                   /* errno, if "gaierr" is EAI_SYSTEM */
+};
+
+static void ReleaseResolver(Resolver *r)
+{
+  if (g_atomic_int_dec_and_test(&r->refcount)) {
+    if (r->addrs)
+      freeaddrinfo(r->addrs);
+    if (r->bindaddrs)
+      freeaddrinfo(r->bindaddrs);
+    if (r->socksaddrs)
+      freeaddrinfo(r->socksaddrs);
+    close(r->pipe[0]);
+    close(r->pipe[1]);
+    g_free(r->host);
+    g_free(r->service);
+    g_free(r->bindaddr);
+    g_free(r->sockshost);
+    g_free(r->RemoteHost);
+    g_free(r);
+  }
+}
+
+static int LookupAddresses(const gchar *host, const gchar *service,
+                           int family, int flags, struct addrinfo **res)
+{
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  return getaddrinfo(host, service, &hints, res);
+}
+
+static gpointer ResolverThread(gpointer data)
+{
+  Resolver *r = (Resolver *)data;
+  int err;
+
+  err = LookupAddresses(r->host, r->service, AF_UNSPEC, 0, &r->addrs);
+  if (err == 0 && r->bindaddr) {
+    err = LookupAddresses(r->bindaddr, NULL, AF_UNSPEC, AI_PASSIVE,
+                          &r->bindaddrs);
+  }
+  if (err == 0 && r->sockshost) {
+    /* SOCKS4 can only handle IPv4 addresses */
+    err = LookupAddresses(r->sockshost, NULL, AF_INET, 0, &r->socksaddrs);
+  }
+  r->gaierr = err;
+  if (err == EAI_SYSTEM)
+    r->syserr = errno;
+
+  while (write(r->pipe[1], "", 1) == -1 && errno == EINTR) {
+  }
+  ReleaseResolver(r);
+  return NULL;
+}
+
+/* 
+ * Stops any lookup or connect attempts on the given network buffer.
+ */
+static void FreeResolver(NetworkBuffer *NetBuf)
+{
+  if (NetBuf->resolver) {
+    /* While resolving, the descriptor is the resolver's pipe, which is
+     * closed when the helper thread is done with it */
+    if (NetBuf->status == NBS_RESOLVING) {
+      g_io_channel_unref(NetBuf->ioch);
+      NetBuf->fd = -1;
+    }
+    ReleaseResolver(NetBuf->resolver);
+    NetBuf->resolver = NULL;
+  }
+}
+
+static gboolean StartResolve(NetworkBuffer *NetBuf, const gchar *bindaddr,
+                             gchar *realhost, unsigned realport,
+                             gchar *RemoteHost, unsigned RemotePort)
+{
+  Resolver *r;
+  GThread *thread;
+
+  r = g_new0(Resolver, 1);
+  if (pipe(r->pipe) == -1) {
+    SetError(&NetBuf->error, ET_ERRNO, errno, NULL);
+    g_free(r);
+    return FALSE;
+  }
+  r->refcount = 2;              /* The network buffer, and the thread */
+  r->host = g_strdup(realhost);
+  r->service = g_strdup_printf("%u", realport);
+  if (bindaddr && bindaddr[0])
+    r->bindaddr = g_strdup(bindaddr);
+  if (NetBuf->socks && NetBuf->socks->version != 5)
+    r->sockshost = g_strdup(RemoteHost);
+  r->RemoteHost = g_strdup(RemoteHost);
+  r->RemotePort = RemotePort;
+
+  NetBuf->resolver = r;
+  NetBuf->fd = r->pipe[0];
+  SetBlocking(NetBuf->fd, FALSE);
+  NetBuf->ioch = g_io_channel_unix_new(NetBuf->fd);
+  NetBuf->status = NBS_RESOLVING;
+
+  thread = g_thread_try_new("resolver", ResolverThread, r, NULL);
+  if (thread) {
+    g_thread_unref(thread);
+  } else {
+    ResolverThread(r);          /* Fall back to a blocking lookup */
+  }
+
+  /* Notify the owner to check for the lookup completing */
+  NetBufCallBack(NetBuf, FALSE);
+  return TRUE;
+}
+
+/* 
+ * Starts a non-blocking connect to the next of the addresses found by
+ * the resolver, closing the socket from any previous attempt. Returns
+ * FALSE (with the error from the last attempt) if none are left.
+ */
+static gboolean ConnectNextAddress(NetworkBuffer *NetBuf)
+{
+  Resolver *r = NetBuf->resolver;
+  struct addrinfo *ai, *bindai;
+  int fd = -1;
+
+  if (NetBuf->fd >= 0) {
+    NetBufCallBackStop(NetBuf);
+    CloseSocket(NetBuf->fd);
+    g_io_channel_unref(NetBuf->ioch);
+    NetBuf->fd = -1;
+  }
+  NetBuf->WaitConnect = FALSE;
+
+  while ((ai = r->next) != NULL) {
+    r->next = ai->ai_next;
+    FreeError(NetBuf->error);
+    NetBuf->error = NULL;
+
+    /* Any local address to bind to must be of the same family */
+    for (bindai = r->bindaddrs; bindai && bindai->ai_family != ai->ai_family;
+         bindai = bindai->ai_next) {
+    }
+    if (r->bindaddrs && !bindai) {
+      SetError(&NetBuf->error, ET_GAI, EAI_FAMILY, NULL);
+      continue;
+    }
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == SOCKET_ERROR) {
+      SetError(&NetBuf->error, ET_ERRNO, errno, NULL);
+      continue;
+    }
+    SetBlocking(fd, FALSE);
+    SetNoDelay(fd);
+
+    if (bindai && bind(fd, bindai->ai_addr,
+                       bindai->ai_addrlen) == SOCKET_ERROR) {
+      SetError(&NetBuf->error, ET_ERRNO, errno, NULL);
+    } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) != SOCKET_ERROR) {
+      break;
+    } else if (errno == EINPROGRESS) {
+      NetBuf->WaitConnect = TRUE;
+      break;
+    } else {
+      SetError(&NetBuf->error, ET_ERRNO, errno, NULL);
+    }
+    CloseSocket(fd);
+  }
+
+  if (!ai) {
+    return FALSE;
+  }
+  NetBuf->fd = fd;
+  NetBuf->ioch = g_io_channel_unix_new(fd);
+  return TRUE;
+}
+
+/* 
+ * Called when the helper thread has finished looking up addresses;
+ * starts connecting to the first of them. Returns FALSE on error.
+ */
+static gboolean FinishResolve(NetworkBuffer *NetBuf)
+{
+  Resolver *r = NetBuf->resolver;
+  struct in_addr *haddr = NULL;
+  char c;
+
+  if (read(NetBuf->fd, &c, 1) != 1) {
+    return TRUE;                /* Still waiting for the thread */
+  }
+
+  NetBufCallBackStop(NetBuf);
+  g_io_channel_unref(NetBuf->ioch);
+  NetBuf->fd = -1;
+  NetBuf->status = NBS_PRECONNECT;
+
+  if (r->gaierr == EAI_SYSTEM) {
+    SetError(&NetBuf->error, ET_ERRNO, r->syserr, NULL);
+    return FALSE;
+  } else if (r->gaierr != 0) {
+    SetError(&NetBuf->error, ET_GAI, r->gaierr, NULL);
+    return FALSE;
+  }
+
+  r->next = r->addrs;
+  if (!ConnectNextAddress(NetBuf)) {
+    return FALSE;
+  }
+
+  if (!NetBuf->WaitConnect) {
+    NetBuf->status = NetBuf->socks ? NBS_SOCKSCONNECT : NBS_CONNECTED;
+    NetBuf->sockstat = NBSS_METHODS;
+  }
+
+  if (r->socksaddrs) {
+    haddr = &((struct sockaddr_in *)r->socksaddrs->ai_addr)->sin_addr;
+  }
+  if (NetBuf->socks
+      && !StartSocksNegotiation(NetBuf, r->RemoteHost, r->RemotePort,
+                                haddr)) {
+    return FALSE;
+  }
+
+  if (!NetBuf->WaitConnect) {
+    FreeResolver(NetBuf);
+  }
+
+  /* Notify the owner if necessary to check for the connection
+   * completing and/or for data to be writeable */
+  NetBufCallBack(NetBuf, FALSE);
+  return TRUE;
+}
+#endif /* ASYNC_RESOLVE */
+
+/* 
+ * Starts connecting the given network buffer to the named host, via the
+ * SOCKS server (if any). Where possible the host name is looked up in
+ * the background, so the connect may not start until the buffer leaves
+ * the NBS_RESOLVING state.
+ */
 gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
                                    const gchar *bindaddr,
                                    gchar *RemoteHost, unsigned RemotePort)
 {
   gchar *realhost;
   unsigned realport;
+#ifndef ASYNC_RESOLVE
   gboolean doneOK;
+#endif
 
   ShutdownNetworkBuffer(NetBuf);
 
@@ -271,6 +768,10 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
     realport = RemotePort;
   }
 
+#ifdef ASYNC_RESOLVE
+  return StartResolve(NetBuf, bindaddr, realhost, realport,
+                      RemoteHost, RemotePort);
+#else
   if (StartConnect(&NetBuf->fd, bindaddr, realhost, realport, &doneOK,
                    &NetBuf->error)) {
 #ifdef CYGIN
@@ -288,7 +789,7 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
     }
 
     if (NetBuf->socks
-        && !StartSocksNegotiation(NetBuf, RemoteHost, RemotePort)) {
+        && !StartSocksNegotiation(NetBuf, RemoteHost, RemotePort, NULL)) {
       return FALSE;
     }
 
@@ -300,6 +801,7 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
   } else {
     return FALSE;
   }
+#endif /* ASYNC_RESOLVE */
 }
 
 /* 
@@ -310,6 +812,14 @@ void ShutdownNetworkBuffer(NetworkBuffer *NetBuf)
 {
   NetBufCallBackStop(NetBuf);
 
+  if (NetBuf->Corked) {
+    CorkedBuffers = g_slist_remove(CorkedBuffers, NetBuf);
+  }
+
+#ifdef ASYNC_RESOLVE
+  FreeResolver(NetBuf);
+#endif
+
   if (NetBuf->fd >= 0) {
     CloseSocket(NetBuf->fd);
     g_io_channel_unref(NetBuf->ioch);
@@ -317,6 +827,8 @@ void ShutdownNetworkBuffer(NetworkBuffer *NetBuf)
   }
 
   FreeConnBuf(&NetBuf->ReadBuf);
+  FreeMsgIndex(&NetBuf->ReadIndex);
+  g_free(NetBuf->ConvMessage);
   FreeConnBuf(&NetBuf->WriteBuf);
   FreeConnBuf(&NetBuf->negbuf);
 
@@ -597,22 +1109,39 @@ static gboolean DoNetworkBufferStuff(NetworkBuffer *NetBuf,
 
   if (ErrorReady || NetBuf->error)
     *ErrorOK = FALSE;
+#ifdef ASYNC_RESOLVE
+  else if (NetBuf->status == NBS_RESOLVING) {
+    if (ReadReady && !FinishResolve(NetBuf))
+      *ErrorOK = FALSE;
+  }
+#endif
   else if (NetBuf->WaitConnect) {
     if (WriteReady) {
       retval = FinishConnect(NetBuf->fd, &NetBuf->error);
       ConnectDone = TRUE;
       NetBuf->WaitConnect = FALSE;
 
-      if (retval) {
+#ifdef ASYNC_RESOLVE
+      /* If the host has other addresses (e.g. both IPv6 and IPv4) then
+       * try the next one */
+      if (!retval && NetBuf->resolver) {
+        retval = ConnectNextAddress(NetBuf);
+      }
+#endif
+
+      if (!retval) {
+        NetBuf->status = NBS_PRECONNECT;
+        *WriteOK = FALSE;
+      } else if (!NetBuf->WaitConnect) {
         if (NetBuf->socks) {
           NetBuf->status = NBS_SOCKSCONNECT;
           NetBuf->sockstat = NBSS_METHODS;
         } else {
           NetBuf->status = NBS_CONNECTED;
         }
-      } else {
-        NetBuf->status = NBS_PRECONNECT;
-        *WriteOK = FALSE;
+#ifdef ASYNC_RESOLVE
+        FreeResolver(NetBuf);
+#endif
       }
     }
   } else {
@@ -638,8 +1167,17 @@ static gboolean DoNetworkBufferStuff(NetworkBuffer *NetBuf,
   if (!(*ErrorOK && *WriteOK && *ReadOK)) {
     /* We don't want to check the socket any more */
     NetBufCallBackStop(NetBuf);
+#ifdef ASYNC_RESOLVE
+    /* While resolving, the descriptor is the resolver's pipe, which is not
+     * ours to close */
+    if (NetBuf->status == NBS_RESOLVING) {
+      FreeResolver(NetBuf);
+      NetBuf->status = NBS_PRECONNECT;
+    }
+#endif
     /* If there were errors, then the socket is now useless - so close it */
-    CloseSocket(NetBuf->fd);
+    if (NetBuf->fd >= 0)
+      CloseSocket(NetBuf->fd);
     NetBuf->fd = -1;
   } else if (ConnectDone) {
     /* If we just connected, then no need to listen for write-ready status
@@ -700,6 +1238,34 @@ gboolean NetBufHandleNetwork(NetworkBuffer *NetBuf, gboolean ReadReady,
   return DataWaiting;
 }
 
+/* 
+ * Finds the boundaries of any complete messages in the read buffer that
+ * have not been found already. Scanning resumes where it last left off,
+ * so each byte is only examined once, however many reads it takes for a
+ * message to arrive. Terminators are found with memchr(), of which C
+ * libraries provide vectorized (e.g. SSE2 or AVX2) implementations.
+ */
+static void IndexWaitingMessages(NetworkBuffer *NetBuf)
+{
+  ConnBuf *conn = &NetBuf->ReadBuf;
+  MsgIndex *idx = &NetBuf->ReadIndex;
+  gchar *data, *SepPt;
+
+  if (!conn->Data)
+    return;
+
+  data = &conn->Data[conn->Start];
+  while (idx->Scanned < conn->DataPresent) {
+    SepPt = memchr(&data[idx->Scanned], NetBuf->Terminator,
+                   conn->DataPresent - idx->Scanned);
+    if (!SepPt) {
+      idx->Scanned = conn->DataPresent;
+      break;
+    }
+    AddIndexedMessage(idx, SepPt + 1 - &data[idx->Indexed]);
+  }
+}
+
 /* 
  * Returns the number of complete (terminated) messages waiting in the
  * given network buffer. This is the number of times that
@@ -707,20 +1273,11 @@ gboolean NetBufHandleNetwork(NetworkBuffer *NetBuf, gboolean ReadReady,
  */
 gint CountWaitingMessages(NetworkBuffer *NetBuf)
 {
-  ConnBuf *conn;
-  gint i, msgs = 0;
-
   if (NetBuf->status != NBS_CONNECTED)
     return 0;
 
-  conn = &NetBuf->ReadBuf;
-
-  if (conn->Data)
-    for (i = 0; i < conn->DataPresent; i++) {
-      if (conn->Data[i] == NetBuf->Terminator)
-        msgs++;
-    }
-  return msgs;
+  IndexWaitingMessages(NetBuf);
+  return NetBuf->ReadIndex.Count;
 }
 
 gchar *PeekWaitingData(NetworkBuffer *NetBuf, int numbytes)
@@ -731,7 +1288,7 @@ gchar *PeekWaitingData(NetworkBuffer *NetBuf, int numbytes)
   if (!conn->Data || conn->DataPresent < numbytes)
     return NULL;
   else
-    return conn->Data;
+    return &conn->Data[conn->Start];
 }
 
 gchar *GetWaitingData(NetworkBuffer *NetBuf, int numbytes)
@@ -744,11 +1301,9 @@ gchar *GetWaitingData(NetworkBuffer *NetBuf, int numbytes)
     return NULL;
 
   data = g_new(gchar, numbytes);
-  memcpy(data, conn->Data, numbytes);
-
-  memmove(&conn->Data[0], &conn->Data[numbytes],
-          conn->DataPresent - numbytes);
-  conn->DataPresent -= numbytes;
+  memcpy(data, &conn->Data[conn->Start], numbytes);
+  ConsumeConnBuf(conn, numbytes);
+  ClearMsgIndex(&NetBuf->ReadIndex);
 
   return data;
 }
@@ -757,36 +1312,71 @@ gchar *GetWaitingData(NetworkBuffer *NetBuf, int numbytes)
  * Reads a complete (terminated) message from the network buffer. The
  * message is removed from the buffer, and returned as a null-terminated
  * string (the network terminator is removed). If no complete message is
- * waiting, NULL is returned. The string is dynamically allocated, and
- * so must be g_free'd by the caller.
+ * waiting, NULL is returned. Unlike GetWaitingMessage(), the string is
+ * not a copy but points into the read buffer itself; it must not be
+ * freed, and remains valid only until more data are read from the wire,
+ * this function returns NULL, or the buffer is shut down. (Since
+ * consuming messages never moves the data behind them, earlier messages
+ * stay valid while later ones are read.) If "len" is non-NULL, it is set
+ * to the length of the message.
  */
-gchar *GetWaitingMessage(NetworkBuffer *NetBuf)
+gchar *GetWaitingMessageView(NetworkBuffer *NetBuf, gint *len)
 {
   ConnBuf *conn;
+  MsgIndex *idx;
   int MessageLen;
-  char *SepPt;
-  gchar *NewMessage;
+  char *MsgStart, *SepPt;
 
   conn = &NetBuf->ReadBuf;
+  idx = &NetBuf->ReadIndex;
   if (!conn->Data || !conn->DataPresent || NetBuf->status != NBS_CONNECTED) {
+    /* Callers are done with earlier messages once they reach the end of
+     * the buffer, so it can go back to the pool if it is empty */
+    if (conn->DataPresent == 0) {
+      ReleaseConnBuf(conn);
+      FreeMsgIndex(idx);
+    }
     return NULL;
   }
-  SepPt = memchr(conn->Data, NetBuf->Terminator, conn->DataPresent);
-  if (!SepPt)
+
+  IndexWaitingMessages(NetBuf);
+  if (idx->Count == 0)
     return NULL;
+  MessageLen = idx->Lens[idx->Head];
+  idx->Head = (idx->Head + 1) % idx->Size;
+  idx->Count--;
+  idx->Indexed -= MessageLen;
+  idx->Scanned -= MessageLen;
+
+  MsgStart = &conn->Data[conn->Start];
+  ConsumeConnBuf(conn, MessageLen);
+  SepPt = &MsgStart[MessageLen - 1];
   *SepPt = '\0';
-  MessageLen = SepPt - conn->Data + 1;
-  SepPt--;
-  if (NetBuf->StripChar && *SepPt == NetBuf->StripChar)
+  if (SepPt > MsgStart && NetBuf->StripChar
+      && SepPt[-1] == NetBuf->StripChar) {
+    SepPt--;
     *SepPt = '\0';
-  NewMessage = g_new(gchar, MessageLen);
-
-  memcpy(NewMessage, conn->Data, MessageLen);
-  if (MessageLen < conn->DataPresent) {
-    memmove(&conn->Data[0], &conn->Data[MessageLen],
-            conn->DataPresent - MessageLen);
   }
-  conn->DataPresent -= MessageLen;
+  if (len)
+    *len = SepPt - MsgStart;
+  return MsgStart;
+}
+
+/* 
+ * Reads a complete (terminated) message from the network buffer, as
+ * for GetWaitingMessageView(). The string is dynamically allocated, and
+ * so must be g_free'd by the caller.
+ */
+gchar *GetWaitingMessage(NetworkBuffer *NetBuf)
+{
+  gchar *view, *NewMessage;
+  gint len;
+
+  view = GetWaitingMessageView(NetBuf, &len);
+  if (!view)
+    return NULL;
+  NewMessage = g_new(gchar, len + 1);
+  memcpy(NewMessage, view, len + 1);
   return NewMessage;
 }
 
@@ -801,20 +1391,20 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
   int CurrentPosition, BytesRead;
 
   conn = &NetBuf->ReadBuf;
-  CurrentPosition = conn->DataPresent;
+  CurrentPosition = conn->Start + conn->DataPresent;
   while (1) {
+    if (CurrentPosition >= conn->Length && conn->Start > 0) {
+      /* Reuse the space freed by messages already read, if any */
+      CompactConnBuf(conn);
+      CurrentPosition = conn->DataPresent;
+    }
     if (CurrentPosition >= conn->Length) {
       if (conn->Length == MAXREADBUF) {
         SetError(&NetBuf->error, ET_CUSTOM, E_FULLBUF, NULL);
         return FALSE;           /* drop connection */
       }
-      if (conn->Length == 0)
-        conn->Length = 256;
-      else
-        conn->Length *= 2;
-      if (conn->Length > MAXREADBUF)
-        conn->Length = MAXREADBUF;
-      conn->Data = g_realloc(conn->Data, conn->Length);
+      ResizeConnBuf(conn, conn->Length == 0 ? MINCONNBUF : conn->Length * 2);
+      CurrentPosition = conn->DataPresent;
     }
     BytesRead = recv(NetBuf->fd, &conn->Data[CurrentPosition],
                      conn->Length - CurrentPosition, 0);
@@ -840,7 +1430,7 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
       return FALSE;
     } else {
       CurrentPosition += BytesRead;
-      conn->DataPresent = CurrentPosition;
+      conn->DataPresent = CurrentPosition - conn->Start;
     }
   }
   return TRUE;
@@ -848,42 +1438,146 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
 
 gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error)
 {
-  int newlen;
+  int newlen, length;
 
   newlen = conn->DataPresent + numbytes;
   if (newlen > conn->Length) {
-    conn->Length *= 2;
-    conn->Length = MAX(conn->Length, newlen);
-    if (conn->Length > MAXWRITEBUF)
-      conn->Length = MAXWRITEBUF;
-    if (newlen > conn->Length) {
+    length = MIN(MAX(conn->Length * 2, MINCONNBUF), MAXWRITEBUF);
+    while (length < newlen && length < MAXWRITEBUF)
+      length *= 2;
+    if (newlen > length) {
       if (error)
         SetError(error, ET_CUSTOM, E_FULLBUF, NULL);
       return NULL;
     }
-    conn->Data = g_realloc(conn->Data, conn->Length);
+    ResizeConnBuf(conn, length);
+  } else if (conn->Start + newlen > conn->Length) {
+    CompactConnBuf(conn);
   }
 
-  return (&conn->Data[conn->DataPresent]);
+  return (&conn->Data[conn->Start + conn->DataPresent]);
 }
 
 void CommitWriteBuffer(NetworkBuffer *NetBuf, ConnBuf *conn,
                        gchar *addpt, guint addlen)
 {
+  gboolean WasEmpty = (conn->DataPresent == 0);
+
   conn->DataPresent += addlen;
+  if (NetBuf && WasEmpty && conn == &NetBuf->WriteBuf)
+    NetBuf->WriteWaitStart = time(NULL);
 
   /* If the buffer was empty before, we may need to tell the owner to
-   * check the socket for write-ready status */
-  if (NetBuf && addpt == conn->Data)
-    NetBufCallBack(NetBuf, FALSE);
+   * check the socket for write-ready status (unless we are corked, in
+   * which case we just try to write the data later) */
+  if (NetBuf && WasEmpty) {
+    if (CorkDepth > 0 && conn == &NetBuf->WriteBuf
+        && NetBuf->status == NBS_CONNECTED) {
+      if (!NetBuf->Corked) {
+        NetBuf->Corked = TRUE;
+        CorkedBuffers = g_slist_prepend(CorkedBuffers, NetBuf);
+      }
+    } else {
+      NetBufCallBack(NetBuf, FALSE);
+    }
+  }
+}
+
+/* 
+ * Holds back data written to network buffers until the matching call to
+ * UncorkNetworkBuffers, so that all of the messages generated while
+ * handling an event go out together. Calls may be nested.
+ */
+void CorkNetworkBuffers(void)
+{
+  CorkDepth++;
+}
+
+/* 
+ * Writes out the data held back since CorkNetworkBuffers. Each buffer is
+ * sent with a single send() call where possible; only if the connection
+ * cannot take all of it is the owner asked to wait for write-ready status.
+ */
+void UncorkNetworkBuffers(void)
+{
+  NetworkBuffer *NetBuf;
+  GSList *list;
+
+  if (CorkDepth <= 0 || --CorkDepth > 0)
+    return;
+
+  list = g_slist_reverse(CorkedBuffers);
+  CorkedBuffers = NULL;
+  while (list) {
+    NetBuf = (NetworkBuffer *)list->data;
+    list = g_slist_delete_link(list, list);
+    NetBuf->Corked = FALSE;
+
+    if (!NetBuf->error && NetBuf->fd >= 0) {
+      WriteBufToWire(NetBuf, &NetBuf->WriteBuf);
+    }
+    /* Errors are handled the next time the connection is checked */
+    if (NetBuf->WriteBuf.DataPresent > 0 || NetBuf->error) {
+      NetBufCallBack(NetBuf, FALSE);
+    }
+  }
+}
+
+/* 
+ * Returns space for "numbytes" more bytes in the network buffer's write
+ * buffer, or NULL if it is full. In the latter case the message cannot
+ * be sent, so the connection is marked as failed (see
+ * IsNetworkBufferFull).
+ */
+static gchar *ExpandNetworkWriteBuffer(NetworkBuffer *NetBuf, int numbytes)
+{
+  gchar *addpt;
+
+  addpt = ExpandWriteBuffer(&NetBuf->WriteBuf, numbytes, NULL);
+  if (!addpt && !NetBuf->error) {
+    SetError(&NetBuf->error, ET_CUSTOM, E_FULLBUF, NULL);
+    FullWriteBuffers++;
+  }
+  return addpt;
+}
+
+/* 
+ * Returns TRUE if the other end of the connection is not keeping up with
+ * the data written to it, such that only essential messages should be
+ * sent to it until it catches up.
+ */
+gboolean IsNetworkBufferCongested(NetworkBuffer *NetBuf)
+{
+  return (NetBuf->WriteBuf.DataPresent >= CONGESTEDWRITEBUF);
+}
+
+/* 
+ * Returns TRUE if a message could not be written to the connection
+ * because its write buffer was full, so that it should be dropped.
+ */
+gboolean IsNetworkBufferFull(NetworkBuffer *NetBuf)
+{
+  return (NetBuf->error && NetBuf->error->type == ET_CUSTOM
+          && NetBuf->error->code == E_FULLBUF);
+}
+
+/* 
+ * Returns the time, in seconds, for which data have been waiting to be
+ * written to the connection without any of them being sent.
+ */
+gint GetNetworkBufferLag(NetworkBuffer *NetBuf)
+{
+  if (NetBuf->WriteBuf.DataPresent == 0 || NetBuf->WriteWaitStart == 0)
+    return 0;
+  return (gint)(time(NULL) - NetBuf->WriteWaitStart);
 }
 
 /* 
  * Writes the null-terminated string "data" to the network buffer, ready
  * to be sent to the wire when the network connection becomes free. The
- * message is automatically terminated. Fails to write the message without
- * error if the buffer reaches its maximum size (although this error will
- * be detected when an attempt is made to write the buffer to the wire).
+ * message is automatically terminated. If the buffer reaches its maximum
+ * size the message is not written, and the connection is marked as
+ * failed.
  */
 void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data)
 {
@@ -896,7 +1590,7 @@ void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data)
   if (!data)
     return;
   addlen = strlen(data) + 1;
-  addpt = ExpandWriteBuffer(conn, addlen, NULL);
+  addpt = ExpandNetworkWriteBuffer(NetBuf, addlen);
   if (!addpt)
     return;
 
@@ -924,15 +1618,20 @@ static struct hostent *LookupHostname(const gchar *host, LastError **error)
   return he;
 }
 
+/* 
+ * Queues the start of a SOCKS negotiation to connect to the given host.
+ * SOCKS4 servers must be given the IPv4 address of the host; if "haddr"
+ * is NULL, this is looked up here.
+ */
 gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
-                               unsigned RemotePort)
+                               unsigned RemotePort,
+                               const struct in_addr *haddr)
 {
   guint num_methods;
   ConnBuf *conn;
   struct hostent *he;
   gchar *addpt;
   guint addlen, i;
-  struct in_addr *haddr;
   unsigned short int netport;
   gchar *username = NULL;
 
@@ -968,9 +1667,12 @@ gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
     return TRUE;
   }
 
-  he = LookupHostname(RemoteHost, &NetBuf->error);
-  if (!he)
-    return FALSE;
+  if (!haddr) {
+    he = LookupHostname(RemoteHost, &NetBuf->error);
+    if (!he)
+      return FALSE;
+    haddr = (struct in_addr *)he->h_addr;
+  }
 
   if (NetBuf->socks->user && NetBuf->socks->user[0]) {
     username = g_strdup(NetBuf->socks->user);
@@ -1001,7 +1703,6 @@ gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
   }
   addlen = 9 + strlen(username);
 
-  haddr = (struct in_addr *)he->h_addr;
   g_assert(sizeof(struct in_addr) == 4);
 
   netport = htons(RemotePort);
@@ -1030,13 +1731,9 @@ static gboolean WriteBufToWire(NetworkBuffer *NetBuf, ConnBuf *conn)
 
   if (!conn->Data || !conn->DataPresent)
     return TRUE;
-  if (conn->Length == MAXWRITEBUF) {
-    SetError(&NetBuf->error, ET_CUSTOM, E_FULLBUF, NULL);
-    return FALSE;
-  }
   CurrentPosition = 0;
   while (CurrentPosition < conn->DataPresent) {
-    BytesSent = send(NetBuf->fd, &conn->Data[CurrentPosition],
+    BytesSent = send(NetBuf->fd, &conn->Data[conn->Start + CurrentPosition],
                      conn->DataPresent - CurrentPosition, 0);
     if (BytesSent == SOCKET_ERROR) {
 #ifdef CYGWIN
@@ -1060,18 +1757,20 @@ static gboolean WriteBufToWire(NetworkBuffer *NetBuf, ConnBuf *conn)
       CurrentPosition += BytesSent;
     }
   }
-  if (CurrentPosition > 0 && CurrentPosition < conn->DataPresent) {
-    memmove(&conn->Data[0], &conn->Data[CurrentPosition],
-            conn->DataPresent - CurrentPosition);
+  ConsumeConnBuf(conn, CurrentPosition);
+  ReleaseConnBuf(conn);
+  if (conn == &NetBuf->WriteBuf) {
+    if (conn->DataPresent == 0)
+      NetBuf->WriteWaitStart = 0;
+    else if (CurrentPosition > 0)
+      NetBuf->WriteWaitStart = time(NULL);
   }
-  conn->DataPresent -= CurrentPosition;
   return TRUE;
 }
 
 /* 
  * Writes any waiting data in the network buffer to the wire. Returns
- * TRUE on success, or FALSE if the buffer's maximum length is
- * reached, or the remote end has closed the connection.
+ * TRUE on success, or FALSE if the remote end has closed the connection.
  */
 gboolean WriteDataToWire(NetworkBuffer *NetBuf)
 {
@@ -1452,6 +2151,7 @@ gboolean StartConnect(int *fd, const gchar *bindaddr, gchar *RemoteHost,
   memset(ClientAddr.sin_zero, 0, sizeof(ClientAddr.sin_zero));
 
   SetBlocking(*fd, FALSE);
+  SetNoDelay(*fd);
 
   if (connect(*fd, (struct sockaddr *)&ClientAddr,
               sizeof(struct sockaddr)) == SOCKET_ERROR) {
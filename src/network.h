@@ -90,10 +90,31 @@ typedef struct _CurlConnection {
 typedef struct _ConnBuf {
   gchar *Data;                  /* bytes waiting to be read/written */
   gint Length;                  /* allocated length of the "Data" buffer */
-  gint DataPresent;             /* number of bytes currently in "Data" */
+  gint Start;                   /* offset in "Data" of the first waiting
+                                 * byte; consumed bytes before this are
+                                 * only reclaimed when space is needed */
+  gint DataPresent;             /* number of bytes waiting in "Data",
+                                 * starting at "Start" */
 } ConnBuf;
 
+/* Number of connections dropped because their write buffer filled */
+extern guint FullWriteBuffers;
+
+/* The boundaries of the messages found in a read buffer, so that its
+ * data need only be scanned once (see IndexWaitingMessages) */
+typedef struct _MsgIndex {
+  gint *Lens;                   /* Lengths of the complete messages at the
+                                 * start of the buffer, as a ring buffer */
+  gint Size;                    /* Allocated size of "Lens" */
+  gint Head;                    /* Index in "Lens" of the first message */
+  gint Count;                   /* Number of messages in "Lens" */
+  gint Indexed;                 /* Bytes taken up by these messages */
+  gint Scanned;                 /* Bytes scanned so far; any after
+                                 * "Indexed" are an incomplete message */
+} MsgIndex;
+
 typedef struct _NetworkBuffer NetworkBuffer;
+typedef struct _Resolver Resolver;
 
 typedef void (*NBCallBack) (NetworkBuffer *NetBuf, gboolean Read,
                             gboolean Write, gboolean Exception,
@@ -118,6 +139,7 @@ typedef struct _SocksServer {
 /* The status of a network buffer */
 typedef enum {
   NBS_PRECONNECT,               /* Socket is not yet connected */
+  NBS_RESOLVING,                /* The host name is being looked up */
   NBS_SOCKSCONNECT,             /* A CONNECT request is being sent to a
                                  * SOCKS server */
   NBS_CONNECTED                 /* Socket is connected */
@@ -143,7 +165,16 @@ struct _NetworkBuffer {
   char StripChar;               /* Char that should be removed
                                  * from messages */
   ConnBuf ReadBuf;              /* New data, waiting for the application */
+  MsgIndex ReadIndex;           /* Complete messages found in ReadBuf */
+  gchar *ConvMessage;           /* Converted copy of the last message
+                                 * returned by GetWaitingPlayerMessageView,
+                                 * if it needed conversion */
   ConnBuf WriteBuf;             /* Data waiting to be written to the wire */
+  time_t WriteWaitStart;        /* When the wire last accepted data
+                                 * from a non-empty WriteBuf, or the
+                                 * data started waiting (0 if empty) */
+  gboolean Corked;              /* TRUE if WriteBuf is waiting to be
+                                 * written by UncorkNetworkBuffers */
   ConnBuf negbuf;               /* Output for protocol negotiation
                                  * (e.g. SOCKS) */
   gboolean WaitConnect;         /* TRUE if a non-blocking connect is in
@@ -154,8 +185,11 @@ struct _NetworkBuffer {
   NBUserPasswd userpasswd;      /* Function to supply username and
                                  * password for SOCKS5 authentication */
   gpointer userpasswddata;      /* data to pass to the above function */
-  gchar *host;                  /* If non-NULL, the host to connect to */
+  gchar *host;                  /* If non-NULL, the host to connect to
+                                 * (or, on the server, connected from) */
   unsigned port;                /* If non-NULL, the port to connect to */
+  Resolver *resolver;           /* If non-NULL, the addresses being looked
+                                 * up or tried for a connect */
   LastError *error;             /* Any error from the last operation */
 };
 
@@ -185,7 +219,11 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf);
 gboolean WriteDataToWire(NetworkBuffer *NetBuf);
 void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data);
 gint CountWaitingMessages(NetworkBuffer *NetBuf);
+gboolean IsNetworkBufferCongested(NetworkBuffer *NetBuf);
+gboolean IsNetworkBufferFull(NetworkBuffer *NetBuf);
+gint GetNetworkBufferLag(NetworkBuffer *NetBuf);
 gchar *GetWaitingMessage(NetworkBuffer *NetBuf);
+gchar *GetWaitingMessageView(NetworkBuffer *NetBuf, gint *len);
 void SendSocks5UserPasswd(NetworkBuffer *NetBuf, gchar *user,
                           gchar *password);
 gchar *GetWaitingData(NetworkBuffer *NetBuf, int numbytes);
@@ -193,6 +231,8 @@ gchar *PeekWaitingData(NetworkBuffer *NetBuf, int numbytes);
 gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error);
 void CommitWriteBuffer(NetworkBuffer *NetBuf, ConnBuf *conn, gchar *addpt,
                        guint addlen);
+void CorkNetworkBuffers(void);
+void UncorkNetworkBuffers(void);
 
 #define DOPE_CURL_ERROR dope_curl_error_quark()
 GQuark dope_curl_error_quark(void);
@@ -223,10 +263,13 @@ void StopNetworking(void);
 #ifdef CYGWIN
 #define CloseSocket(sock) closesocket(sock)
 void SetReuse(SOCKET sock);
+void SetNoDelay(SOCKET sock);
 void SetBlocking(SOCKET sock, gboolean blocking);
 #else
 #define CloseSocket(sock) close(sock)
 void SetReuse(int sock);
+gboolean SetReusePort(int sock);
+void SetNoDelay(int sock);
 void SetBlocking(int sock, gboolean blocking);
 #endif
 
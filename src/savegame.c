@@ -0,0 +1,559 @@
+/************************************************************************
+ * savegame.c     Saving and resuming players' games on the server      *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <glib.h>
+
+#include "dopewars.h"
+#include "gameroom.h"
+#include "savegame.h"
+#include "util.h"
+
+/* 
+ * Each player's game is saved in its own small file in the save
+ * directory, named after the player and its game room (see
+ * SaveFileName), so that a player has a separate game in each room, in
+ * which prices and settings may differ. The file holds the magic string
+ * "DWSG", a version byte, the length of the snapshot and an FNV-1a
+ * checksum of it (4 bytes each), followed by the snapshot.
+ * All numbers are big-endian; prices take 8 bytes, other numbers 4, and
+ * strings are a length followed by the bytes. The snapshot is:
+ *   - the world it was saved in: NumLocation, NumDrug, NumGun and a
+ *     checksum of their names (see WorldFingerprint)
+ *   - the name of the game room, "" for the main game
+ *   - the player's name, turn, date (as a Julian day), cash, debt, bank,
+ *     health, coat size, location, flags, bitches and cop index
+ *   - the number carried and total value of each drug, then each gun
+ *   - the names of the players in its spy list, with their turn counts,
+ *     then the same for its tip-off list
+ * A file is replaced by writing a new one and renaming it over the old,
+ * so that a crash never leaves a half-written save behind.
+ */
+#define SAVEMAGIC   "DWSG"
+#define SAVEVERSION 2
+#define SAVEHDRLEN  13
+
+/* Flags that are part of the game, rather than of the current turn or
+ * of other players that may not be around when it is resumed */
+#define SAVEDFLAGS (FIRSTTURN | DEADHARDASS | TIPPEDOFF | SPIEDON)
+
+/* Walks through a snapshot being read */
+typedef struct _SaveReader {
+  const guchar *Pos, *End;
+  gboolean OK;                  /* FALSE once the end has been overrun */
+} SaveReader;
+
+static void PutSaveInt(GString *str, guint32 val)
+{
+  g_string_append_c(str, (gchar)((val >> 24) & 0xFF));
+  g_string_append_c(str, (gchar)((val >> 16) & 0xFF));
+  g_string_append_c(str, (gchar)((val >> 8) & 0xFF));
+  g_string_append_c(str, (gchar)(val & 0xFF));
+}
+
+static void PutSavePrice(GString *str, price_t val)
+{
+  guint64 uval = (guint64)(gint64)val;
+
+  PutSaveInt(str, (guint32)(uval >> 32));
+  PutSaveInt(str, (guint32)(uval & 0xFFFFFFFFU));
+}
+
+static void PutSaveString(GString *str, const gchar *val)
+{
+  guint32 len = strlen(val);
+
+  PutSaveInt(str, len);
+  g_string_append_len(str, val, len);
+}
+
+static guint32 GetSaveInt(SaveReader *rd)
+{
+  const guchar *data = rd->Pos;
+
+  if (!rd->OK || rd->End - rd->Pos < 4) {
+    rd->OK = FALSE;
+    return 0;
+  }
+  rd->Pos += 4;
+  return ((guint32)data[0] << 24) | ((guint32)data[1] << 16)
+      | ((guint32)data[2] << 8) | (guint32)data[3];
+}
+
+static price_t GetSavePrice(SaveReader *rd)
+{
+  guint64 uval = (guint64)GetSaveInt(rd) << 32;
+
+  uval |= GetSaveInt(rd);
+  return (price_t)(gint64)uval;
+}
+
+/* 
+ * Returns the next string in the snapshot, which points into the
+ * snapshot itself and so is not nul-terminated; its length is returned
+ * in "len".
+ */
+static const gchar *GetSaveString(SaveReader *rd, guint32 *len)
+{
+  const gchar *str;
+
+  *len = GetSaveInt(rd);
+  if (!rd->OK || (guint32)(rd->End - rd->Pos) < *len) {
+    rd->OK = FALSE;
+    *len = 0;
+    return "";
+  }
+  str = (const gchar *)rd->Pos;
+  rd->Pos += *len;
+  return str;
+}
+
+static guint32 SaveChecksum(const guchar *data, gsize len)
+{
+  guint32 sum = 2166136261U;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    sum ^= data[i];
+    sum *= 16777619U;
+  }
+  return sum;
+}
+
+/* 
+ * Returns a checksum of the names of the locations, drugs and guns, so
+ * that a game is not resumed in a different world.
+ */
+static guint32 WorldFingerprint(void)
+{
+  GString *names = g_string_new(NULL);
+  guint32 sum;
+  int i;
+
+  for (i = 0; i < NumLocation; i++)
+    PutSaveString(names, Location[i].Name);
+  for (i = 0; i < NumDrug; i++)
+    PutSaveString(names, Drug[i].Name);
+  for (i = 0; i < NumGun; i++)
+    PutSaveString(names, Gun[i].Name);
+  sum = SaveChecksum((guchar *)names->str, names->len);
+  g_string_free(names, TRUE);
+  return sum;
+}
+
+/* 
+ * Returns the name of player "Play"'s game room, "" for the main game.
+ */
+static const gchar *SaveRoomName(Player *Play)
+{
+  return Play->Room ? Play->Room->Name : "";
+}
+
+static void PutSaveList(GString *str, DopeList *List)
+{
+  int i;
+
+  PutSaveInt(str, List->Number);
+  for (i = 0; i < List->Number; i++) {
+    PutSaveString(str, GetPlayerName(List->Data[i].Play));
+    PutSaveInt(str, List->Data[i].Turns);
+  }
+}
+
+/* 
+ * Reads a spy or tip-off list from the snapshot. If "List" is non-NULL,
+ * the entries for players that are in "Room" are added to it; others
+ * are dropped, as those players have left the game.
+ */
+static void GetSaveList(SaveReader *rd, DopeList *List, GameRoom *Room)
+{
+  guint32 num, i, len;
+  const gchar *name;
+  gchar *namestr;
+  DopeEntry entry;
+
+  num = GetSaveInt(rd);
+  for (i = 0; i < num && rd->OK; i++) {
+    name = GetSaveString(rd, &len);
+    entry.Turns = (gint32)GetSaveInt(rd);
+    if (List && Room && rd->OK) {
+      namestr = g_strndup(name, len);
+      entry.Play = GetRoomPlayerByName(Room, namestr);
+      if (entry.Play)
+        AddListEntry(List, &entry);
+      g_free(namestr);
+    }
+  }
+}
+
+/* 
+ * Appends a snapshot of player "Play"'s game to "str".
+ */
+void PutPlayerSnapshot(GString *str, Player *Play)
+{
+  int i;
+
+  PutSaveInt(str, NumLocation);
+  PutSaveInt(str, NumDrug);
+  PutSaveInt(str, NumGun);
+  PutSaveInt(str, WorldFingerprint());
+  PutSaveString(str, SaveRoomName(Play));
+
+  PutSaveString(str, GetPlayerName(Play));
+  PutSaveInt(str, Play->Turn);
+  PutSaveInt(str, g_date_get_julian(Play->date));
+  PutSavePrice(str, Play->Cash);
+  PutSavePrice(str, Play->Debt);
+  PutSavePrice(str, Play->Bank);
+  PutSaveInt(str, Play->Health);
+  PutSaveInt(str, Play->CoatSize);
+  PutSaveInt(str, Play->IsAt);
+  PutSaveInt(str, Play->Flags & SAVEDFLAGS);
+  PutSaveInt(str, Play->Bitches.Carried);
+  PutSaveInt(str, Play->CopIndex);
+  for (i = 0; i < NumDrug; i++) {
+    PutSaveInt(str, Play->Drugs[i].Carried);
+    PutSavePrice(str, Play->Drugs[i].TotalValue);
+  }
+  for (i = 0; i < NumGun; i++) {
+    PutSaveInt(str, Play->Guns[i].Carried);
+    PutSavePrice(str, Play->Guns[i].TotalValue);
+  }
+  PutSaveList(str, &Play->SpyList);
+  PutSaveList(str, &Play->TipList);
+}
+
+/* 
+ * Returns TRUE if the snapshot "data", of length "len", was saved in
+ * player "Play"'s game room.
+ */
+static gboolean SnapshotInRoom(Player *Play, const gchar *data, gsize len)
+{
+  SaveReader rd;
+  const gchar *room, *name;
+  guint32 roomlen;
+
+  rd.Pos = (const guchar *)data;
+  rd.End = rd.Pos + len;
+  rd.OK = TRUE;
+  GetSaveInt(&rd);
+  GetSaveInt(&rd);
+  GetSaveInt(&rd);
+  GetSaveInt(&rd);
+  room = GetSaveString(&rd, &roomlen);
+  name = SaveRoomName(Play);
+  return rd.OK && roomlen == strlen(name)
+      && memcmp(room, name, roomlen) == 0;
+}
+
+/* 
+ * Restores player "Play"'s game from the snapshot "data", of length
+ * "len". The player's inventories must already be allocated, and it
+ * must be in its game room, so that its spy and tip-off lists can be
+ * restored. Nothing is changed, and FALSE is returned, if the snapshot
+ * is damaged, is not for this player or room, or was saved in a
+ * different world.
+ */
+gboolean GetPlayerSnapshot(Player *Play, const gchar *data, gsize len)
+{
+  SaveReader rd;
+  Inventory *drugs, *guns;
+  const guchar *lists;
+  const gchar *name;
+  guint32 namelen, julian, flags;
+  gint turn, health, coatsize, isat, bitches, copindex;
+  price_t cash, debt, bank;
+  gboolean ok = TRUE;
+  int i;
+
+  rd.Pos = (const guchar *)data;
+  rd.End = rd.Pos + len;
+  rd.OK = TRUE;
+
+  if (GetSaveInt(&rd) != NumLocation || GetSaveInt(&rd) != NumDrug
+      || GetSaveInt(&rd) != NumGun || GetSaveInt(&rd) != WorldFingerprint()
+      || !SnapshotInRoom(Play, data, len))
+    return FALSE;
+  GetSaveString(&rd, &namelen);  /* The room name, checked above */
+  name = GetSaveString(&rd, &namelen);
+  if (namelen != strlen(GetPlayerName(Play))
+      || memcmp(name, GetPlayerName(Play), namelen) != 0)
+    return FALSE;
+
+  turn = (gint32)GetSaveInt(&rd);
+  julian = GetSaveInt(&rd);
+  cash = GetSavePrice(&rd);
+  debt = GetSavePrice(&rd);
+  bank = GetSavePrice(&rd);
+  health = (gint32)GetSaveInt(&rd);
+  coatsize = (gint32)GetSaveInt(&rd);
+  isat = (gint32)GetSaveInt(&rd);
+  flags = GetSaveInt(&rd);
+  bitches = (gint32)GetSaveInt(&rd);
+  copindex = (gint32)GetSaveInt(&rd);
+  drugs = g_new(Inventory, NumDrug);
+  guns = g_new(Inventory, NumGun);
+  for (i = 0; i < NumDrug; i++) {
+    drugs[i].Carried = (gint32)GetSaveInt(&rd);
+    drugs[i].TotalValue = GetSavePrice(&rd);
+    ok = ok && drugs[i].Carried >= 0;
+  }
+  for (i = 0; i < NumGun; i++) {
+    guns[i].Carried = (gint32)GetSaveInt(&rd);
+    guns[i].TotalValue = GetSavePrice(&rd);
+    ok = ok && guns[i].Carried >= 0;
+  }
+  lists = rd.Pos;
+  GetSaveList(&rd, NULL, NULL);
+  GetSaveList(&rd, NULL, NULL);
+
+  ok = ok && rd.OK && rd.Pos == rd.End && g_date_valid_julian(julian)
+      && isat >= 0 && isat < NumLocation && health > 0 && coatsize >= 0
+      && bitches >= 0;
+  if (ok) {
+    Play->Turn = turn;
+    g_date_set_julian(Play->date, julian);
+    Play->Cash = cash;
+    Play->Debt = debt;
+    Play->Bank = bank;
+    Play->Health = health;
+    Play->CoatSize = coatsize;
+    Play->IsAt = isat;
+    Play->Flags = flags & SAVEDFLAGS;
+    Play->Bitches.Carried = bitches;
+    Play->CopIndex = copindex;
+    for (i = 0; i < NumDrug; i++) {
+      Play->Drugs[i].Carried = drugs[i].Carried;
+      Play->Drugs[i].TotalValue = drugs[i].TotalValue;
+    }
+    for (i = 0; i < NumGun; i++) {
+      Play->Guns[i].Carried = guns[i].Carried;
+      Play->Guns[i].TotalValue = guns[i].TotalValue;
+    }
+    ClearList(&Play->SpyList);
+    ClearList(&Play->TipList);
+    rd.Pos = lists;
+    GetSaveList(&rd, &Play->SpyList, Play->Room);
+    GetSaveList(&rd, &Play->TipList, Play->Room);
+  }
+  g_free(drugs);
+  g_free(guns);
+  return ok;
+}
+
+/* 
+ * Appends "Name" to "file", escaping characters other than letters,
+ * digits, '-' and '_' as %xx.
+ */
+static void AppendSafeName(GString *file, const gchar *Name)
+{
+  const guchar *pt;
+
+  for (pt = (const guchar *)Name; *pt; pt++) {
+    if ((*pt < 128 && isalnum(*pt)) || *pt == '-' || *pt == '_')
+      g_string_append_c(file, (gchar)*pt);
+    else
+      g_string_append_printf(file, "%%%02x", *pt);
+  }
+}
+
+/* 
+ * Returns the name of the file in "Dir" for the player (or game room)
+ * called "Name", ending in "Suffix". Characters other than letters,
+ * digits, '-' and '_' are escaped as %xx, so that any name makes a safe
+ * file name.
+ */
+gchar *SafeFileName(const gchar *Dir, const gchar *Name,
+                    const gchar *Suffix)
+{
+  GString *file = g_string_new(Dir);
+
+  g_string_append_c(file, G_DIR_SEPARATOR);
+  AppendSafeName(file, Name);
+  g_string_append(file, Suffix);
+  return g_string_free(file, FALSE);
+}
+
+/* 
+ * Returns the name of the file in "Dir" that holds the saved game of
+ * the player called "Name" in the game room called "Room" - NAME.sav
+ * for the main game, or NAME.ROOM.sav otherwise. As '.' is always
+ * escaped in names, no two players or rooms can share a file.
+ */
+static gchar *SaveFileName(const gchar *Dir, const gchar *Name,
+                           const gchar *Room)
+{
+  GString *file = g_string_new(Dir);
+
+  g_string_append_c(file, G_DIR_SEPARATOR);
+  AppendSafeName(file, Name);
+  if (Room && Room[0]) {
+    g_string_append_c(file, '.');
+    AppendSafeName(file, Room);
+  }
+  g_string_append(file, ".sav");
+  return g_string_free(file, FALSE);
+}
+
+/* 
+ * Saves player "Play"'s game in the directory "Dir", replacing any
+ * earlier save. Returns FALSE (with errno set) on failure.
+ */
+gboolean SavePlayerGame(const gchar *Dir, Player *Play)
+{
+  GString *str = g_string_new(SAVEMAGIC);
+  gchar *file, *tmpfile;
+  FILE *fp;
+  gboolean ok;
+  int err;
+
+  g_string_append_c(str, SAVEVERSION);
+  PutSaveInt(str, 0);
+  PutSaveInt(str, 0);
+  PutPlayerSnapshot(str, Play);
+
+  /* Fill in the length and checksum, now that they are known */
+  {
+    GString *hdr = g_string_new(NULL);
+
+    PutSaveInt(hdr, str->len - SAVEHDRLEN);
+    PutSaveInt(hdr, SaveChecksum((guchar *)str->str + SAVEHDRLEN,
+                                 str->len - SAVEHDRLEN));
+    memcpy(str->str + 5, hdr->str, 8);
+    g_string_free(hdr, TRUE);
+  }
+
+  file = SaveFileName(Dir, GetPlayerName(Play), SaveRoomName(Play));
+  tmpfile = g_strdup_printf("%s.%ld.tmp", file, (long)getpid());
+  fp = fopen(tmpfile, "wb");
+  ok = (fp && fwrite(str->str, 1, str->len, fp) == str->len);
+  if (fp && fclose(fp) != 0)
+    ok = FALSE;
+#ifdef CYGWIN
+  /* Windows cannot rename over an existing file */
+  if (ok)
+    unlink(file);
+#endif
+  ok = ok && rename(tmpfile, file) == 0;
+  if (!ok) {
+    err = errno;
+    unlink(tmpfile);
+    errno = err;
+  }
+  g_free(tmpfile);
+  g_free(file);
+  g_string_free(str, TRUE);
+  return ok;
+}
+
+/* 
+ * Restores player "Play"'s game in its game room from the directory
+ * "Dir", if it was saved there (see GetPlayerSnapshot). A save from
+ * another room counts as no save at all.
+ */
+ResumeResult ResumePlayerGame(const gchar *Dir, Player *Play)
+{
+  gchar *file, *data;
+  gsize len;
+  SaveReader rd;
+  ResumeResult result = RESUME_BAD;
+  GError *err = NULL;
+
+  file = SaveFileName(Dir, GetPlayerName(Play), SaveRoomName(Play));
+  if (!g_file_get_contents(file, &data, &len, &err)) {
+    if (err->code == G_FILE_ERROR_NOENT)
+      result = RESUME_NONE;
+    g_error_free(err);
+    g_free(file);
+    return result;
+  }
+  g_free(file);
+
+  rd.Pos = (const guchar *)data + 5;
+  rd.End = (const guchar *)data + len;
+  rd.OK = TRUE;
+  if (len >= SAVEHDRLEN && memcmp(data, SAVEMAGIC, 4) == 0
+      && data[4] == SAVEVERSION && GetSaveInt(&rd) == len - SAVEHDRLEN
+      && GetSaveInt(&rd) == SaveChecksum((guchar *)data + SAVEHDRLEN,
+                                         len - SAVEHDRLEN)) {
+    if (!SnapshotInRoom(Play, data + SAVEHDRLEN, len - SAVEHDRLEN))
+      result = RESUME_NONE;
+    else if (GetPlayerSnapshot(Play, data + SAVEHDRLEN, len - SAVEHDRLEN))
+      result = RESUME_OK;
+  }
+  g_free(data);
+  return result;
+}
+
+/* 
+ * Removes any saved game of player "Play" in its game room from "Dir",
+ * e.g. once that game is over.
+ */
+void RemovePlayerGame(const gchar *Dir, Player *Play)
+{
+  gchar *file = SaveFileName(Dir, GetPlayerName(Play),
+                             SaveRoomName(Play));
+
+  unlink(file);
+  g_free(file);
+}
+
+/* 
+ * Claims the saved game of the player called "Name" in "Dir", so that
+ * other server processes (e.g. workers) neither resume nor overwrite it
+ * while this one has that player. The claim is a lock on a NAME.lck
+ * file, which the system releases should the server die. Returns the
+ * open lock file, to be passed to UnlockPlayerGame, or NULL if the game
+ * is already claimed (or the lock file cannot be opened).
+ */
+FILE *LockPlayerGame(const gchar *Dir, const gchar *Name)
+{
+  gchar *file = SafeFileName(Dir, Name, ".lck");
+  FILE *fp;
+
+  fp = fopen(file, "a");
+  g_free(file);
+  if (fp && TryWriteLock(fp) != 0) {
+    fclose(fp);
+    fp = NULL;
+  }
+  return fp;
+}
+
+/* 
+ * Gives up a claim made by LockPlayerGame.
+ */
+void UnlockPlayerGame(FILE *fp)
+{
+  ReleaseLock(fp);
+  fclose(fp);
+}
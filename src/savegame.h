@@ -0,0 +1,52 @@
+/************************************************************************
+ * savegame.h     Header file for saving and resuming server games      *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_SAVEGAME_H__
+#define __DP_SAVEGAME_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <glib.h>
+#include "dopewars.h"
+
+/* The result of trying to resume a saved game */
+typedef enum {
+  RESUME_NONE,                  /* There is no saved game */
+  RESUME_OK,                    /* The saved game was restored */
+  RESUME_BAD                    /* The saved game is damaged, or does not
+                                 * match the server's configuration */
+} ResumeResult;
+
+gchar *SafeFileName(const gchar *Dir, const gchar *Name,
+                    const gchar *Suffix);
+void PutPlayerSnapshot(GString *str, Player *Play);
+gboolean GetPlayerSnapshot(Player *Play, const gchar *data, gsize len);
+gboolean SavePlayerGame(const gchar *Dir, Player *Play);
+ResumeResult ResumePlayerGame(const gchar *Dir, Player *Play);
+void RemovePlayerGame(const gchar *Dir, Player *Play);
+FILE *LockPlayerGame(const gchar *Dir, const gchar *Name);
+void UnlockPlayerGame(FILE *fp);
+
+#endif /* __DP_SAVEGAME_H__ */
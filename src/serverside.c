@@ -38,6 +38,7 @@
 #include <netinet/in.h>         /* For struct sockaddr_in etc. */
 #include <sys/un.h>             /* For struct sockaddr_un */
 #include <arpa/inet.h>          /* For socklen_t */
+#include <netdb.h>              /* For getnameinfo() */
 #endif /* CYGWIN */
 
 #ifdef HAVE_UNISTD_H
@@ -47,13 +48,20 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <glib.h>
+#include "accounts.h"
+#include "admission.h"
 #include "configfile.h"         /* For UpdateConfigFile */
 #include "dopewars.h"
+#include "eventloop.h"
+#include "gameroom.h"
+#include "leaderboard.h"
 #include "log.h"
 #include "message.h"
 #include "network.h"
 #include "nls.h"
+#include "savegame.h"
 #include "serverside.h"
+#include "timers.h"
 #include "tstring.h"
 #include "util.h"
 
@@ -61,6 +69,19 @@
 #include "gtkport/gtkport.h"
 #endif
 
+/* The standalone server can run as several worker processes sharing
+ * one port if the kernel supports SO_REUSEPORT */
+#if defined(NETWORKING) && defined(HAVE_FORK) && !defined(CYGWIN) \
+    && defined(SO_REUSEPORT)
+#define SERVER_WORKERS
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 static const price_t MINTRENCHPRICE = 200, MAXTRENCHPRICE = 300;
 
 #define ESCAPE      0
@@ -101,6 +122,7 @@ static SERVICE_STATUS_HANDLE scHandle;
 static gboolean glib_timeout(gpointer userp);
 static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
                             gpointer data);
+static void GuiWatchListen(gboolean Watch);
 #endif
 
 
@@ -110,6 +132,9 @@ gboolean MetaPlayerPending = FALSE;
 
 GSList *FirstServer = NULL;
 
+/* Pending fight, idle and connect timeouts of all players */
+static TimerHeap *PlayerTimers = NULL;
+
 #ifdef NETWORKING
 /* Data waiting to be sent to/read from the metaserver */
 static CurlConnection MetaConn;
@@ -118,8 +143,110 @@ static GScanner *Scanner;
 
 #endif
 
-/* Handle to the high score file */
-static FILE *ScoreFP = NULL;
+/* A new high score, not yet written to the file */
+typedef struct _PendingScore {
+  struct HISCORE Score;
+  gboolean Antique;             /* TRUE if this is an antique mode score */
+} PendingScore;
+
+/* How much of a high score journal (see ReadScoreJournal) has been read */
+typedef struct _ScoreJournal {
+  long Start;                   /* Offset of the first record */
+  long End;                     /* End of the last good record */
+  long Last;                    /* Start of the record with sequence
+                                 * number "Seq" (0 if none yet) */
+  guint32 Seq;                  /* Highest sequence number applied */
+  gint Adds;                    /* Scores added since the last snapshot */
+} ScoreJournal;
+
+/* A high score file, and the scores in it */
+struct _ScoreTable {
+  gchar *FileName;
+  FILE *fp;
+
+  /* The scores of every game, in normal and antique mode, read from the
+   * file when first needed and then served from memory (see
+   * LoadHighScores). The top NUMHISCORE of each are the high score
+   * tables shown to players. */
+  Leaderboard *Multi, *Antique;
+  gboolean Loaded;
+
+  /* Scores waiting to be written by FlushHighScores, oldest first */
+  GSList *Pending;
+
+  /* How much of the file is reflected in Multi and Antique */
+  ScoreJournal Journal;
+};
+
+/* The server's high scores (in HiScoreFile), which are also those of
+ * game rooms that do not have their own */
+static ScoreTable ServerScores;
+
+/* Tables with Pending scores */
+static GSList *PendingTables = NULL;
+
+/* Expires when PendingTables are due to be written */
+static Timer ScoreFlushTimer;
+
+#ifdef NETWORKING
+/* Used to start accepting connections again after running out of file
+ * descriptors (see PauseAccept) */
+static Timer AcceptTimer;
+#endif
+
+/* Index of this server worker process, or -1 if not running workers */
+static gint WorkerIndex = -1;
+
+/* TRUE while handling an admin command passed on by another worker */
+static gboolean ForwardedCommand = FALSE;
+
+#ifdef SERVER_WORKERS
+/* Most workers that can be started with --workers */
+#define MAXWORKERS 64
+
+/* Restart a worker no more than once a second if it dies this many
+ * seconds or fewer after starting (e.g. if it cannot bind the port) */
+#define WORKERMINLIFE 5
+
+static gint NumWorkers = 0;
+
+/* Process IDs of the workers, in the supervisor process */
+static pid_t *WorkerPids = NULL;
+
+/* Incremented by each worker that writes the high score file, so that
+ * the others know to read it again; shared by all workers */
+static gint *ScoreChanges = NULL;
+
+/* The value of *ScoreChanges when this worker last read the file */
+static gint ScoreChangesSeen = 0;
+
+/* The last signal received by the supervisor */
+static volatile sig_atomic_t WorkerSignal = 0;
+
+/* 
+ * Each game room belongs to one worker (see RoomWorker), and connections
+ * asking for it are passed to that worker over a datagram socket pair.
+ * Worker i reads from RoomRecv[i]; the others write to RoomSend[i].
+ * Admin commands about another worker's players are passed on the same
+ * way, together with the admin connection, so that it can reply.
+ */
+static int *RoomRecv = NULL, *RoomSend = NULL;
+
+/* The first byte of each datagram says what it carries */
+#define HANDOFFPLAYER 'P'
+#define HANDOFFADMIN  'A'
+
+/* Most unread data that can be passed on with a connection */
+#define HANDOFFDATA 4096
+
+/* A player whose connection is to be passed to worker HandOffWorker
+ * (for room HandOffRoom) once its current messages are handled. If
+ * HandOffMessage is set, it is handled by that worker first. */
+static Player *HandOffPlayer = NULL;
+static gint HandOffWorker;
+static gchar *HandOffRoom = NULL, *HandOffMessage = NULL;
+
+#endif
 
 /* Pointer to the filename of a pid file (if non-NULL) */
 char *PidFile = NULL;
@@ -129,6 +256,12 @@ static char HelpText[] = {
   N_("dopewars server version %s commands and settings\n\n"
      "help                     Displays this help screen\n"
      "list                     Lists all players logged on\n"
+     "stats                    Shows connection and message queue statistics\n"
+     "scores [antique] [<from> [<to>]] [<page>]\n"
+     "                         Lists every recorded game, best first, or\n"
+     "                         those played between two dd-mm-yyyy dates\n"
+     "rank <player>            Shows the named player's best recorded game\n"
+     "account <player>         Shows the named player's account statistics\n"
      "push <player>            Politely asks the named player to leave\n"
      "kill <player>            Abruptly breaks the connection with the "
      "named player\n"
@@ -143,16 +276,96 @@ static char HelpText[] = {
      "\nValid variables are listed below:-\n\n")
 };
 
+/* 
+ * Schedules the given player timer to expire in "seconds" seconds.
+ */
+static void SetPlayerTimeout(Timer *timer, int seconds)
+{
+  if (!PlayerTimers)
+    PlayerTimers = TimerHeapNew();
+  TimerSchedule(PlayerTimers, timer, TimerNow() + (gint64)seconds * 1000);
+}
+
+/*
+ * Records that the offer made to player "To" is on behalf of "Play".
+ * The serial is kept so that we can tell later whether "Play" is still
+ * around without walking FirstServer.
+ */
+static void SetOnBehalfOf(Player *To, Player *Play)
+{
+  To->OnBehalfOf = Play;
+  To->OnBehalfOfSerial = Play ? Play->Serial : 0;
+}
+
+/* 
+ * Saves the game of player "Play", if the server saves games and the
+ * player has one in progress, so that it can be resumed later. Only the
+ * player holding the claim on the saved game (see ResumeServerGame) may
+ * write it.
+ */
+static gboolean SaveServerGame(Player *Play)
+{
+  if (!SaveDir || !SaveDir[0] || !Play->SaveLock || !HasPlayerData(Play)
+      || IsCop(Play) || strlen(GetPlayerName(Play)) == 0
+      || Play->EventNum == E_FINISH) {
+    return FALSE;
+  }
+  if (!SavePlayerGame(SaveDir, Play)) {
+    dopelog(1, LF_SERVER, _("Cannot save the game of %s (%s)"),
+            GetPlayerName(Play), g_strerror(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* 
+ * Gives up player "Play"'s claim (if any) on their saved game, so that
+ * it can be resumed elsewhere.
+ */
+static void ReleaseServerGame(Player *Play)
+{
+  if (Play->SaveLock) {
+    UnlockPlayerGame(Play->SaveLock);
+    Play->SaveLock = NULL;
+  }
+}
+
+/* 
+ * Removes a player from the server's list, releasing its connection (if
+ * any) from the admission limits. Any game still in progress is saved.
+ */
+static GSList *RemoveServerPlayer(Player *Play, GSList *First)
+{
+  UseGameRoom(Play->Room);
+  SaveServerGame(Play);
+  ReleaseServerGame(Play);
+#ifdef NETWORKING
+  ReleaseConnection(Play->NetBuf.host);
+#endif
+  return RemovePlayer(Play, First);
+}
+
 typedef enum _OfferForce {
   NOFORCE, FORCECOPS, FORCEBITCH
 } OfferForce;
 
 int SendSingleHighScore(Player *Play, struct HISCORE *Score,
                         int ind, gboolean Bold);
+static void JoinRequestedRoom(Player *Play, const gchar *Name);
+#ifdef SERVER_WORKERS
+static gint RoomWorker(const gchar *Name);
+static void StartHandOff(Player *Play, const gchar *Room,
+                         const gchar *Message);
+static void ForwardServerCommand(const gchar *string, NetworkBuffer *netbuf,
+                                 gint worker);
+#endif
 static int SendCopOffer(Player *To, OfferForce Force);
 static int OfferObject(Player *To, gboolean ForceBitch);
 static gboolean HighScoreWrite(FILE *fp, struct HISCORE *MultiScore,
                                struct HISCORE *AntiqueScore);
+static gboolean LoadHighScores(ScoreTable *table);
+static gboolean FlushHighScores(ScoreTable *table);
+static gboolean FlushAllHighScores(void);
 
 #ifdef NETWORKING
 static void MetaConnectError(CurlConnection *conn, GError *err)
@@ -182,13 +395,20 @@ void RegisterWithMetaServer(gboolean Up, gboolean SendData,
                             gboolean RespectTimeout)
 {
 #ifdef NETWORKING
-  struct HISCORE MultiScore[NUMHISCORE], AntiqueScore[NUMHISCORE];
   GString *body;
   gchar *prstr;
   gboolean ret;
   GError *tmp_error = NULL;
   int i;
 
+#ifdef SERVER_WORKERS
+  /* Workers share a single metaserver entry, for the main game, which
+   * is maintained by the worker that hosts it */
+  if (WorkerIndex >= 0 && RoomWorker("") != WorkerIndex) {
+    return;
+  }
+#endif
+
   if (!MetaServer.Active || WantQuit || !Server) {
     return;
   }
@@ -220,16 +440,18 @@ void RegisterWithMetaServer(gboolean Up, gboolean SendData,
     AddURLEnc(body, MetaServer.Password);
   }
 
-  if (SendData && HighScoreRead(ScoreFP, MultiScore, AntiqueScore, TRUE)) {
+  if (SendData && LoadHighScores(&ServerScores)) {
     for (i = 0; i < NUMHISCORE; i++) {
-      if (MultiScore[i].Name && MultiScore[i].Name[0]) {
+      LeaderEntry *entry = LeaderboardNth(ServerScores.Multi, i);
+
+      if (entry && entry->Score.Name[0]) {
         g_string_append_printf(body, "&nm[%d]=", i);
-        AddURLEnc(body, MultiScore[i].Name);
+        AddURLEnc(body, entry->Score.Name);
         g_string_append_printf(body, "&dt[%d]=", i);
-        AddURLEnc(body, MultiScore[i].Time);
+        AddURLEnc(body, entry->Score.Time);
         g_string_append_printf(body, "&st[%d]=%s&sc[%d]=", i,
-                          MultiScore[i].Dead ? "dead" : "alive", i);
-        AddURLEnc(body, prstr = FormatPrice(MultiScore[i].Money));
+                          entry->Score.Dead ? "dead" : "alive", i);
+        AddURLEnc(body, prstr = FormatPrice(entry->Score.Money));
         g_free(prstr);
       }
     }
@@ -257,14 +479,19 @@ void HandleServerPlayer(Player *Play)
   gchar *buf;
   gboolean MessageRead = FALSE;
 
-  while ((buf = GetWaitingPlayerMessage(Play)) != NULL) {
+  while ((buf = GetWaitingPlayerMessageView(Play)) != NULL) {
     MessageRead = TRUE;
     HandleServerMessage(buf, Play);
-    g_free(buf);
+#ifdef SERVER_WORKERS
+    /* Leave any later messages for the worker that takes over */
+    if (HandOffPlayer == Play)
+      break;
+#endif
   }
+  FlushAllPlayerData();
   /* Reset the idle timeout (if necessary) */
   if (MessageRead && IdleTimeout) {
-    Play->IdleTimeout = time(NULL) + (time_t) IdleTimeout;
+    SetPlayerTimeout(&Play->IdleTimer, IdleTimeout);
   }
 }
 #endif /* NETWORKING */
@@ -314,6 +541,91 @@ void RemoteVersionCheck(Player *Play)
    * it's newer. Both should be OK, so do nothing. */
 }
 
+/* 
+ * Logs player "Play" in to the account for the name "Name", if player
+ * accounts are kept, using the password (if any) that it sent. Returns
+ * FALSE if the account is protected by a different password, in which
+ * case the player should choose another name.
+ */
+static gboolean CheckAccountLogin(Player *Play, const gchar *Name)
+{
+  gchar *text;
+  AccountLogin result;
+
+  result = AccountLogIn(Name, Play->Password);
+  if (result != ACCOUNT_BADPASSWORD) {
+    /* Only a password set when the account was created counts */
+    Play->Authenticated = (result == ACCOUNT_OK
+                           || (result == ACCOUNT_NEW && Play->Password
+                               && Play->Password[0]));
+    /* The password is not needed again */
+    g_free(Play->Password);
+    Play->Password = NULL;
+    return TRUE;
+  }
+  dopelog(2, LF_SERVER, _("Wrong password given for account %s"), Name);
+  text = g_strdup_printf(
+                          /* Message sent to a player who tries to use a
+                             name that belongs to a password-protected
+                             account */
+                          _("Sorry, but the name %s belongs to a player "
+                            "account, and the right password was not "
+                            "given.^Please choose another name."), Name);
+  SendServerMessage(NULL, C_NONE, C_PRINTMESSAGE, Play, text);
+  g_free(text);
+  return FALSE;
+}
+
+/* 
+ * Restores the saved game (if any) of player "Play", who has just logged
+ * in, and tells them about it. Saves are kept by name and game room, so
+ * only a player who gave their account's password can resume (or save)
+ * one, and only if no-one else with that name is playing in any room or
+ * server worker.
+ */
+static void ResumeServerGame(Player *Play)
+{
+  if (!SaveDir || !SaveDir[0] || !Play->Authenticated) {
+    return;
+  }
+  /* Players with the same name in this process share its lock, so must
+   * be checked for separately */
+  if (CountPlayersByName(GetPlayerName(Play), FirstServer) > 1
+      || !(Play->SaveLock = LockPlayerGame(SaveDir,
+                                           GetPlayerName(Play)))) {
+    dopelog(2, LF_SERVER, _("%s is already playing, so their saved game "
+                            "was not resumed"), GetPlayerName(Play));
+    SendPrintMessage(NULL, C_NONE, Play,
+                     /* Message sent to a player who logs in while
+                        already playing elsewhere on the server */
+                     _("You are already playing on this server, so your "
+                       "saved game has not been resumed, and this game "
+                       "will not be saved."));
+    return;
+  }
+  switch (ResumePlayerGame(SaveDir, Play)) {
+  case RESUME_OK:
+    dopelog(2, LF_SERVER, _("%s resumes a saved game at turn %d"),
+            GetPlayerName(Play), Play->Turn);
+    SendPrintMessage(NULL, C_NONE, Play,
+                     /* Message sent to a player whose saved game has
+                        been restored */
+                     _("Welcome back! Your saved game has been resumed."));
+    break;
+  case RESUME_BAD:
+    dopelog(1, LF_SERVER, _("Cannot resume the saved game of %s"),
+            GetPlayerName(Play));
+    SendPrintMessage(NULL, C_NONE, Play,
+                     /* Message sent to a player whose saved game cannot
+                        be used */
+                     _("Sorry, but your saved game could not be resumed, "
+                       "so a new game has been started."));
+    break;
+  case RESUME_NONE:
+    break;
+  }
+}
+
 /* 
  * Given a message "buf", from player "Play", performs processing and
  * sends suitable replies.
@@ -330,10 +642,33 @@ void HandleServerMessage(gchar *buf, Player *Play)
   int i;
   price_t money;
 
+  UseGameRoom(Play->Room);
   if (ProcessMessage(buf, Play, &To, &AI, &Code, &Data, FirstServer) == -1) {
     g_warning("Bad message");
     return;
   }
+  /* Players that haven't yet sent a name have no inventories etc., so
+   * can't do much */
+  if (!HasPlayerData(Play) && Code != C_ABILITIES && Code != C_NAME
+      && Code != C_JOINROOM && Code != C_PASSWORD
+      && Code != C_REQUESTSCORE) {
+    g_warning("Message from player before login");
+    return;
+  }
+  /* Players can only address others in the same game room. Old clients
+   * identify players by name, which need only be unique within a room,
+   * so the name is looked up again there; an ID cannot be mistaken. */
+  if (To != &Noone && To->Room != Play->Room) {
+    if (HaveAbility(Play, A_PLAYERID)) {
+      To = NULL;
+    } else {
+      To = GetRoomPlayerByName(Play->Room, GetPlayerName(To));
+    }
+    if (!To) {
+      g_warning("Bad message");
+      return;
+    }
+  }
   switch (Code) {
   case C_MSGTO:
     if (Network) {
@@ -345,76 +680,123 @@ void HandleServerMessage(gchar *buf, Player *Play)
   case C_ABILITIES:
     ReceiveAbilities(Play, Data);
     break;
+  case C_JOINROOM:
+    StripTerminators(Data);
+    /* The room can only be chosen once, before logging in */
+    if (!Network || Play->Room || strlen(GetPlayerName(Play)) > 0) {
+      break;
+    }
+    if (strlen(Data) > MAXROOMNAME) {
+      Data[MAXROOMNAME] = '\0';
+    }
+#ifdef SERVER_WORKERS
+    if (RoomWorker(Data) != WorkerIndex) {
+      StartHandOff(Play, Data, NULL);
+      break;
+    }
+#endif
+    JoinRequestedRoom(Play, Data);
+    break;
+  case C_PASSWORD:
+    /* Only used to log in (see CheckAccountLogin) */
+    if (strlen(GetPlayerName(Play)) == 0) {
+      g_free(Play->Password);
+      Play->Password = g_strdup(Data);
+    }
+    break;
   case C_NAME:
     StripTerminators(Data);
-    pt = GetPlayerByName(Data, FirstServer);
+    if (!Play->Room) {
+#ifdef SERVER_WORKERS
+      /* The main game belongs to one worker, which is asked to log the
+       * player in */
+      if (Network && RoomWorker("") != WorkerIndex) {
+        text = g_strdup_printf("^^%c%c%s", AI, Code, Data);
+        StartHandOff(Play, "", text);
+        g_free(text);
+        break;
+      }
+#endif
+      JoinRequestedRoom(Play, "");
+    }
+    pt = GetRoomPlayerByName(Play->Room, Data);
     if (pt && pt != Play) {
       if (ConnectTimeout) {
-        Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+        SetPlayerTimeout(&Play->ConnectTimer, ConnectTimeout);
       }
       SendServerMessage(NULL, C_NONE, C_NEWNAME, Play, NULL);
-    } else if (strlen(GetPlayerName(Play)) == 0 && Data[0]) {
-      if (CountPlayers(FirstServer) < MaxClients || !Network) {
-        RemoteVersionCheck(Play);
-        SendAbilities(Play);
-        CombineAbilities(Play);
-        SendInitialData(Play);
-        SendMiscData(Play);
-        SetPlayerName(Play, Data);
-        for (list = FirstServer; list; list = g_slist_next(list)) {
-          pt = (Player *)list->data;
-          if (pt != Play && IsConnectedPlayer(pt) && !IsCop(pt)) {
-            SendPlayerDetails(pt, Play, C_LIST);
-          }
-        }
-        if (ServerMOTD && ServerMOTD[0]) {
-          SendPrintMessage(NULL, C_MOTD, Play, ServerMOTD);
-        }
-        SendServerMessage(NULL, C_NONE, C_ENDLIST, Play, NULL);
-        RegisterWithMetaServer(TRUE, FALSE, TRUE);
-        Play->ConnectTimeout = 0;
-
-        if (Network) {
-          dopelog(2, LF_SERVER, _("%s joins the game!"), GetPlayerName(Play));
-        }
-        for (list = FirstServer; list; list = g_slist_next(list)) {
-          pt = (Player *)list->data;
-          if (IsConnectedPlayer(pt) && pt != Play) {
-            SendPlayerDetails(Play, pt, C_JOIN);
-          }
-        }
-        Play->EventNum = E_ARRIVE;
-        SendPlayerData(Play);
-        SendEvent(Play);
+    } else if (strlen(GetPlayerName(Play)) == 0 && Data[0]
+               && CountPlayers(FirstServer) >= MaxClients && Network) {
+      /* Message displayed in the server when too many players try to
+       * connect */
+      dopelog(2, LF_SERVER,
+              _("MaxClients (%d) exceeded - dropping connection"),
+              MaxClients);
+      if (MaxClients == 1) {
+        text = g_strdup_printf(
+                                /* Message sent to a player if the
+                                   server is full */
+                                _("Sorry, but this server has a limit of "
+                                 "1 player, which has been reached.^"
+                                 "Please try connecting again later."));
       } else {
-        /* Message displayed in the server when too many players try to
-         * connect */
-        dopelog(2, LF_SERVER,
-                _("MaxClients (%d) exceeded - dropping connection"),
-                MaxClients);
-        if (MaxClients == 1) {
-          text = g_strdup_printf(
-                                  /* Message sent to a player if the
-                                     server is full */
-                                  _("Sorry, but this server has a limit of "
-                                   "1 player, which has been reached.^"
-                                   "Please try connecting again later."));
-        } else {
-          text = g_strdup_printf(
-                                  /* Message sent to a player if the
-                                     server is full */
-                                  _("Sorry, but this server has a limit of "
-                                   "%d players, which has been reached.^"
-                                   "Please try connecting again later."),
-                                  MaxClients);
+        text = g_strdup_printf(
+                                /* Message sent to a player if the
+                                   server is full */
+                                _("Sorry, but this server has a limit of "
+                                 "%d players, which has been reached.^"
+                                 "Please try connecting again later."),
+                                MaxClients);
+      }
+      SendServerMessage(NULL, C_NONE, C_PRINTMESSAGE, Play, text);
+      g_free(text);
+      /* Make sure they do actually disconnect, eventually! */
+      if (ConnectTimeout) {
+        SetPlayerTimeout(&Play->ConnectTimer, ConnectTimeout);
+      }
+    } else if (Data[0] && strcmp(Data, GetPlayerName(Play)) != 0
+               && !CheckAccountLogin(Play, Data)) {
+      if (ConnectTimeout) {
+        SetPlayerTimeout(&Play->ConnectTimer, ConnectTimeout);
+      }
+      SendServerMessage(NULL, C_NONE, C_NEWNAME, Play, NULL);
+    } else if (strlen(GetPlayerName(Play)) == 0 && Data[0]) {
+      AllocPlayerData(Play);
+      RemoteVersionCheck(Play);
+      SendAbilities(Play);
+      CombineAbilities(Play);
+      SendInitialData(Play);
+      SendMiscData(Play);
+      SetPlayerName(Play, Data);
+      ResumeServerGame(Play);
+      for (list = Play->Room->Players; list; list = g_slist_next(list)) {
+        pt = (Player *)list->data;
+        if (pt != Play && IsConnectedPlayer(pt) && !IsCop(pt)) {
+          SendPlayerDetails(pt, Play, C_LIST);
         }
-        SendServerMessage(NULL, C_NONE, C_PRINTMESSAGE, Play, text);
-        g_free(text);
-        /* Make sure they do actually disconnect, eventually! */
-        if (ConnectTimeout) {
-          Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+      }
+      if (ServerMOTD && ServerMOTD[0]) {
+        SendPrintMessage(NULL, C_MOTD, Play, ServerMOTD);
+      }
+      SendServerMessage(NULL, C_NONE, C_ENDLIST, Play, NULL);
+      RegisterWithMetaServer(TRUE, FALSE, TRUE);
+      TimerCancel(&Play->ConnectTimer);
+
+      if (Network && Play->Room->Name[0]) {
+        dopelog(2, LF_SERVER, _("%s joins the game in room %s!"),
+                GetPlayerName(Play), Play->Room->Name);
+      } else if (Network) {
+        dopelog(2, LF_SERVER, _("%s joins the game!"), GetPlayerName(Play));
+      }
+      for (list = Play->Room->Players; list; list = g_slist_next(list)) {
+        pt = (Player *)list->data;
+        if (IsConnectedPlayer(pt) && pt != Play) {
+          SendPlayerDetails(Play, pt, C_JOIN);
         }
       }
+      Play->EventNum = E_ARRIVE;
+      SendPlayerData(Play);
+      SendEvent(Play);
     } else {
       /* A player changed their name during the game (unusual, and not
          really properly supported anyway) - notify all players of the
@@ -422,6 +804,9 @@ void HandleServerMessage(gchar *buf, Player *Play)
       dopelog(2, LF_SERVER, _("%s will now be known as %s"),
               GetPlayerName(Play), Data);
       BroadcastToClients(C_NONE, C_RENAME, Data, Play, Play);
+      /* The game stays saved under the old name */
+      SaveServerGame(Play);
+      ReleaseServerGame(Play);
       SetPlayerName(Play, Data);
     }
     break;
@@ -465,6 +850,7 @@ void HandleServerMessage(gchar *buf, Player *Play)
       Play->Debt = MAX(Play->Debt, 0);
       Play->Bank = Play->Bank * (BankInterest + 100) / 100;
       Play->Bank = MAX(Play->Bank, 0);
+      SaveServerGame(Play);
       SendPlayerData(Play);
       Play->EventNum = E_SUBWAY;
       SendEvent(Play);
@@ -480,7 +866,8 @@ void HandleServerMessage(gchar *buf, Player *Play)
     SendHighScores(Play, FALSE, NULL);
     break;
   case C_CONTACTSPY:
-    for (list = FirstServer; list; list = g_slist_next(list)) {
+    for (list = Play->Room ? Play->Room->Players : NULL; list;
+         list = g_slist_next(list)) {
       tmp = (Player *)list->data;
       i = GetListEntry(&(tmp->SpyList), Play);
       if (tmp != Play && i >= 0 && tmp->SpyList.Data[i].Turns >= 0) {
@@ -587,10 +974,12 @@ void ClientLeftServer(Player *Play)
   if (!IsConnectedPlayer(Play))
     return;
 
+  UseGameRoom(Play->Room);
   if (Play->EventNum == E_FIGHT || Play->EventNum == E_FIGHTASK) {
     WithdrawFromCombat(Play);
   }
-  for (list = FirstServer; list; list = g_slist_next(list)) {
+  for (list = Play->Room ? Play->Room->Players : NULL; list;
+       list = g_slist_next(list)) {
     tmp = (Player *)list->data;
     if (tmp != Play) {
       RemoveAllEntries(&(tmp->TipList), Play);
@@ -606,12 +995,14 @@ void ClientLeftServer(Player *Play)
 void CleanUpServer()
 {
   while (FirstServer) {
-    FirstServer = RemovePlayer((Player *)FirstServer->data, FirstServer);
+    FirstServer = RemoveServerPlayer((Player *)FirstServer->data,
+                                     FirstServer);
   }
 #ifdef NETWORKING
   if (Server)
     CloseSocket(ListenSock);
 #endif
+  ClearAdmission();
 }
 
 /* 
@@ -762,6 +1153,31 @@ static gboolean StartServer(void)
 
   if (!CheckHighScoreFileConfig())
     return FALSE;
+  TimerInit(&AcceptTimer, NULL);
+  if (AccountFile && AccountFile[0] && !OpenAccountStore(AccountFile)) {
+    g_log(NULL, G_LOG_LEVEL_CRITICAL, _("Cannot open account file %s (%s)."),
+          AccountFile,
+          errno ? g_strerror(errno) : _("not a dopewars account file"));
+    return FALSE;
+  }
+  /* Saves are kept by player name, so an account is needed to tell who
+   * may resume them */
+  if (SaveDir && SaveDir[0] && !IsAccountStoreOpen()) {
+    g_log(NULL, G_LOG_LEVEL_CRITICAL,
+          _("SaveDir cannot be used without an AccountFile."));
+    return FALSE;
+  }
+#ifdef CYGWIN
+  if (SaveDir && SaveDir[0] && mkdir(SaveDir) == -1 && errno != EEXIST) {
+#else
+  if (SaveDir && SaveDir[0] && mkdir(SaveDir, 0755) == -1
+      && errno != EEXIST) {
+#endif
+    g_log(NULL, G_LOG_LEVEL_CRITICAL,
+          _("Cannot create save game directory %s (%s)."), SaveDir,
+          g_strerror(errno));
+    return FALSE;
+  }
   Scanner = g_scanner_new(&ScannerConfig);
   Scanner->msg_handler = ScannerErrorHandler;
   Scanner->input_name = "(stdin)";
@@ -795,6 +1211,12 @@ static gboolean StartServer(void)
   /* This doesn't seem to work properly under Win32 */
 #ifndef CYGWIN
   SetReuse(ListenSock);
+  if (WorkerIndex >= 0 && !SetReusePort(ListenSock)) {
+    g_log(NULL, G_LOG_LEVEL_CRITICAL,
+          _("Cannot share port %u between server workers. Aborting."),
+          Port);
+    exit(EXIT_FAILURE);
+  }
 #endif
 
   SetBlocking(ListenSock, FALSE);
@@ -809,7 +1231,7 @@ static gboolean StartServer(void)
     exit(EXIT_FAILURE);
   }
 
-  if (listen(ListenSock, 10) == SOCKET_ERROR) {
+  if (listen(ListenSock, ListenBacklog) == SOCKET_ERROR) {
     g_log(NULL, G_LOG_LEVEL_CRITICAL,
           _("Cannot listen to network socket. Aborting."));
     exit(EXIT_FAILURE);
@@ -919,6 +1341,232 @@ static void ServerSaveConfigFile(const char *string)
   g_free(file);
 }
 
+/* Number of games listed on each page by the "scores" command */
+#define SCOREPAGELEN 20
+
+static void PrintLeaderEntry(const LeaderEntry *entry, guint rank)
+{
+  gchar *prstr = FormatPrice(entry->Score.Money);
+
+  g_print("%6u. %18s  %-10s  %s %s\n", rank + 1, prstr, entry->Score.Time,
+          entry->Score.Name, entry->Score.Dead ? _("(R.I.P.)") : "");
+  g_free(prstr);
+}
+
+/* 
+ * Handles the "scores" server command. "args" may name the antique mode
+ * scores, a date (or two, for a range) and a page number; with dates,
+ * the games played then are listed in date order, together with their
+ * overall rank.
+ */
+static void ServerListScores(const char *args)
+{
+  gchar **words, **word;
+  Leaderboard *board;
+  gboolean antique = FALSE, bydate = FALSE;
+  guint32 date, from = 0, to = 0;
+  guint page = 1, pages, first = 0, total, start, i;
+
+  words = g_strsplit(args, " ", 0);
+  for (word = words; *word; word++) {
+    if (!**word) {
+      continue;
+    } else if (g_ascii_strcasecmp(*word, "antique") == 0) {
+      antique = TRUE;
+    } else if ((date = LeaderboardParseDate(*word)) != 0) {
+      if (!bydate)
+        from = date;
+      to = date;
+      bydate = TRUE;
+    } else if (atoi(*word) > 0) {
+      page = atoi(*word);
+    } else {
+      g_print(_("Usage: scores [antique] [<from> [<to>]] [<page>]\n"));
+      g_strfreev(words);
+      return;
+    }
+  }
+  g_strfreev(words);
+
+  if (!LoadHighScores(&ServerScores)) {
+    g_print(_("Unable to read high score file %s\n"),
+            ServerScores.FileName);
+  }
+  board = antique ? ServerScores.Antique : ServerScores.Multi;
+  if (bydate)
+    total = LeaderboardDateRange(board, MIN(from, to), MAX(from, to),
+                                 &first);
+  else
+    total = LeaderboardSize(board);
+  if (total == 0) {
+    g_print(_("No games recorded.\n"));
+    return;
+  }
+  pages = (total + SCOREPAGELEN - 1) / SCOREPAGELEN;
+  page = MIN(page, pages);
+  start = (page - 1) * SCOREPAGELEN;
+  g_print(_("Scores %u to %u of %u (page %u of %u):\n"), start + 1,
+          MIN(start + SCOREPAGELEN, total), total, page, pages);
+  for (i = start; i < total && i < start + SCOREPAGELEN; i++) {
+    if (bydate) {
+      LeaderEntry *entry = LeaderboardByDate(board, first + i);
+
+      PrintLeaderEntry(entry, LeaderboardRank(board, entry));
+    } else {
+      PrintLeaderEntry(LeaderboardNth(board, i), i);
+    }
+  }
+}
+
+/* 
+ * Handles the "rank" server command, showing the best game played in
+ * each mode by the player called "Name".
+ */
+static void ServerPlayerRank(const char *Name)
+{
+  Leaderboard *board;
+  LeaderEntry *best;
+  guint games;
+  int antique;
+
+  if (!LoadHighScores(&ServerScores)) {
+    g_print(_("Unable to read high score file %s\n"),
+            ServerScores.FileName);
+  }
+  for (antique = 0; antique <= 1; antique++) {
+    board = antique ? ServerScores.Antique : ServerScores.Multi;
+    best = LeaderboardBest(board, Name, &games);
+    if (!best)
+      continue;
+    g_print(antique ? _("%s has played %u antique mode games; best:\n")
+                    : _("%s has played %u games; best:\n"), Name, games);
+    PrintLeaderEntry(best, LeaderboardRank(board, best));
+  }
+  if (!LeaderboardBest(ServerScores.Multi, Name, NULL)
+      && !LeaderboardBest(ServerScores.Antique, Name, NULL)) {
+    g_print(_("No games recorded for %s\n"), Name);
+  }
+}
+
+/* 
+ * Handles the "account" server command, showing what is known about the
+ * player called "Name" from their account.
+ */
+static void ServerShowAccount(const char *Name)
+{
+  AccountStats stats;
+  gchar *prstr, date[80];
+  time_t tim;
+
+  if (!IsAccountStoreOpen()) {
+    g_print(_("Player accounts are not kept (see AccountFile)\n"));
+    return;
+  } else if (!GetAccountStats(Name, &stats)) {
+    g_print(_("No account for %s\n"), Name);
+    return;
+  }
+  g_print(stats.HasPassword ? _("Account %s (with password):\n")
+                            : _("Account %s (no password):\n"), Name);
+  g_print(_("Games finished: %u (%u ending in death)\n"), stats.Games,
+          stats.Deaths);
+  g_print(_("Turns played: %lu\n"), (unsigned long)stats.Turns);
+  if (stats.Games > 0) {
+    g_print(_("Best net worth: %s\n"),
+            prstr = FormatPrice(stats.BestWorth));
+    g_free(prstr);
+    tim = (time_t)stats.LastPlayed;
+    strftime(date, sizeof(date), "%d-%m-%Y", gmtime(&tim));
+    g_print(_("Last game finished: %s\n"), date);
+  }
+}
+
+/* 
+ * Returns TRUE if the admin command "string" is "cmd", either by itself
+ * or followed by a space and its arguments.
+ */
+static gboolean IsServerCommand(const char *string, const char *cmd)
+{
+  size_t len = strlen(cmd);
+
+  return g_ascii_strncasecmp(string, cmd, len) == 0
+      && (string[len] == '\0' || string[len] == ' ');
+}
+
+/* 
+ * Lists the players connected to this server (worker).
+ */
+static void ServerListPlayers(void)
+{
+  GSList *list;
+  Player *tmp;
+
+  for (list = FirstServer; list; list = g_slist_next(list)) {
+    tmp = (Player *)list->data;
+    if (IsCop(tmp)) {
+      continue;
+    } else if (CountGameRooms() > 1) {
+      g_print("%s (%s)", GetPlayerName(tmp), GetGameRoomLabel(tmp->Room));
+    } else {
+      g_print("%s", GetPlayerName(tmp));
+    }
+    if (tmp->NetBuf.WriteBuf.DataPresent > 0) {
+      /* Shown in the "list" output for players who are not keeping up
+       * with the messages sent to them */
+      g_print(_(" - %d bytes queued, %d s behind"),
+              tmp->NetBuf.WriteBuf.DataPresent,
+              GetNetworkBufferLag(&tmp->NetBuf));
+    }
+    g_print("\n");
+  }
+}
+
+/* 
+ * Returns the player named in a "push" or "kill" command. Names need
+ * only be unique within a game room, so "NAME@ROOM" picks the player in
+ * a given room (with "NAME@" for the main game). Prints a message and
+ * returns NULL if there is no such player, or more than one. If the room
+ * is hosted by another server worker, the whole command "string" is
+ * passed on to it instead (replying on "netbuf") and NULL is returned.
+ */
+static Player *GetAdminTarget(gchar *Arg, gchar *string,
+                              NetworkBuffer *netbuf)
+{
+  gchar *at, *name;
+  Player *Play;
+
+  at = strrchr(Arg, '@');
+#ifdef SERVER_WORKERS
+  if (at && RoomWorker(at + 1) != WorkerIndex && netbuf
+      && !ForwardedCommand) {
+    ForwardServerCommand(string, netbuf, RoomWorker(at + 1));
+    return NULL;
+  }
+#endif
+  if (at) {
+    name = g_strndup(Arg, at - Arg);
+    Play = GetRoomPlayerByName(GetGameRoom(at + 1), name);
+    g_free(name);
+    if (Play && Play != &Noone)
+      return Play;
+  }
+  switch (CountPlayersByName(Arg, FirstServer)) {
+  case 0:
+    if (WorkerIndex >= 0) {
+      g_print(_("No such user! Players in game rooms hosted by other "
+                "server workers must be given as NAME@ROOM\n"));
+    } else {
+      g_print(_("No such user!\n"));
+    }
+    return NULL;
+  case 1:
+    return GetPlayerByName(Arg, FirstServer);
+  default:
+    g_print(_("%s is playing in more than one game room; use "
+              "NAME@ROOM to pick one\n"), Arg);
+    return NULL;
+  }
+}
+
 static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
                                 gboolean ForceUTF8)
 {
@@ -929,6 +1577,8 @@ static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
 
   oldprint = StartServerReply(netbuf);
 
+  /* Commands see (and change) the server's own settings */
+  UseGameRoom(NULL);
   conv = Conv_New();
   if (ForceUTF8) {
     Conv_SetCodeset(conv, "UTF-8");
@@ -942,82 +1592,226 @@ static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
       RequestServerShutdown();
     } else if (g_ascii_strncasecmp(string, "msg:", 4) == 0) {
       BroadcastToClients(C_NONE, C_MSG, string + 4, NULL, NULL);
+#ifdef SERVER_WORKERS
+      ForwardServerCommand(string, netbuf, -1);
+#endif
     } else if (g_ascii_strncasecmp(string, "save ", 5) == 0) {
       ServerSaveConfigFile(string + 5);
     } else if (g_ascii_strncasecmp(string, "save", 4) == 0) {
       ServerSaveConfigFile(NULL);
     } else if (g_ascii_strncasecmp(string, "list", 4) == 0) {
-      if (FirstServer) {
+      if (ForwardedCommand) {
+        /* Goes under the heading printed by the worker that passed the
+         * command on */
+        ServerListPlayers();
+      } else if (FirstServer || WorkerIndex >= 0) {
         g_print(_("Users currently logged on:-\n"));
-        for (list = FirstServer; list; list = g_slist_next(list)) {
-          tmp = (Player *)list->data;
-          if (!IsCop(tmp)) {
-            g_print("%s\n", GetPlayerName(tmp));
-          }
-        }
+        ServerListPlayers();
+#ifdef SERVER_WORKERS
+        ForwardServerCommand(string, netbuf, -1);
+#endif
       } else
         g_print(_("No users currently logged on!\n"));
+    } else if (IsServerCommand(string, "stats")) {
+      AdmissionStats stats;
+      gint queued = 0, maxlag = 0;
+      guint lagging = 0;
+
+      for (list = FirstServer; list; list = g_slist_next(list)) {
+        tmp = (Player *)list->data;
+        if (IsCop(tmp))
+          continue;
+        queued += tmp->NetBuf.WriteBuf.DataPresent;
+        maxlag = MAX(maxlag, GetNetworkBufferLag(&tmp->NetBuf));
+        if (IsNetworkBufferCongested(&tmp->NetBuf))
+          lagging++;
+      }
+      GetAdmissionStats(&stats);
+      g_print(_("Connections admitted: %u\n"), stats.Admitted);
+      g_print(_("Refused (rate limit): %u\n"), stats.RateLimited);
+      g_print(_("Refused (too many from one host): %u\n"), stats.TooMany);
+      g_print(_("Hosts tracked: %u\n"), stats.Hosts);
+      g_print(_("Game rooms: %u\n"), CountGameRooms());
+      g_print(_("Bytes queued for clients: %d\n"), queued);
+      g_print(_("Lagging clients: %u (longest wait %d s)\n"), lagging,
+              maxlag);
+      g_print(_("Messages skipped for lagging clients: %u\n"),
+              SkippedMessages);
+      g_print(_("Clients dropped (output queue full): %u\n"),
+              FullWriteBuffers);
+      if (IsAccountStoreOpen())
+        g_print(_("Player accounts: %u\n"), CountAccounts());
+    } else if (IsServerCommand(string, "scores")) {
+      ServerListScores(string + 6);
+    } else if (IsServerCommand(string, "rank")) {
+      if (string[4] && string[5]) {
+        ServerPlayerRank(string + 5);
+      } else {
+        g_print(_("Usage: rank <player>\n"));
+      }
+    } else if (IsServerCommand(string, "account")) {
+      if (string[7] && string[8]) {
+        ServerShowAccount(string + 8);
+      } else {
+        g_print(_("Usage: account <player>\n"));
+      }
     } else if (g_ascii_strncasecmp(string, "push ", 5) == 0) {
-      tmp = GetPlayerByName(string + 5, FirstServer);
+      tmp = GetAdminTarget(string + 5, string, netbuf);
       if (tmp) {
         g_print(_("Pushing %s\n"), GetPlayerName(tmp));
         SendServerMessage(NULL, C_NONE, C_PUSH, tmp, NULL);
-      } else
-        g_print(_("No such user!\n"));
+      }
     } else if (g_ascii_strncasecmp(string, "kill ", 5) == 0) {
-      tmp = GetPlayerByName(string + 5, FirstServer);
+      tmp = GetAdminTarget(string + 5, string, netbuf);
       if (tmp) {
         /* The named user has been removed from the server following
            a "kill" command */
         g_print(_("%s killed\n"), GetPlayerName(tmp));
         BroadcastToClients(C_NONE, C_KILL, GetPlayerName(tmp), tmp,
                            (Player *)FirstServer->data);
-        FirstServer = RemovePlayer(tmp, FirstServer);
-      } else
-        g_print(_("No such user!\n"));
+        FirstServer = RemoveServerPlayer(tmp, FirstServer);
+      }
     } else {
       g_print(_("Unknown command - try \"help\" for help...\n"));
     }
   }
   Conv_Free(conv);
+  FlushAllPlayerData();
   FinishServerReply(oldprint);
 }
 
-Player *HandleNewConnection(void)
+static EventLoop *ServerEvents = NULL;
+
+/* 
+ * Stops watching the listening socket for a while, as we have run out of
+ * descriptors (or memory) to accept connections with. They will wait in
+ * the listen queue until AcceptTimer expires.
+ */
+static void PauseAccept(void)
+{
+  dopelog(1, LF_SERVER, _("Cannot accept new connections for now (%s)"),
+          g_strerror(errno));
+  if (ServerEvents) {
+    EventLoopUnwatch(ServerEvents, ListenSock);
+  }
+#ifdef GUI_SERVER
+  GuiWatchListen(FALSE);
+#endif
+  if (AcceptTimer.expiry == 0)
+    SetPlayerTimeout(&AcceptTimer, 1);
+}
+
+/* 
+ * Accepts a new connection on the listening socket. Returns FALSE if
+ * there are no more connections waiting (or we cannot accept any more
+ * right now). Otherwise, TRUE is returned and "NewPlayer" is set to the
+ * new player, or NULL if the connection was refused because its host is
+ * over its admission limits (see AdmitConnection) or was dropped before
+ * we got to it. Only the player's connection is set up; its inventories
+ * are not allocated until it sends a valid name.
+ */
+gboolean HandleNewConnection(Player **NewPlayer)
 {
   socklen_t cadsize;
   int ClientSock;
+#ifdef HAVE_GETNAMEINFO
+  struct sockaddr_storage ClientAddr;
+  gchar host[NI_MAXHOST];
+#else
   struct sockaddr_in ClientAddr;
+  gchar *host;
+#endif
   Player *tmp;
-  cadsize = sizeof(struct sockaddr);
-  if ((ClientSock = accept(ListenSock, (struct sockaddr *)&ClientAddr,
-                            &cadsize)) == -1) {
+
+  *NewPlayer = NULL;
+  cadsize = sizeof(ClientAddr);
+#ifdef HAVE_ACCEPT4
+  ClientSock = accept4(ListenSock, (struct sockaddr *)&ClientAddr, &cadsize,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  ClientSock = accept(ListenSock, (struct sockaddr *)&ClientAddr, &cadsize);
+#endif
+  if (ClientSock == -1) {
+#ifdef CYGWIN
+    int Error = WSAGetLastError();
+
+    if (Error == WSAEWOULDBLOCK)
+      return FALSE;
+    else if (Error == WSAECONNRESET || Error == WSAEINTR)
+      return TRUE;
+    else if (Error == WSAEMFILE || Error == WSAENOBUFS) {
+      PauseAccept();
+      return FALSE;
+    }
+#else
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return FALSE;
+    else if (errno == EINTR || errno == ECONNABORTED)
+      return TRUE;
+    else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+             || errno == ENOMEM) {
+      PauseAccept();
+      return FALSE;
+    }
+#endif
     perror("accept socket");
     exit(EXIT_FAILURE);
   }
-  dopelog(2, LF_SERVER, _("got connection from %s"),
-          inet_ntoa(ClientAddr.sin_addr));
+#ifdef HAVE_GETNAMEINFO
+  /* Use the numeric address, whatever the address family, so that all
+   * connections from one host are counted together */
+  if (getnameinfo((struct sockaddr *)&ClientAddr, cadsize, host,
+                  sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+    strcpy(host, "?");
+  }
+#else
+  host = inet_ntoa(ClientAddr.sin_addr);
+#endif
+  if (ServerEvents && !EventLoopCanWatch(ServerEvents, ClientSock)) {
+    dopelog(1, LF_SERVER, _("Too many open connections - refused "
+                            "connection from %s"), host);
+    CloseSocket(ClientSock);
+    return TRUE;
+  }
+  if (!AdmitConnection(host)) {
+    dopelog(2, LF_SERVER, _("refused connection from %s"), host);
+    CloseSocket(ClientSock);
+    return TRUE;
+  }
+  dopelog(2, LF_SERVER, _("got connection from %s"), host);
+  SetNoDelay(ClientSock);
   tmp = g_new(Player, 1);
 
-  FirstServer = AddPlayer(ClientSock, tmp, FirstServer);
+  FirstServer = AddPendingPlayer(ClientSock, tmp, FirstServer);
+  /* Remember the host, so that the connection can be released from the
+   * admission limits when the player is removed */
+  tmp->NetBuf.host = g_strdup(host);
   if (ConnectTimeout) {
-    tmp->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+    SetPlayerTimeout(&tmp->ConnectTimer, ConnectTimeout);
   }
-  return tmp;
+  *NewPlayer = tmp;
+  return TRUE;
 }
 
 void StopServer()
 {
   dopelog(0, LF_SERVER, _("dopewars server terminating."));
+  FlushAllHighScores();
+  CloseAccountStore();
+  TimerCancel(&AcceptTimer);
   g_scanner_destroy(Scanner);
   CleanUpServer();
-  RemovePidFile();
+  /* The pid file of a worker belongs to its supervisor */
+  if (WorkerIndex < 0)
+    RemovePidFile();
 }
 
 void RemovePlayerFromServer(Player *Play)
 {
+  UseGameRoom(Play->Room);
   if (!WantQuit && strlen(GetPlayerName(Play)) > 0) {
     dopelog(2, LF_SERVER, _("%s leaves the server!"), GetPlayerName(Play));
+    SaveServerGame(Play);
     ClientLeftServer(Play);
     /* Blank the name, so that CountPlayers ignores this player */
     SetPlayerName(Play, NULL);
@@ -1025,20 +1819,48 @@ void RemovePlayerFromServer(Player *Play)
      * to the metaserver */
     RegisterWithMetaServer(TRUE, TRUE, TRUE);
   }
-  FirstServer = RemovePlayer(Play, FirstServer);
+  FirstServer = RemoveServerPlayer(Play, FirstServer);
+  /* Leaving can change other players' data (e.g. ending a fight), and
+   * this may happen after their batch of updates has been sent */
+  FlushAllPlayerData();
+}
+
+/* 
+ * Removes any players whose write buffers filled up while the last batch
+ * of events was handled (removing one may in turn fill another's).
+ */
+static void DropFullPlayers(void)
+{
+  Player *Play;
+
+  while ((Play = TakeFullPlayer()) != NULL) {
+    dopelog(1, LF_SERVER, _("%s dropped due to full write buffer"),
+            GetPlayerName(Play));
+    RemovePlayerFromServer(Play);
+  }
 }
 
 #ifndef CYGWIN
 static gchar sockpref[] = "/tmp/.dopewars";
 
+/* 
+ * Worker 0 (or the only server process) uses the default admin socket
+ * that "dopewars -A" connects to; other workers get their own.
+ */
 static gchar *GetLocalSockDir(void)
 {
-  return g_strdup_printf("%s-%u", sockpref, Port);
+  if (WorkerIndex > 0)
+    return g_strdup_printf("%s-%u.%d", sockpref, Port, WorkerIndex);
+  else
+    return g_strdup_printf("%s-%u", sockpref, Port);
 }
 
 gchar *GetLocalSocket(void)
 {
-  return g_strdup_printf("%s-%u/socket", sockpref, Port);
+  if (WorkerIndex > 0)
+    return g_strdup_printf("%s-%u.%d/socket", sockpref, Port, WorkerIndex);
+  else
+    return g_strdup_printf("%s-%u/socket", sockpref, Port);
 }
 
 static void CloseLocalSocket(int localsock)
@@ -1159,42 +1981,736 @@ static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
 
 #endif
 
+#ifndef CYGWIN
+static GSList *AdminConns = NULL;
+#endif
+
+/* 
+ * Puts "Play" in the game room "Name", or the main game if no more rooms
+ * can be created, and starts them off with that room's settings. If the
+ * main game is hosted by another server worker, the player is passed on
+ * to it instead (see StartHandOff).
+ */
+static void JoinRequestedRoom(Player *Play, const gchar *Name)
+{
+  if (!JoinGameRoom(Play, Name)) {
+    dopelog(2, LF_SERVER, _("MaxRooms (%d) exceeded - using main game"),
+            MaxRooms);
+#ifdef SERVER_WORKERS
+    if (RoomWorker("") != WorkerIndex) {
+      StartHandOff(Play, "", NULL);
+      return;
+    }
+#endif
+    JoinGameRoom(Play, "");
+  }
+  UseGameRoom(Play->Room);
+  Play->Cash = StartCash;
+  Play->Debt = StartDebt;
+}
+
+#ifdef SERVER_WORKERS
+/* 
+ * Returns the index of the worker that hosts game room "Name". The main
+ * game is always hosted by the first worker.
+ */
+static gint RoomWorker(const gchar *Name)
+{
+  if (WorkerIndex < 0 || !RoomSend)
+    return WorkerIndex;
+  else if (!Name[0])
+    return 0;
+  return g_str_hash(Name) % NumWorkers;
+}
+
+/* 
+ * Arranges for the connection of "Play" to be passed to the worker that
+ * hosts room "Room", once we are done with the message being handled.
+ * If "Message" is non-NULL, it is handled by that worker before anything
+ * else the player has sent.
+ */
+static void StartHandOff(Player *Play, const gchar *Room,
+                         const gchar *Message)
+{
+  HandOffPlayer = Play;
+  HandOffWorker = RoomWorker(Room);
+  g_free(HandOffRoom);
+  HandOffRoom = g_strdup(Room);
+  g_free(HandOffMessage);
+  HandOffMessage = g_strdup(Message);
+}
+
+/* 
+ * Sends the "len" bytes at "data", together with a copy of descriptor
+ * "fd", to worker "worker". Returns FALSE (and logs why) on failure.
+ */
+static gboolean SendToWorker(gint worker, int fd, const gchar *data,
+                             gsize len)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (gpointer)data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(RoomSend[worker], &msg, 0) == -1) {
+    dopelog(1, LF_SERVER, _("Cannot pass connection to server worker %d "
+                            "(%s)"), worker, g_strerror(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* 
+ * Passes admin command "string" to worker "worker" (or to all the other
+ * workers, if it is -1), together with the admin connection "netbuf", so
+ * that they can reply on it. Our own reply so far is sent first, to keep
+ * the output in order.
+ */
+static void ForwardServerCommand(const gchar *string, NetworkBuffer *netbuf,
+                                 gint worker)
+{
+  GString *text;
+  int i;
+
+  if (!netbuf || ForwardedCommand || WorkerIndex < 0 || !RoomSend)
+    return;
+
+  text = g_string_new("");
+  g_string_append_c(text, HANDOFFADMIN);
+  g_string_append(text, string);
+  g_string_append_c(text, '\0');
+  WriteDataToWire(netbuf);
+  for (i = 0; i < NumWorkers; i++) {
+    if (i == worker || (worker == -1 && i != WorkerIndex)) {
+      if (!SendToWorker(i, netbuf->fd, text->str, text->len)) {
+        g_print(_("Cannot pass the command to server worker %d\n"), i);
+      }
+    }
+  }
+  g_string_free(text, TRUE);
+}
+
+/* 
+ * Passes the connection of "Play" (which has not yet logged in) to worker
+ * HandOffWorker, together with its abilities, HandOffMessage and any data
+ * it has sent that we have not yet handled, and removes the player from
+ * this worker. Returns FALSE if the connection cannot be passed on (e.g.
+ * if the other worker is too far behind, or the player has sent too much
+ * data), in which case the player stays here.
+ */
+static gboolean HandOffConnection(Player *Play)
+{
+  NetworkBuffer *NetBuf = &Play->NetBuf;
+  GString *text;
+  gboolean sent;
+  gsize msglen;
+  int i;
+
+  msglen = HandOffMessage ? strlen(HandOffMessage) + 1 : 0;
+  if (NetBuf->WriteBuf.DataPresent > 0
+      || NetBuf->ReadBuf.DataPresent + msglen > HANDOFFDATA) {
+    return FALSE;
+  }
+
+  /* Room name, abilities and host, each nul-terminated, then the data */
+  text = g_string_new("");
+  g_string_append_c(text, HANDOFFPLAYER);
+  g_string_append(text, HandOffRoom);
+  g_string_append_c(text, '\0');
+  for (i = 0; i < MIN(Play->Abil.RemoteNum, A_NUM); i++) {
+    g_string_append_c(text, Play->Abil.Remote[i] ? '1' : '0');
+  }
+  g_string_append_c(text, '\0');
+  g_string_append(text, NetBuf->host ? NetBuf->host : "");
+  g_string_append_c(text, '\0');
+  if (HandOffMessage) {
+    g_string_append(text, HandOffMessage);
+    g_string_append_c(text, NetBuf->Terminator);
+  }
+  g_string_append_len(text, &NetBuf->ReadBuf.Data[NetBuf->ReadBuf.Start],
+                      NetBuf->ReadBuf.DataPresent);
+
+  sent = SendToWorker(HandOffWorker, NetBuf->fd, text->str, text->len);
+  g_string_free(text, TRUE);
+  if (!sent) {
+    return FALSE;
+  }
+  dopelog(3, LF_SERVER, _("Passed connection for room %s to server "
+                          "worker %d"), HandOffRoom, HandOffWorker);
+  FirstServer = RemoveServerPlayer(Play, FirstServer);
+  return TRUE;
+}
+
+/* 
+ * Passes on the connection of HandOffPlayer, "Play", now that we are done
+ * with the messages it has sent so far. As its game is hosted by another
+ * worker, the player is dropped if this fails.
+ */
+static void FinishHandOff(Player *Play)
+{
+  HandOffPlayer = NULL;
+  if (HandOffConnection(Play))
+    return;
+  dopelog(1, LF_SERVER, _("Cannot pass connection for room %s to server "
+                          "worker %d - dropping it"),
+          HandOffRoom, HandOffWorker);
+  SendPrintMessage(NULL, C_NONE, Play,
+                   /* Message sent to a player whose connection could not
+                      be passed to the server process that hosts their
+                      game */
+                   _("Sorry, but the server is too busy to let you join "
+                     "this game just now.^Please try connecting again "
+                     "later."));
+  /* Try to get the message out before the connection is closed */
+  WriteDataToWire(&Play->NetBuf);
+  RemovePlayerFromServer(Play);
+}
+#endif /* SERVER_WORKERS */
+
+/*
+ * Handles network activity on a player's connection, and removes the
+ * player if the connection is broken.
+ */
+static void ServerPlayerEvent(int fd, gboolean Read, gboolean Write,
+                              gboolean Exception, gpointer data)
+{
+  Player *Play = (Player *)data;
+  gboolean DoneOK;
+
+  if (NetBufHandleNetwork(&Play->NetBuf, Read, Write, Exception, &DoneOK)) {
+    /* If any complete messages were read, process them */
+    HandleServerPlayer(Play);
+  }
+#ifdef SERVER_WORKERS
+  if (HandOffPlayer == Play) {
+    if (DoneOK) {
+      FinishHandOff(Play);
+      return;
+    }
+    HandOffPlayer = NULL;
+  }
+#endif
+  if (!DoneOK) {
+    /* The socket has been shut down, or the buffer was filled -
+     * remove player */
+    RemovePlayerFromServer(Play);
+  }
+}
+
+/*
+ * Called by the network code whenever a player's connection needs
+ * to be watched for different conditions (e.g. when the write buffer
+ * fills or empties).
+ */
+static void ServerPlayerStatus(NetworkBuffer *NetBuf, gboolean Read,
+                               gboolean Write, gboolean Exception,
+                               gboolean CallNow)
+{
+  if (!ServerEvents)
+    return;
+  EventLoopWatch(ServerEvents, NetBuf->fd, Read, Write, ServerPlayerEvent,
+                 NetBuf->CallBackData);
+  if (CallNow)
+    ServerPlayerEvent(NetBuf->fd, FALSE, FALSE, FALSE, NetBuf->CallBackData);
+}
+
+#ifdef SERVER_WORKERS
+/* 
+ * Handles admin command "string" passed on by another worker, replying
+ * directly on the admin connection "fd", which is then closed (the other
+ * worker still has it open).
+ */
+static void HandleForwardedCommand(int fd, gchar *string)
+{
+  NetworkBuffer netbuf;
+  fd_set writefds;
+  struct timeval tv;
+
+  InitNetworkBuffer(&netbuf, '\n', '\r', NULL);
+  BindNetworkBufferToSocket(&netbuf, fd);
+  ForwardedCommand = TRUE;
+  HandleServerCommand(string, &netbuf, FALSE);
+  ForwardedCommand = FALSE;
+
+  /* The reply is short, so should not have to wait long to go */
+  while (netbuf.WriteBuf.DataPresent > 0 && WriteDataToWire(&netbuf)
+         && netbuf.WriteBuf.DataPresent > 0) {
+    FD_ZERO(&writefds);
+    FD_SET(fd, &writefds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select(fd + 1, NULL, &writefds, NULL, &tv) <= 0)
+      break;
+  }
+  ShutdownNetworkBuffer(&netbuf);
+}
+
+/* 
+ * Takes over connections passed to this worker by HandOffConnection, and
+ * handles admin commands passed on by ForwardServerCommand.
+ */
+static void ServerRoomEvent(int fd, gboolean Read, gboolean Write,
+                            gboolean Exception, gpointer data)
+{
+  gchar buf[HANDOFFDATA + 3 * MAXROOMNAME + A_NUM + 256];
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t len;
+  int ClientSock;
+  gchar *room, *abil, *host, *payload, *end, *addpt;
+  Player *tmp;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    len = recvmsg(fd, &msg, 0);
+    if (len == -1 && errno == EINTR)
+      continue;
+    else if (len <= 0)
+      return;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    memcpy(&ClientSock, CMSG_DATA(cmsg), sizeof(int));
+
+    end = buf + len;
+    if (buf[0] == HANDOFFADMIN && memchr(buf, '\0', len)
+        && !(msg.msg_flags & MSG_TRUNC)) {
+      HandleForwardedCommand(ClientSock, buf + 1);
+      continue;
+    } else if (buf[0] != HANDOFFPLAYER) {
+      CloseSocket(ClientSock);
+      continue;
+    }
+
+    /* Check that the three strings are all there */
+    room = buf + 1;
+    host = payload = NULL;
+    if ((abil = memchr(room, '\0', end - room)) != NULL) {
+      abil++;
+      host = memchr(abil, '\0', end - abil);
+    }
+    if (host) {
+      host++;
+      payload = memchr(host, '\0', end - host);
+    }
+    if (!payload || (msg.msg_flags & MSG_TRUNC)
+        || !EventLoopCanWatch(ServerEvents, ClientSock)) {
+      CloseSocket(ClientSock);
+      continue;
+    }
+    payload++;
+
+    tmp = g_new(Player, 1);
+    FirstServer = AddPendingPlayer(ClientSock, tmp, FirstServer);
+    if (host[0]) {
+      tmp->NetBuf.host = g_strdup(host);
+      TrackConnection(host);
+    }
+    if (abil[0]) {
+      ReceiveAbilities(tmp, abil);
+    }
+    if (ConnectTimeout) {
+      SetPlayerTimeout(&tmp->ConnectTimer, ConnectTimeout);
+    }
+    JoinRequestedRoom(tmp, room);
+    dopelog(3, LF_SERVER, _("Took over connection from %s for room %s"),
+            host, room);
+    if (end > payload) {
+      len = end - payload;
+      addpt = ExpandWriteBuffer(&tmp->NetBuf.ReadBuf, len, NULL);
+      if (addpt) {
+        memcpy(addpt, payload, len);
+        CommitWriteBuffer(NULL, &tmp->NetBuf.ReadBuf, addpt, len);
+      }
+    }
+    SetNetworkBufferCallBack(&tmp->NetBuf, ServerPlayerStatus,
+                             (gpointer)tmp);
+    /* If the room could not be created, the player goes on again to the
+     * main game */
+    if (HandOffPlayer != tmp)
+      HandleServerPlayer(tmp);
+    if (HandOffPlayer == tmp)
+      FinishHandOff(tmp);
+  }
+}
+#endif /* SERVER_WORKERS */
+
+static void ServerListenEvent(int fd, gboolean Read, gboolean Write,
+                              gboolean Exception, gpointer data)
+{
+  Player *Play;
+
+  /* Accept everything that is waiting, rather than one connection per
+   * wakeup, so that a burst of reconnections is dealt with quickly */
+  while (HandleNewConnection(&Play)) {
+    if (Play) {
+      SetNetworkBufferCallBack(&Play->NetBuf, ServerPlayerStatus,
+                               (gpointer)Play);
+    }
+  }
+}
+
+/* 
+ * Starts watching the listening socket again after PauseAccept.
+ */
+static void ResumeAccept(void)
+{
+  if (ServerEvents) {
+    EventLoopWatch(ServerEvents, ListenSock, TRUE, FALSE, ServerListenEvent,
+                   NULL);
+  }
+#ifdef GUI_SERVER
+  GuiWatchListen(TRUE);
+#endif
+}
+
+#ifndef CYGWIN
+static void ServerAdminEvent(int fd, gboolean Read, gboolean Write,
+                             gboolean Exception, gpointer data)
+{
+  NetworkBuffer *netbuf = (NetworkBuffer *)data;
+  gchar *buf;
+  gboolean DoneOK;
+
+  if (NetBufHandleNetwork(netbuf, Read, Write, Exception, &DoneOK)) {
+    while ((buf = GetWaitingMessageView(netbuf, NULL)) != NULL) {
+      dopelog(2, LF_SERVER, _("Admin command: %s"), buf);
+      HandleServerCommand(buf, netbuf, FALSE);
+    }
+  }
+  if (!DoneOK) {
+    dopelog(1, LF_SERVER, _("Admin connection closed"));
+    AdminConns = g_slist_remove(AdminConns, netbuf);
+    ShutdownNetworkBuffer(netbuf);
+    g_free(netbuf);
+  }
+}
+
+static void ServerAdminStatus(NetworkBuffer *NetBuf, gboolean Read,
+                              gboolean Write, gboolean Exception,
+                              gboolean CallNow)
+{
+  if (!ServerEvents)
+    return;
+  EventLoopWatch(ServerEvents, NetBuf->fd, Read, Write, ServerAdminEvent,
+                 NetBuf->CallBackData);
+  if (CallNow)
+    ServerAdminEvent(NetBuf->fd, FALSE, FALSE, FALSE, NetBuf->CallBackData);
+}
+
+static void ServerLocalEvent(int fd, gboolean Read, gboolean Write,
+                             gboolean Exception, gpointer data)
+{
+  int newlocal;
+  NetworkBuffer *netbuf;
+  GPrintFunc oldprint;
+
+  newlocal = accept(fd, NULL, NULL);
+  if (newlocal == -1)
+    return;
+  if (!EventLoopCanWatch(ServerEvents, newlocal)) {
+    close(newlocal);
+    return;
+  }
+  netbuf = g_new(NetworkBuffer, 1);
+
+  InitNetworkBuffer(netbuf, '\n', '\r', NULL);
+  BindNetworkBufferToSocket(netbuf, newlocal);
+  SetNetworkBufferCallBack(netbuf, ServerAdminStatus, (gpointer)netbuf);
+  AdminConns = g_slist_append(AdminConns, netbuf);
+  oldprint = StartServerReply(netbuf);
+  g_print(_("dopewars server version %s ready for admin commands; "
+            "try \"help\" for help"), VERSION);
+  FinishServerReply(oldprint);
+  dopelog(1, LF_SERVER, _("New admin connection"));
+}
+#endif
+
+#ifdef SERVER_WORKERS
+static void WorkerSignalHandle(int sig)
+{
+  WorkerSignal = sig;
+}
+
+/* Does nothing, but stops SIGCHLD from being ignored, so that it ends
+ * the supervisor's sigsuspend() */
+static void WorkerChildHandle(int sig)
+{
+}
+
+/* 
+ * Forks worker number "index". Returns TRUE in the new worker, or
+ * FALSE in the supervisor (also if the fork failed, in which case the
+ * worker will be started again later). The new worker gets the signal
+ * mask "mask".
+ */
+static gboolean StartWorker(gint index, sigset_t *mask)
+{
+  struct sigaction sact;
+  pid_t pid;
+  int i;
+
+  pid = fork();
+  if (pid == 0) {
+    WorkerIndex = index;
+    sact.sa_handler = SIG_DFL;
+    sact.sa_flags = 0;
+    sigemptyset(&sact.sa_mask);
+    sigaction(SIGCHLD, &sact, NULL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    /* Other workers' connections are none of our business */
+    for (i = 0; RoomRecv && i < NumWorkers; i++) {
+      if (i != index)
+        close(RoomRecv[i]);
+    }
+    return TRUE;
+  } else if (pid == -1) {
+    gchar *ForkError = ErrStrFromErrno(errno);
+
+    dopelog(0, LF_SERVER, _("Cannot start server worker %d: %s"),
+            index, ForkError);
+    g_free(ForkError);
+    WorkerPids[index] = 0;
+  } else {
+    dopelog(2, LF_SERVER, _("Started server worker %d (pid %ld)"),
+            index, (long)pid);
+    WorkerPids[index] = pid;
+  }
+  return FALSE;
+}
+
+/* 
+ * Runs "workers" copies of the server, each in its own process, and
+ * restarts any that die. The kernel shares incoming connections
+ * between them, since each binds the same port with SO_REUSEPORT.
+ * Returns TRUE in each worker, which should go on to start its server,
+ * or FALSE in the supervisor once all workers have been shut down (on
+ * SIGTERM or SIGINT). SIGHUP and SIGUSR1 are passed on to the workers.
+ */
+static gboolean SuperviseWorkers(gint workers)
+{
+  struct sigaction sact;
+  sigset_t blocked, oldmask;
+  time_t *Started;
+  pid_t pid;
+  int i, sig, sv[2];
+
+  if (workers > MAXWORKERS) {
+    g_warning(_("Too many server workers requested; using %d"),
+              MAXWORKERS);
+    workers = MAXWORKERS;
+  }
+
+  /* Daemonize; continue if the fork was successful and we are the child,
+   * or if the fork failed */
+  if (Daemonize && fork() > 0)
+    return FALSE;
+  CreatePidFile();
+
+  NumWorkers = workers;
+  WorkerPids = g_new0(pid_t, NumWorkers);
+  Started = g_new0(time_t, NumWorkers);
+  ScoreChanges = mmap(NULL, sizeof(gint), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ScoreChanges == MAP_FAILED) {
+    /* Workers will only see each other's scores when they write theirs */
+    ScoreChanges = NULL;
+  } else {
+    *ScoreChanges = 0;
+  }
+
+  /* The supervisor keeps these open, so that connections passed to a
+   * worker that has died are picked up when it is restarted */
+  RoomRecv = g_new(int, NumWorkers);
+  RoomSend = g_new(int, NumWorkers);
+  for (i = 0; i < NumWorkers; i++) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+      /* Without these, each worker hosts every room itself */
+      g_warning(_("Cannot pass connections between server workers: %s"),
+                g_strerror(errno));
+      for (i--; i >= 0; i--) {
+        close(RoomRecv[i]);
+        close(RoomSend[i]);
+      }
+      g_free(RoomRecv);
+      g_free(RoomSend);
+      RoomRecv = RoomSend = NULL;
+      break;
+    }
+    SetBlocking(sv[0], FALSE);
+    SetBlocking(sv[1], FALSE);
+    RoomRecv[i] = sv[0];
+    RoomSend[i] = sv[1];
+  }
+
+  /* These are only let through while waiting in sigsuspend(), so that
+   * one that arrives just before we wait is not missed */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGHUP);
+  sigaddset(&blocked, SIGUSR1);
+  sigaddset(&blocked, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+  sact.sa_handler = WorkerSignalHandle;
+  sact.sa_flags = 0;
+  sigemptyset(&sact.sa_mask);
+  sigaction(SIGTERM, &sact, NULL);
+  sigaction(SIGINT, &sact, NULL);
+  sigaction(SIGHUP, &sact, NULL);
+  sigaction(SIGUSR1, &sact, NULL);
+  sact.sa_handler = WorkerChildHandle;
+  sigaction(SIGCHLD, &sact, NULL);
+
+  dopelog(0, LF_SERVER, _("Supervising %d server workers on port %d."),
+          NumWorkers, Port);
+
+  while (1) {
+    for (i = 0; i < NumWorkers; i++) {
+      if (WorkerPids[i] == 0) {
+        Started[i] = time(NULL);
+        if (StartWorker(i, &oldmask)) {
+          g_free(Started);
+          return TRUE;
+        }
+      }
+    }
+
+    pid = waitpid(-1, NULL, WNOHANG);
+    if (pid == 0 && !WorkerSignal) {
+      /* Wait for a worker to exit, or a signal */
+      sigsuspend(&oldmask);
+      continue;
+    }
+    if (WorkerSignal) {
+      sig = WorkerSignal;
+      WorkerSignal = 0;
+      if (sig == SIGTERM || sig == SIGINT)
+        break;
+      for (i = 0; i < NumWorkers; i++) {
+        if (WorkerPids[i] > 0)
+          kill(WorkerPids[i], sig);
+      }
+    }
+    if (pid == -1 && errno == ECHILD) {
+      /* No workers at all (every fork failed); try again shortly */
+      sleep(1);
+    }
+    for (i = 0; pid > 0 && i < NumWorkers; i++) {
+      if (WorkerPids[i] == pid) {
+        dopelog(0, LF_SERVER, _("Server worker %d (pid %ld) exited; "
+                                "restarting it"), i, (long)pid);
+        WorkerPids[i] = 0;
+        if (time(NULL) - Started[i] <= WORKERMINLIFE)
+          sleep(1);
+      }
+    }
+  }
+
+  dopelog(0, LF_SERVER, _("Shutting down server workers."));
+  for (i = 0; i < NumWorkers; i++) {
+    if (WorkerPids[i] > 0)
+      kill(WorkerPids[i], SIGTERM);
+  }
+  while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+  }
+  sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+  RemovePidFile();
+  for (i = 0; RoomRecv && i < NumWorkers; i++) {
+    close(RoomRecv[i]);
+    close(RoomSend[i]);
+  }
+  g_free(RoomRecv);
+  g_free(RoomSend);
+  RoomRecv = RoomSend = NULL;
+  if (ScoreChanges)
+    munmap(ScoreChanges, sizeof(gint));
+  ScoreChanges = NULL;
+  g_free(WorkerPids);
+  g_free(Started);
+  return FALSE;
+}
+#endif /* SERVER_WORKERS */
+
 /* 
  * Initializes server, processes network and interactive messages, and
  * finally cleans up the server on exit.
  */
 void ServerLoop(struct CMDLINE *cmdline)
 {
-  Player *tmp;
-  GSList *list, *listcp;
-  fd_set readfs, writefs, errorfs;
-  int topsock;
-  struct timeval timeout;
-  int MinTimeout;
+  long MinTimeout;
   GString *LineBuf;
 
-  gboolean DoneOK;
-
 #ifndef CYGWIN
-  gchar *buf;
   int localsock;
-  GSList *nextlist;
-  GPrintFunc oldprint;
-  GSList *localconn = NULL;
 #endif
 
   InitConfiguration(cmdline);
 
+  if (cmdline->workers > 1) {
+#ifdef SERVER_WORKERS
+    /* Only the workers continue; the supervisor returns on shutdown */
+    if (!SuperviseWorkers(cmdline->workers))
+      return;
+#else
+    g_warning(_("Multiple server workers are not supported on this "
+                "system; running a single server process"));
+#endif
+  }
+
   if (!StartServer())
     return;
 
+  /* The supervisor has already daemonized and created the pid file */
+  if (WorkerIndex < 0) {
 #ifdef HAVE_FORK
-  /* Daemonize; continue if the fork was successful and we are the child,
-   * or if the fork failed */
-  if (Daemonize && fork() > 0)
-    return;
+    /* Daemonize; continue if the fork was successful and we are the
+     * child, or if the fork failed */
+    if (Daemonize && fork() > 0)
+      return;
 #endif
-  CreatePidFile();
+    CreatePidFile();
+  }
+
+  /* Create the event loop after forking, since an epoll descriptor
+   * should not be shared with the parent */
+  ServerEvents = EventLoopNew(NULL);
+  dopelog(3, LF_SERVER, _("Using %s event loop"),
+          EventLoopBackendName(ServerEvents));
+  EventLoopWatch(ServerEvents, ListenSock, TRUE, FALSE, ServerListenEvent,
+                 NULL);
+#ifdef SERVER_WORKERS
+  if (WorkerIndex >= 0 && RoomRecv) {
+    EventLoopWatch(ServerEvents, RoomRecv[WorkerIndex], TRUE, FALSE,
+                   ServerRoomEvent, NULL);
+  }
+#endif
+
   InitMetaServer();
 
 #ifndef CYGWIN
@@ -1203,45 +2719,17 @@ void ServerLoop(struct CMDLINE *cmdline)
     dopelog(0, LF_SERVER,
             _("Could not set up Unix domain socket for admin "
               "connections - check permissions on /tmp!"));
+  } else {
+    EventLoopWatch(ServerEvents, localsock, TRUE, FALSE, ServerLocalEvent,
+                   NULL);
   }
 #endif
 
   LineBuf = g_string_new("");
   while (1) {
-    FD_ZERO(&readfs);
-    FD_ZERO(&writefs);
-    FD_ZERO(&errorfs);
-    curl_multi_fdset(MetaConn.multi, &readfs, &writefs, &errorfs, &topsock);
-    FD_SET(ListenSock, &readfs);
-    FD_SET(ListenSock, &errorfs);
-    topsock = MAX(topsock + 1, ListenSock + 1);
-#ifndef CYGWIN
-    if (localsock >= 0) {
-      FD_SET(localsock, &readfs);
-      topsock = MAX(topsock, localsock + 1);
-    }
-    for (list = localconn; list; list = g_slist_next(list)) {
-      NetworkBuffer *netbuf;
-
-      netbuf = (NetworkBuffer *)list->data;
-      SetSelectForNetworkBuffer(netbuf, &readfs, &writefs, &errorfs,
-                                &topsock);
-    }
-#endif
-    for (list = FirstServer; list; list = g_slist_next(list)) {
-      tmp = (Player *)list->data;
-      if (!IsCop(tmp)) {
-        SetSelectForNetworkBuffer(&tmp->NetBuf, &readfs, &writefs,
-                                  &errorfs, &topsock);
-      }
-    }
     MinTimeout = GetMinimumTimeout(FirstServer);
-    if (MinTimeout != -1) {
-      timeout.tv_sec = MinTimeout;
-      timeout.tv_usec = 0;
-    }
-    if (select(topsock, &readfs, &writefs, &errorfs,
-               MinTimeout == -1 ? NULL : &timeout) == -1) {
+    if (EventLoopWait(ServerEvents, MetaConn.running ? MetaConn.multi : NULL,
+                      MinTimeout) == -1) {
       if (errno == EINTR) {
         if (ReregisterRequest) {
           ReregisterRequest = 0;
@@ -1262,56 +2750,22 @@ void ServerLoop(struct CMDLINE *cmdline)
         } else
           continue;
       }
-      perror("select");
+      perror(EventLoopBackendName(ServerEvents));
       break;
     }
+    /* Messages generated while handling this batch of timeouts and
+     * events are sent when it is done, one write per connection */
+    CorkNetworkBuffers();
     FirstServer = HandleTimeouts(FirstServer);
-    if (FD_ISSET(ListenSock, &readfs)) {
-      HandleNewConnection();
-    }
-#ifndef CYGWIN
-    if (localsock >= 0 && FD_ISSET(localsock, &readfs)) {
-      int newlocal;
-      NetworkBuffer *netbuf;
-
-      newlocal = accept(localsock, NULL, NULL);
-      netbuf = g_new(NetworkBuffer, 1);
-
-      InitNetworkBuffer(netbuf, '\n', '\r', NULL);
-      BindNetworkBufferToSocket(netbuf, newlocal);
-      localconn = g_slist_append(localconn, netbuf);
-      oldprint = StartServerReply(netbuf);
-      g_print(_("dopewars server version %s ready for admin commands; "
-                "try \"help\" for help"), VERSION);
-      FinishServerReply(oldprint);
-      dopelog(1, LF_SERVER, _("New admin connection"));
-    }
-    list = localconn;
-    while (list) {
-      NetworkBuffer *netbuf;
-
-      nextlist = g_slist_next(list);
-      netbuf = (NetworkBuffer *)list->data;
-      if (netbuf) {
-        if (RespondToSelect(netbuf, &readfs, &writefs, &errorfs, &DoneOK)) {
-          while ((buf = GetWaitingMessage(netbuf)) != NULL) {
-            dopelog(2, LF_SERVER, _("Admin command: %s"), buf);
-            HandleServerCommand(buf, netbuf, FALSE);
-            g_free(buf);
-          }
-        }
-        if (!DoneOK) {
-          dopelog(1, LF_SERVER, _("Admin connection closed"));
-          localconn = g_slist_remove(localconn, netbuf);
-          ShutdownNetworkBuffer(netbuf);
-          g_free(netbuf);
-        }
-        list = nextlist;
-      }
-    }
+
+    /* Handle new connections, admin commands and player data. Players
+     * removed while handling earlier descriptors are skipped. */
+    EventLoopDispatch(ServerEvents);
+    DropFullPlayers();
+    UncorkNetworkBuffers();
     if (IsServerShutdown())
       break;
-#endif
+
     if (MetaConn.running) {
       GError *tmp_error = NULL;
       int still_running;
@@ -1327,37 +2781,20 @@ void ServerLoop(struct CMDLINE *cmdline)
           break;
       }
     }
-
-    /* Check all players for data; iterate over a copy of the player list,
-     * as HandleServerPlayer may remove players from this list! */
-    listcp = g_slist_copy(FirstServer);
-    for (list = listcp; list; list = g_slist_next(list)) {
-      if (list->data && g_slist_find(FirstServer, list->data)) {
-        tmp = (Player *)list->data;
-        if (RespondToSelect(&tmp->NetBuf, &readfs, &writefs,
-                            &errorfs, &DoneOK)) {
-          /* If any complete messages were read, process them */
-          HandleServerPlayer(tmp);
-        }
-        if (!DoneOK) {
-          /* The socket has been shut down, or the buffer was filled -
-           * remove player */
-          RemovePlayerFromServer(tmp);
-          if (IsServerShutdown()) {
-            break;
-          }
-        }
-      }
-    }
-    g_slist_free(listcp);
-    if (IsServerShutdown()) {
-      break;
-    }
   }
 #ifndef CYGWIN
+  if (localsock >= 0)
+    EventLoopUnwatch(ServerEvents, localsock);
   CloseLocalSocket(localsock);
+#endif
+  EventLoopUnwatch(ServerEvents, ListenSock);
+#ifdef SERVER_WORKERS
+  if (WorkerIndex >= 0 && RoomRecv)
+    EventLoopUnwatch(ServerEvents, RoomRecv[WorkerIndex]);
 #endif
   StopServer();
+  EventLoopFree(ServerEvents);
+  ServerEvents = NULL;
   g_string_free(LineBuf, TRUE);
 
   CurlCleanup(&MetaConn);
@@ -1365,11 +2802,12 @@ void ServerLoop(struct CMDLINE *cmdline)
 
 #ifdef GUI_SERVER
 static GtkWidget *TextOutput;
+static GIOChannel *ListenChannel = NULL;
 static gint ListenTag = 0;
 static void SocketStatus(NetworkBuffer *NetBuf, gboolean Read,
                          gboolean Write, gboolean Exception, gboolean CallNow);
 static void GuiSetTimeouts(void);
-static time_t NextTimeout = 0;
+static gint64 NextTimeout = 0;
 static guint TimeoutTag = 0;
 
 static gboolean GuiDoTimeouts(gpointer data)
@@ -1380,23 +2818,24 @@ static gboolean GuiDoTimeouts(gpointer data)
   NextTimeout = 0;
 
   FirstServer = HandleTimeouts(FirstServer);
+  DropFullPlayers();
   GuiSetTimeouts();
   return FALSE;
 }
 
 void GuiSetTimeouts(void)
 {
-  int MinTimeout;
-  time_t TimeNow;
+  long MinTimeout;
+  gint64 TimeNow;
 
-  TimeNow = time(NULL);
+  TimeNow = TimerNow();
   MinTimeout = GetMinimumTimeout(FirstServer);
   if (TimeNow + MinTimeout < NextTimeout || NextTimeout < TimeNow) {
     if (TimeoutTag > 0)
       dp_g_source_remove(TimeoutTag);
     TimeoutTag = 0;
     if (MinTimeout > 0) {
-      TimeoutTag = dp_g_timeout_add(MinTimeout * 1000, GuiDoTimeouts, NULL);
+      TimeoutTag = dp_g_timeout_add(MinTimeout, GuiDoTimeouts, NULL);
       NextTimeout = TimeNow + MinTimeout;
     }
   }
@@ -1447,6 +2886,7 @@ static void GuiDoCommand(GtkWidget *widget, gpointer data)
   gtk_editable_delete_text(GTK_EDITABLE(widget), 0, -1);
   HandleServerCommand(text, NULL, TRUE);
   g_free(text);
+  DropFullPlayers();
   if (IsServerShutdown())
     GuiQuitServer();
 }
@@ -1459,10 +2899,8 @@ static gboolean GuiHandleSocket(GIOChannel *source, GIOCondition condition,
 
   Play = (Player *)data;
 
-  /* Sanity check - is the player still around? */
-  if (!g_slist_find(FirstServer, (gpointer)Play))
-    return TRUE;
-
+  /* No need to check that the player is still around, as the watch is
+   * removed when the player's network buffer is shut down */
   if (PlayerHandleNetwork(Play, condition & G_IO_IN, condition & G_IO_OUT,
                           condition & G_IO_ERR, &DoneOK)) {
     HandleServerPlayer(Play);
@@ -1470,9 +2908,10 @@ static gboolean GuiHandleSocket(GIOChannel *source, GIOCondition condition,
   }
   if (!DoneOK) {
     RemovePlayerFromServer(Play);
-    if (IsServerShutdown())
-      GuiQuitServer();
   }
+  DropFullPlayers();
+  if (!DoneOK && IsServerShutdown())
+    GuiQuitServer();
   return TRUE;
 }
 
@@ -1500,12 +2939,31 @@ static gboolean GuiNewConnect(GIOChannel *source, GIOCondition condition,
   Player *Play;
 
   if (condition & G_IO_IN) {
-    Play = HandleNewConnection();
-    SetNetworkBufferCallBack(&Play->NetBuf, SocketStatus, (gpointer)Play);
+    while (HandleNewConnection(&Play)) {
+      if (Play)
+        SetNetworkBufferCallBack(&Play->NetBuf, SocketStatus,
+                                 (gpointer)Play);
+    }
   }
   return TRUE;
 }
 
+/* 
+ * Starts or stops watching the listening socket for new connections
+ * (see PauseAccept).
+ */
+static void GuiWatchListen(gboolean Watch)
+{
+  if (ListenTag) {
+    dp_g_source_remove(ListenTag);
+    ListenTag = 0;
+  }
+  if (Watch && ListenChannel) {
+    ListenTag = dp_g_io_add_watch(ListenChannel, G_IO_IN, GuiNewConnect,
+                                  NULL);
+  }
+}
+
 static gboolean TriedPoliteShutdown = FALSE;
 
 static gint GuiRequestDelete(GtkWidget *widget, GdkEvent * event,
@@ -1647,7 +3105,6 @@ static void SetupTaskBarIcon(GtkWidget *widget)
 void GuiServerLoop(struct CMDLINE *cmdline, gboolean is_service)
 {
   GtkWidget *window, *text, *hbox, *vbox, *entry, *label;
-  GIOChannel *listench;
 
   /* GTK+2 (and the GTK emulation code on WinNT systems) expects all
    * strings to be UTF-8, so we force gettext to return all translations
@@ -1704,11 +3161,11 @@ void GuiServerLoop(struct CMDLINE *cmdline, gboolean is_service)
   InitMetaServer();
 
 #ifdef CYGIN
-  listench = g_io_channel_win32_new_socket(ListenSock);
+  ListenChannel = g_io_channel_win32_new_socket(ListenSock);
 #else
-  listench = g_io_channel_unix_new(ListenSock);
+  ListenChannel = g_io_channel_unix_new(ListenSock);
 #endif
-  ListenTag = dp_g_io_add_watch(listench, G_IO_IN, GuiNewConnect, NULL);
+  GuiWatchListen(TRUE);
 #ifdef CYGWIN
   mainhwnd = window->hWnd;
   SetupTaskBarIcon(window);
@@ -1735,13 +3192,19 @@ void FinishGame(Player *Play, char *Message)
   Play->EventNum = E_FINISH;
   ClientLeftServer(Play);
   SendHighScores(Play, TRUE, Message);
+  AccountFinishGame(GetPlayerName(Play),
+                    Play->Cash + Play->Bank - Play->Debt, Play->Turn,
+                    Play->Health == 0);
+  if (SaveDir && SaveDir[0] && Play->SaveLock) {
+    RemovePlayerGame(SaveDir, Play);
+  }
 
   /* Blank the name, so that CountPlayers ignores this player */
   SetPlayerName(Play, NULL);
 
   /* Make sure they do actually disconnect, eventually! */
   if (ConnectTimeout) {
-    Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+    SetPlayerTimeout(&Play->ConnectTimer, ConnectTimeout);
   }
 }
 
@@ -1765,38 +3228,72 @@ void HighScoreTypeRead(struct HISCORE *HiScore, FILE *fp)
 }
 
 /* 
- * Writes out a batch of NUMHISCORE high scores from "HiScore" to "fp".
+ * Frees the names and dates in a batch of NUMHISCORE high scores, and
+ * blanks the scores.
  */
-void HighScoreTypeWrite(struct HISCORE *HiScore, FILE *fp)
+static void FreeHighScores(struct HISCORE *HiScore)
 {
   int i;
-  gchar *text;
 
   for (i = 0; i < NUMHISCORE; i++) {
-    if (HiScore[i].Name) {
-      fwrite(HiScore[i].Name, strlen(HiScore[i].Name) + 1, 1, fp);
-    } else
-      fputc(0, fp);
-    if (HiScore[i].Time) {
-      fwrite(HiScore[i].Time, strlen(HiScore[i].Time) + 1, 1, fp);
-    } else
-      fputc(0, fp);
-    text = pricetostr(HiScore[i].Money);
-    fwrite(text, strlen(text) + 1, 1, fp);
-    g_free(text);
-    fputc(HiScore[i].Dead ? 1 : 0, fp);
+    g_free(HiScore[i].Name);
+    g_free(HiScore[i].Time);
   }
+  memset(HiScore, 0, sizeof(struct HISCORE) * NUMHISCORE);
 }
 
 /* 
- * Closes the high score file opened by OpenHighScoreFile, below.
+ * Frees the scores read from the file of "table", and closes the file.
+ * Scores not yet written out are kept.
+ */
+static void ClearScoreTable(ScoreTable *table)
+{
+  LeaderboardFree(table->Multi);
+  LeaderboardFree(table->Antique);
+  table->Multi = table->Antique = NULL;
+  table->Loaded = FALSE;
+  memset(&table->Journal, 0, sizeof(ScoreJournal));
+  if (table->fp) {
+    fclose(table->fp);
+  }
+  table->fp = NULL;
+  g_free(table->FileName);
+  table->FileName = NULL;
+}
+
+/* 
+ * Closes the high score file opened by OpenHighScoreFile, below, first
+ * writing out any new scores.
  */
 void CloseHighScoreFile()
 {
-  if (ScoreFP) {
-    fclose(ScoreFP);
+  FlushAllHighScores();
+  ClearScoreTable(&ServerScores);
+}
+
+/* 
+ * Writes out any new scores in a game room's table opened by
+ * OpenScoreTable (dropping them if this fails), and frees the table.
+ */
+void CloseScoreTable(ScoreTable *table)
+{
+  GSList *list;
+
+  if (!table)
+    return;
+  if (!FlushHighScores(table)) {
+    for (list = table->Pending; list; list = g_slist_next(list)) {
+      PendingScore *pend = (PendingScore *)list->data;
+
+      g_free(pend->Score.Name);
+      g_free(pend->Score.Time);
+      g_free(pend);
+    }
+    g_slist_free(table->Pending);
+    PendingTables = g_slist_remove(PendingTables, table);
   }
-  ScoreFP = NULL;
+  ClearScoreTable(table);
+  g_free(table);
 }
 
 /* 
@@ -1829,7 +3326,7 @@ void DropPrivileges()
 
 static const gchar SCOREHEADER[] = "DOPEWARS SCORES V.";
 static const guint SCOREHDRLEN = sizeof(SCOREHEADER) - 1; /* Don't include \0 */
-static const guint SCOREVERSION = 1;
+static const guint SCOREVERSION = 2;
 
 static gboolean HighScoreReadHeader(FILE *fp, gint *ScoreVersion)
 {
@@ -1865,6 +3362,7 @@ void ConvertHighScoreFile(const gchar *convertfile)
   FILE *old;
   gchar *BackupFile;
   int ch;
+  gint ScoreVersion = 0;
   struct HISCORE MultiScore[NUMHISCORE], AntiqueScore[NUMHISCORE];
 
   BackupFile = g_strdup_printf("%s.bak", convertfile);
@@ -1872,11 +3370,13 @@ void ConvertHighScoreFile(const gchar *convertfile)
   old = fopen(convertfile, "r+");
   if (old) {
     gboolean empty;
-    /* Only convert if the file is not empty, and does not have a header */
+    /* Only convert if the file is not empty, and either does not have a
+     * header or is from an older version */
     rewind(old);
     empty = (fgetc(old) == EOF);
     rewind(old);
-    if (!empty && !HighScoreReadHeader(old, NULL)) {
+    if (!empty && (!HighScoreReadHeader(old, &ScoreVersion)
+                   || ScoreVersion < SCOREVERSION)) {
       FILE *backup = fopen(BackupFile, "w");
       if (backup) {
         /* Make a backup of the old file */
@@ -1893,9 +3393,10 @@ void ConvertHighScoreFile(const gchar *convertfile)
         }
         fclose(backup);
 
-        /* Read in the scores without the header, and then write out with
-         * the header */
-        if (!HighScoreRead(old, MultiScore, AntiqueScore, FALSE)) {
+        /* Read in the scores (with the header, if there is one), and
+         * then write out in the new format */
+        if (!HighScoreRead(old, MultiScore, AntiqueScore,
+                           ScoreVersion > 0)) {
           g_log(NULL, G_LOG_LEVEL_CRITICAL,
                 _("Error reading scores from %s."), convertfile);
         } else {
@@ -1907,6 +3408,8 @@ void ConvertHighScoreFile(const gchar *convertfile)
                         "created as %s.\n"), convertfile, BackupFile);
           }
         }
+        FreeHighScores(MultiScore);
+        FreeHighScores(AntiqueScore);
       } else {
         gchar *errmsg = ErrStrFromErrno(errno);
         g_log(NULL, G_LOG_LEVEL_CRITICAL,
@@ -1966,146 +3469,863 @@ static FILE *OpenHighScoreAppData(int *error, gboolean *empty)
     }
     RegCloseKey(key);
   }
-  return fp;
+  return fp;
+}
+#endif
+
+
+/* State, set by OpenHighScoreFile, and later used by
+ * CheckHighScoreFileConfig */
+static gboolean EmptyFile;
+static int OpenError;
+
+/* 
+ * Opens the high score file for later use, and then drops privileges.
+ */
+void OpenHighScoreFile(void)
+{
+  if (ServerScores.fp) {
+    return;                     /* If already opened, then we're done */
+  }
+
+  EmptyFile = FALSE;
+  OpenError = 0;
+
+  /* Win32 gets upset if we use "a+" so we use this nasty hack instead */
+  ServerScores.fp = fopen(HiScoreFile, "r+");
+  if (!ServerScores.fp) {
+    ServerScores.fp = fopen(HiScoreFile, "w+");
+    if (!ServerScores.fp) {
+      OpenError = errno;
+    }
+    EmptyFile = TRUE;
+  }
+#ifdef CYGWIN
+  if (!ServerScores.fp) {
+    ServerScores.fp = OpenHighScoreAppData(&OpenError, &EmptyFile);
+  }
+#endif
+
+  /* Check for a 0-byte score file */
+  if (ServerScores.fp && !EmptyFile) {
+    rewind(ServerScores.fp);
+    if (fgetc(ServerScores.fp) == EOF) {
+      EmptyFile = TRUE;
+    }
+    rewind(ServerScores.fp);
+  }
+  AssignName(&ServerScores.FileName, HiScoreFile);
+}
+
+/* 
+ * Checks the high score file opened by OpenHighScoreFile, above. Also warns
+ * the user about other problems encountered during startup. Returns
+ * TRUE if it's valid; otherwise, returns FALSE.
+ */
+gboolean CheckHighScoreFileConfig(void)
+{
+  gint ScoreVersion = 0;
+
+  if (!ServerScores.fp) {
+    gchar *errstr = ErrStrFromErrno(OpenError);
+    g_log(NULL, G_LOG_LEVEL_CRITICAL,
+          _("Cannot open high score file %s.\n"
+            "(%s.) Either ensure you have permissions to access\n"
+            "this file and directory, or specify an alternate high score "
+            "file with the\n-f command line option."),
+          HiScoreFile, errstr);
+    g_free(errstr);
+    return FALSE;
+  }
+
+  if (EmptyFile) {
+    HighScoreWriteHeader(ServerScores.fp);
+    fflush(ServerScores.fp);
+  } else if (!HighScoreReadHeader(ServerScores.fp, &ScoreVersion)
+             || ScoreVersion != SCOREVERSION) {
+    g_log(NULL, G_LOG_LEVEL_CRITICAL,
+          _("%s does not appear to be a valid\n"
+            "high score file - please check it. If it is a high score file\n"
+            "from an older version of dopewars, then first convert it to the\n"
+            "new format by running \"dopewars -C %s\"\n"
+            "from the command line."), HiScoreFile, HiScoreFile);
+    return FALSE;
+  }
+
+  if (ConfigErrors) {
+#ifdef CYGWIN
+    g_warning(_("Errors were encountered during the reading of the "
+                "configuration file.\nAs as result, some settings may not "
+                "work as expected. Please consult the\n"
+                "file \"dopewars-log.txt\" for further details."));
+#else
+    g_warning(_("Errors were encountered during the reading of the "
+                "configuration\nfile. As a result, some settings may not "
+                "work as expected. Please see the\nmessages on standard "
+                "output for further details."));
+#endif
+  }
+
+  return TRUE;
+}
+
+/* 
+ * Opens the high score file "FileName" of a game room, creating it if
+ * necessary, and returns a new table for its scores; or, if it cannot be
+ * used, logs why and returns NULL. By now privileges have been dropped,
+ * so the server's own user must be able to write to the file.
+ */
+ScoreTable *OpenScoreTable(const gchar *FileName)
+{
+  ScoreTable *table;
+  FILE *fp;
+  gint ScoreVersion = 0;
+  gboolean ok;
+
+  fp = fopen(FileName, "r+");
+  if (!fp) {
+    fp = fopen(FileName, "w+");
+  }
+  if (!fp) {
+    gchar *errstr = ErrStrFromErrno(errno);
+    dopelog(1, LF_SERVER, _("Cannot open high score file %s: %s"),
+            FileName, errstr);
+    g_free(errstr);
+    return NULL;
+  }
+
+  if (fgetc(fp) == EOF) {
+    rewind(fp);
+    HighScoreWriteHeader(fp);
+    ok = (fflush(fp) == 0);
+  } else {
+    rewind(fp);
+    ok = (HighScoreReadHeader(fp, &ScoreVersion)
+          && ScoreVersion == SCOREVERSION);
+  }
+  if (!ok) {
+    dopelog(1, LF_SERVER, _("%s is not a valid high score file"), FileName);
+    fclose(fp);
+    return NULL;
+  }
+
+  table = g_new0(ScoreTable, 1);
+  table->FileName = g_strdup(FileName);
+  table->fp = fp;
+  return table;
+}
+
+/* 
+ * Locks the high score file for reading. Server workers all share the
+ * file offset of the descriptor they inherited, so they cannot read
+ * concurrently and must take an exclusive lock instead.
+ */
+static int HighScoreReadLock(FILE *fp)
+{
+  if (WorkerIndex >= 0)
+    return WriteLock(fp);
+  else
+    return ReadLock(fp);
+}
+
+/* 
+ * Returns the position of "Score" in the high score table drawn from
+ * "board", or -1 if it is not there.
+ */
+static int FindHighScore(Leaderboard *board, const struct HISCORE *Score)
+{
+  LeaderEntry *entry;
+  int i;
+
+  for (i = 0; i < NUMHISCORE; i++) {
+    entry = LeaderboardNth(board, i);
+    if (entry && entry->Score.Money == Score->Money
+        && strcmp(entry->Score.Name, Score->Name) == 0
+        && strcmp(entry->Score.Time, Score->Time) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* 
+ * Adds a copy of "Score" to the board of normal mode scores "Multi" (or,
+ * if "IsAntique" is TRUE, antique mode scores "Antique"). Blank entries,
+ * from the unused slots in old high score tables, are ignored.
+ */
+static void AddToBoards(Leaderboard *Multi, Leaderboard *Antique,
+                        const struct HISCORE *Score, gboolean IsAntique)
+{
+  if (Score->Time && Score->Time[0])
+    LeaderboardAdd(IsAntique ? Antique : Multi, Score);
+}
+
+/* 
+ * Since version 2, the high score file is a journal: the header is
+ * followed by a series of records, each of which either adds a single
+ * game's score or is a snapshot of all of them. New scores are appended
+ * to the end, and once enough have built up the file is compacted (see
+ * CompactScoreJournal). Each record is SCORERECMAGIC, a type byte, the
+ * payload length and a sequence number, the payload, and a checksum of
+ * all of these (numbers are 4 bytes, big-endian). Only records with a
+ * good checksum and a higher sequence number than any before them are
+ * applied, so that torn writes and the leftovers of an interrupted
+ * compaction are skipped.
+ */
+static const gchar SCORERECMAGIC[] = "DWSC";
+#define SCORERECMAGICLEN 4
+#define SCORERECHDRLEN   (SCORERECMAGICLEN + 9)
+#define SCORERECSUMLEN   4
+#define SCOREREC_ADD      'A'   /* Payload: antique flag, one score */
+#define SCOREREC_SNAPSHOT 'S'   /* Payload: any number of antique flags,
+                                 * each followed by a score */
+
+/* Fewest scores added to the journal before it is compacted; once there
+ * are more scores in total than this, it waits for as many to be added
+ * as are in the snapshot, so that compaction costs O(1) per score */
+#define MAXJOURNALADDS 64
+
+static void PutScoreInt(GString *str, guint32 val)
+{
+  g_string_append_c(str, (gchar)((val >> 24) & 0xFF));
+  g_string_append_c(str, (gchar)((val >> 16) & 0xFF));
+  g_string_append_c(str, (gchar)((val >> 8) & 0xFF));
+  g_string_append_c(str, (gchar)(val & 0xFF));
+}
+
+static guint32 GetScoreInt(const guchar *data)
+{
+  return ((guint32)data[0] << 24) | ((guint32)data[1] << 16)
+      | ((guint32)data[2] << 8) | (guint32)data[3];
+}
+
+/* 
+ * Returns the checksum (32-bit FNV-1a) of "len" bytes at "data".
+ */
+static guint32 ScoreChecksum(const guchar *data, gsize len)
+{
+  guint32 sum = 2166136261U;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    sum ^= data[i];
+    sum *= 16777619U;
+  }
+  return sum;
 }
-#endif
 
+/* 
+ * Appends "Score" to "str", in the same form as version 1 files used.
+ */
+static void PutHighScore(GString *str, const struct HISCORE *Score)
+{
+  gchar *text;
 
-/* State, set by OpenHighScoreFile, and later used by
- * CheckHighScoreFileConfig */
-static gboolean EmptyFile;
-static int OpenError;
+  g_string_append(str, Score->Name ? Score->Name : "");
+  g_string_append_c(str, '\0');
+  g_string_append(str, Score->Time ? Score->Time : "");
+  g_string_append_c(str, '\0');
+  text = pricetostr(Score->Money);
+  g_string_append(str, text);
+  g_string_append_c(str, '\0');
+  g_free(text);
+  g_string_append_c(str, Score->Dead ? 1 : 0);
+}
 
 /* 
- * Opens the high score file for later use, and then drops privileges.
+ * Copies the nul-terminated string at "*data" (which must end before
+ * "end") into "*str", and moves "*data" past it. Returns FALSE if the
+ * string is not terminated.
  */
-void OpenHighScoreFile(void)
+static gboolean GetScoreString(const gchar **data, const gchar *end,
+                               gchar **str)
 {
-  if (ScoreFP) {
-    return;                     /* If already opened, then we're done */
+  const gchar *nul = memchr(*data, '\0', end - *data);
+
+  if (!nul)
+    return FALSE;
+  *str = g_strdup(*data);
+  *data = nul + 1;
+  return TRUE;
+}
+
+/* 
+ * Reads a score written by PutHighScore from "*data" into "Score", and
+ * moves "*data" past it. Returns FALSE if it is malformed.
+ */
+static gboolean GetHighScore(const gchar **data, const gchar *end,
+                             struct HISCORE *Score)
+{
+  gchar *money = NULL;
+  gboolean ok;
+
+  memset(Score, 0, sizeof(struct HISCORE));
+  ok = GetScoreString(data, end, &Score->Name)
+      && GetScoreString(data, end, &Score->Time)
+      && GetScoreString(data, end, &money) && *data < end;
+  if (ok) {
+    Score->Money = strtoprice(money);
+    Score->Dead = (**data > 0);
+    (*data)++;
+  } else {
+    g_free(Score->Name);
+    g_free(Score->Time);
+    Score->Name = Score->Time = NULL;
   }
+  g_free(money);
+  return ok;
+}
 
-  EmptyFile = FALSE;
-  OpenError = 0;
+/* 
+ * Appends a journal record of type "type", with sequence number "seq"
+ * and payload "payload", to "str".
+ */
+static void PutScoreRecord(GString *str, gchar type, guint32 seq,
+                           GString *payload)
+{
+  gsize start = str->len;
+
+  g_string_append_len(str, SCORERECMAGIC, SCORERECMAGICLEN);
+  g_string_append_c(str, type);
+  PutScoreInt(str, payload->len);
+  PutScoreInt(str, seq);
+  g_string_append_len(str, payload->str, payload->len);
+  PutScoreInt(str, ScoreChecksum((const guchar *)str->str + start,
+                                 str->len - start));
+}
 
-  /* Win32 gets upset if we use "a+" so we use this nasty hack instead */
-  ScoreFP = fopen(HiScoreFile, "r+");
-  if (!ScoreFP) {
-    ScoreFP = fopen(HiScoreFile, "w+");
-    if (!ScoreFP) {
-      OpenError = errno;
-    }
-    EmptyFile = TRUE;
+/* 
+ * Appends a snapshot record of every score in "Multi" and "Antique"
+ * (normal and antique mode) to "str". They are given in date order, so
+ * that they are added back in much the order they were played.
+ */
+static void PutScoreSnapshot(GString *str, guint32 seq, Leaderboard *Multi,
+                             Leaderboard *Antique)
+{
+  GString *payload;
+  guint i;
+
+  payload = g_string_new(NULL);
+  for (i = 0; i < Antique->ByDate->len; i++) {
+    g_string_append_c(payload, 1);
+    PutHighScore(payload, &LeaderboardByDate(Antique, i)->Score);
   }
-#ifdef CYGWIN
-  if (!ScoreFP) {
-    ScoreFP = OpenHighScoreAppData(&OpenError, &EmptyFile);
+  for (i = 0; i < Multi->ByDate->len; i++) {
+    g_string_append_c(payload, 0);
+    PutHighScore(payload, &LeaderboardByDate(Multi, i)->Score);
   }
-#endif
+  PutScoreRecord(str, SCOREREC_SNAPSHOT, seq, payload);
+  g_string_free(payload, TRUE);
+}
 
-  /* Check for a 0-byte score file */
-  if (ScoreFP && !EmptyFile) {
-    rewind(ScoreFP);
-    if (fgetc(ScoreFP) == EOF) {
-      EmptyFile = TRUE;
+/* 
+ * Reads an antique flag and score, as written for journal records, from
+ * "*data" into "Score" and "*Antique", and moves "*data" past them.
+ * Returns FALSE if they are malformed.
+ */
+static gboolean GetJournalScore(const gchar **data, const gchar *end,
+                                struct HISCORE *Score, gboolean *Antique)
+{
+  if (*data >= end)
+    return FALSE;
+  *Antique = (**data != 0);
+  (*data)++;
+  return GetHighScore(data, end, Score);
+}
+
+/* 
+ * Applies the payload (from "data" to "end") of a journal record of
+ * type "type" to the boards of normal and antique mode scores. Returns
+ * FALSE (leaving the boards alone) if it is malformed.
+ */
+static gboolean ApplyScoreRecord(gchar type, const gchar *data,
+                                 const gchar *end, Leaderboard *Multi,
+                                 Leaderboard *Antique)
+{
+  struct HISCORE Score;
+  gboolean IsAntique;
+  const gchar *pt;
+
+  if (type == SCOREREC_ADD) {
+    if (!GetJournalScore(&data, end, &Score, &IsAntique))
+      return FALSE;
+    AddToBoards(Multi, Antique, &Score, IsAntique);
+    g_free(Score.Name);
+    g_free(Score.Time);
+    return TRUE;
+  } else if (type == SCOREREC_SNAPSHOT) {
+    /* Check the whole snapshot before replacing anything with it */
+    for (pt = data; pt < end;) {
+      if (!GetJournalScore(&pt, end, &Score, &IsAntique))
+        return FALSE;
+      g_free(Score.Name);
+      g_free(Score.Time);
     }
-    rewind(ScoreFP);
+    LeaderboardClear(Multi);
+    LeaderboardClear(Antique);
+    for (pt = data; pt < end;) {
+      GetJournalScore(&pt, end, &Score, &IsAntique);
+      AddToBoards(Multi, Antique, &Score, IsAntique);
+      g_free(Score.Name);
+      g_free(Score.Time);
+    }
+    return TRUE;
   }
+  return FALSE;
 }
 
 /* 
- * Checks the high score file opened by OpenHighScoreFile, above. Also warns
- * the user about other problems encountered during startup. Returns
- * TRUE if it's valid; otherwise, returns FALSE.
+ * Reads the records of the (locked) high score journal "fp", from the
+ * end of those already read (as given by "journal") to the end of the
+ * file, applies them to the boards of normal and antique mode scores,
+ * and updates "journal" to match. Anything that is not a good record is
+ * skipped. Returns FALSE if the file could not be read.
  */
-gboolean CheckHighScoreFileConfig(void)
+static gboolean ReadScoreJournal(FILE *fp, ScoreJournal *journal,
+                                 Leaderboard *Multi, Leaderboard *Antique)
 {
+  GString *buf;
+  gchar chunk[4096];
+  const guchar *data;
+  gsize n, pos = 0;
+  long start = journal->End;
 
-  if (!ScoreFP) {
-    gchar *errstr = ErrStrFromErrno(OpenError);
-    g_log(NULL, G_LOG_LEVEL_CRITICAL,
-          _("Cannot open high score file %s.\n"
-            "(%s.) Either ensure you have permissions to access\n"
-            "this file and directory, or specify an alternate high score "
-            "file with the\n-f command line option."),
-          HiScoreFile, errstr);
-    g_free(errstr);
+  if (fseek(fp, start, SEEK_SET) != 0)
     return FALSE;
+  buf = g_string_new(NULL);
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    g_string_append_len(buf, chunk, n);
   }
-
-  if (EmptyFile) {
-    HighScoreWriteHeader(ScoreFP);
-    fflush(ScoreFP);
-  } else if (!HighScoreReadHeader(ScoreFP, NULL)) {
-    g_log(NULL, G_LOG_LEVEL_CRITICAL,
-          _("%s does not appear to be a valid\n"
-            "high score file - please check it. If it is a high score file\n"
-            "from an older version of dopewars, then first convert it to the\n"
-            "new format by running \"dopewars -C %s\"\n"
-            "from the command line."), HiScoreFile, HiScoreFile);
+  if (ferror(fp)) {
+    g_string_free(buf, TRUE);
     return FALSE;
   }
 
-  if (ConfigErrors) {
-#ifdef CYGWIN
-    g_warning(_("Errors were encountered during the reading of the "
-                "configuration file.\nAs as result, some settings may not "
-                "work as expected. Please consult the\n"
-                "file \"dopewars-log.txt\" for further details."));
-#else
-    g_warning(_("Errors were encountered during the reading of the "
-                "configuration\nfile. As a result, some settings may not "
-                "work as expected. Please see the\nmessages on standard "
-                "output for further details."));
-#endif
+  data = (const guchar *)buf->str;
+  while (pos + SCORERECHDRLEN + SCORERECSUMLEN <= buf->len) {
+    const guchar *rec = data + pos;
+    guint32 len, seq;
+    gsize total;
+
+    len = GetScoreInt(rec + SCORERECMAGICLEN + 1);
+    seq = GetScoreInt(rec + SCORERECMAGICLEN + 5);
+    if (memcmp(rec, SCORERECMAGIC, SCORERECMAGICLEN) != 0
+        || len > buf->len - pos - SCORERECHDRLEN - SCORERECSUMLEN) {
+      pos++;
+      continue;
+    }
+    total = SCORERECHDRLEN + len + SCORERECSUMLEN;
+    if (GetScoreInt(rec + total - SCORERECSUMLEN)
+        != ScoreChecksum(rec, total - SCORERECSUMLEN)) {
+      pos++;
+      continue;
+    }
+    if (seq > journal->Seq
+        && ApplyScoreRecord(rec[SCORERECMAGICLEN],
+                            (const gchar *)rec + SCORERECHDRLEN,
+                            (const gchar *)rec + SCORERECHDRLEN + len,
+                            Multi, Antique)) {
+      journal->Seq = seq;
+      if (rec[SCORERECMAGICLEN] == SCOREREC_SNAPSHOT)
+        journal->Adds = 0;
+      else
+        journal->Adds++;
+    }
+    if (seq == journal->Seq)
+      journal->Last = start + pos;
+    pos += total;
+    journal->End = start + pos;
   }
+  g_string_free(buf, TRUE);
+  return TRUE;
+}
 
+/* 
+ * Writes "buf" to "fp" at offset "pos", and makes sure that it has
+ * reached the disk. Returns TRUE on success.
+ */
+static gboolean WriteScoreData(FILE *fp, long pos, GString *buf)
+{
+  if (fseek(fp, pos, SEEK_SET) != 0
+      || fwrite(buf->str, 1, buf->len, fp) != buf->len || fflush(fp) != 0)
+    return FALSE;
+#ifdef HAVE_FSYNC
+  if (fsync(fileno(fp)) != 0)
+    return FALSE;
+#endif
   return TRUE;
 }
 
 /* 
  * Reads all the high scores into MultiScore and AntiqueScore (antique
  * mode scores). If ReadHeader is TRUE, read the high score file header
- * first. Returns TRUE on success, FALSE on failure.
+ * first (files without one are from very old versions). Returns TRUE on
+ * success, FALSE on failure.
  */
 gboolean HighScoreRead(FILE *fp, struct HISCORE *MultiScore,
                        struct HISCORE *AntiqueScore, gboolean ReadHeader)
 {
+  ScoreJournal journal;
   gint ScoreVersion = 0;
+  gboolean retval = FALSE;
+
   memset(MultiScore, 0, sizeof(struct HISCORE) * NUMHISCORE);
   memset(AntiqueScore, 0, sizeof(struct HISCORE) * NUMHISCORE);
-  if (fp && ReadLock(fp) == 0) {
-    rewind(fp);
-    if (ReadHeader && !HighScoreReadHeader(fp, &ScoreVersion)) {
-      ReleaseLock(fp);
-      return FALSE;
+  if (!fp || HighScoreReadLock(fp) != 0)
+    return FALSE;
+  rewind(fp);
+  if (ReadHeader && !HighScoreReadHeader(fp, &ScoreVersion)) {
+    retval = FALSE;
+  } else if (ScoreVersion >= 2) {
+    Leaderboard *Multi = LeaderboardNew(), *Antique = LeaderboardNew();
+    LeaderEntry *entry;
+    int i;
+
+    memset(&journal, 0, sizeof(ScoreJournal));
+    journal.Start = journal.End = ftell(fp);
+    retval = ReadScoreJournal(fp, &journal, Multi, Antique);
+    for (i = 0; i < NUMHISCORE; i++) {
+      if ((entry = LeaderboardNth(Multi, i))) {
+        MultiScore[i] = entry->Score;
+        MultiScore[i].Name = g_strdup(entry->Score.Name);
+        MultiScore[i].Time = g_strdup(entry->Score.Time);
+      }
+      if ((entry = LeaderboardNth(Antique, i))) {
+        AntiqueScore[i] = entry->Score;
+        AntiqueScore[i].Name = g_strdup(entry->Score.Name);
+        AntiqueScore[i].Time = g_strdup(entry->Score.Time);
+      }
     }
+    LeaderboardFree(Multi);
+    LeaderboardFree(Antique);
+  } else {
     HighScoreTypeRead(AntiqueScore, fp);
     HighScoreTypeRead(MultiScore, fp);
-    ReleaseLock(fp);
-  } else
-    return FALSE;
-  return TRUE;
+    retval = TRUE;
+  }
+  ReleaseLock(fp);
+  return retval;
 }
 
 /* 
- * Writes out all the high scores from MultiScore and AntiqueScore; returns
- * TRUE on success, FALSE on failure.
+ * Replaces the contents of "fp" with a new high score file, holding
+ * the scores in MultiScore and AntiqueScore; returns TRUE on success,
+ * FALSE on failure.
  */
 gboolean HighScoreWrite(FILE *fp, struct HISCORE *MultiScore,
                         struct HISCORE *AntiqueScore)
 {
-  if (fp && WriteLock(fp) == 0) {
-    ftruncate(fileno(fp), 0);
+  Leaderboard *Multi, *Antique;
+  GString *buf;
+  gboolean retval;
+  int i;
+
+  if (!fp || WriteLock(fp) != 0)
+    return FALSE;
+  Multi = LeaderboardNew();
+  Antique = LeaderboardNew();
+  for (i = 0; i < NUMHISCORE; i++) {
+    AddToBoards(Multi, Antique, &MultiScore[i], FALSE);
+    AddToBoards(Multi, Antique, &AntiqueScore[i], TRUE);
+  }
+  buf = g_string_new(NULL);
+  PutScoreSnapshot(buf, 1, Multi, Antique);
+  LeaderboardFree(Multi);
+  LeaderboardFree(Antique);
+  retval = (ftruncate(fileno(fp), 0) == 0);
+  if (retval) {
     rewind(fp);
     HighScoreWriteHeader(fp);
-    HighScoreTypeWrite(AntiqueScore, fp);
-    HighScoreTypeWrite(MultiScore, fp);
-    ReleaseLock(fp);
-    fflush(fp);
-  } else
-    return 0;
-  return 1;
+    retval = WriteScoreData(fp, ftell(fp), buf);
+  }
+  ReleaseLock(fp);
+  g_string_free(buf, TRUE);
+  return retval;
+}
+
+/* 
+ * Brings the scores in "table" up to date with its (locked) high score
+ * file. Usually only the records added since the file was last read
+ * need to be read, but if it has been compacted by another process in
+ * the meantime (so that the last record we read is no longer where it
+ * was) it is read again from the start. Returns FALSE on failure.
+ */
+static gboolean SyncHighScores(ScoreTable *table)
+{
+  guchar hdr[SCORERECHDRLEN];
+  gint ScoreVersion = 0;
+  long size;
+  gboolean reread;
+  GSList *list;
+
+  if (fseek(table->fp, 0, SEEK_END) != 0 || (size = ftell(table->fp)) < 0)
+    return FALSE;
+  reread = (!table->Loaded || size < table->Journal.End);
+  if (!reread && table->Journal.Last > 0) {
+    reread = (fseek(table->fp, table->Journal.Last, SEEK_SET) != 0
+              || fread(hdr, 1, SCORERECHDRLEN, table->fp) != SCORERECHDRLEN
+              || memcmp(hdr, SCORERECMAGIC, SCORERECMAGICLEN) != 0
+              || GetScoreInt(hdr + SCORERECMAGICLEN + 5)
+                 != table->Journal.Seq);
+  }
+  if (!reread) {
+    return (size == table->Journal.End
+            || ReadScoreJournal(table->fp, &table->Journal, table->Multi,
+                                table->Antique));
+  }
+
+  table->Loaded = FALSE;
+  LeaderboardClear(table->Multi);
+  LeaderboardClear(table->Antique);
+  memset(&table->Journal, 0, sizeof(ScoreJournal));
+  rewind(table->fp);
+  if (!HighScoreReadHeader(table->fp, &ScoreVersion)
+      || ScoreVersion != SCOREVERSION)
+    return FALSE;
+  table->Journal.Start = table->Journal.End = ftell(table->fp);
+  if (!ReadScoreJournal(table->fp, &table->Journal, table->Multi,
+                        table->Antique))
+    return FALSE;
+
+  /* Scores not yet written out are kept */
+  for (list = table->Pending; list; list = g_slist_next(list)) {
+    PendingScore *pend = (PendingScore *)list->data;
+
+    AddToBoards(table->Multi, table->Antique, &pend->Score, pend->Antique);
+  }
+  table->Loaded = TRUE;
+  return TRUE;
+}
+
+/* 
+ * Appends a record to the (write-locked) high score journal of "table"
+ * for each of its Pending scores. Anything after the last good record
+ * (e.g. part of a record, from a process that died while writing it) is
+ * removed first. Returns FALSE on failure, in which case nothing is
+ * added.
+ */
+static gboolean AppendScoreRecords(ScoreTable *table)
+{
+  GString *buf, *payload;
+  GSList *list;
+  guint32 seq = table->Journal.Seq;
+  long last = table->Journal.Last;
+  gint adds = 0;
+  gboolean ok;
+
+  buf = g_string_new(NULL);
+  payload = g_string_new(NULL);
+  for (list = table->Pending; list; list = g_slist_next(list)) {
+    PendingScore *pend = (PendingScore *)list->data;
+
+    g_string_truncate(payload, 0);
+    g_string_append_c(payload, pend->Antique ? 1 : 0);
+    PutHighScore(payload, &pend->Score);
+    last = table->Journal.End + buf->len;
+    PutScoreRecord(buf, SCOREREC_ADD, ++seq, payload);
+    adds++;
+  }
+  g_string_free(payload, TRUE);
+
+  ok = (fflush(table->fp) == 0
+        && ftruncate(fileno(table->fp), table->Journal.End) == 0
+        && WriteScoreData(table->fp, table->Journal.End, buf));
+  if (ok) {
+    table->Journal.End += buf->len;
+    table->Journal.Last = last;
+    table->Journal.Seq = seq;
+    table->Journal.Adds += adds;
+  } else {
+    /* Don't leave part of a record behind (e.g. if the disk is full) */
+    fflush(table->fp);
+    ftruncate(fileno(table->fp), table->Journal.End);
+  }
+  g_string_free(buf, TRUE);
+  return ok;
+}
+
+/* 
+ * Compacts the (write-locked) high score journal, which must match the
+ * scores in memory. A snapshot of the scores is appended to the file
+ * first, and then copied to the start of it, after which the file is
+ * cut short. If this is interrupted, the snapshot at the end (which has
+ * the highest sequence number) is still found when the file is next
+ * read. Returns FALSE if even the first step failed.
+ */
+static gboolean CompactScoreJournal(ScoreTable *table)
+{
+  GString *buf;
+  long snappos = table->Journal.End;
+
+  buf = g_string_new(NULL);
+  PutScoreSnapshot(buf, table->Journal.Seq + 1, table->Multi,
+                   table->Antique);
+  if (!WriteScoreData(table->fp, snappos, buf)) {
+    g_string_free(buf, TRUE);
+    return FALSE;
+  }
+  table->Journal.Seq++;
+  table->Journal.Last = snappos;
+  table->Journal.End = snappos + buf->len;
+  table->Journal.Adds = 0;
+
+  /* Leave the file as it is if the copy would overwrite the snapshot */
+  if (snappos - table->Journal.Start >= (long)buf->len
+      && WriteScoreData(table->fp, table->Journal.Start, buf)
+      && ftruncate(fileno(table->fp),
+                   table->Journal.Start + buf->len) == 0) {
+    table->Journal.Last = table->Journal.Start;
+    table->Journal.End = table->Journal.Start + buf->len;
+  }
+  g_string_free(buf, TRUE);
+  return TRUE;
+}
+
+/* 
+ * Makes sure that "table" holds the high scores, reading them from the
+ * file if this has not yet been done (or, with server workers, reading
+ * what another worker has added since; a game room's own table is only
+ * ever used by the worker that hosts the room). Scores not yet written
+ * out are kept. Returns FALSE if the file could not be read.
+ */
+static gboolean LoadHighScores(ScoreTable *table)
+{
+  gboolean stale = !table->Loaded, ok;
+  gint changes = 0;
+
+#ifdef SERVER_WORKERS
+  if (table == &ServerScores && ScoreChanges) {
+    changes = *ScoreChanges;
+    if (changes != ScoreChangesSeen)
+      stale = TRUE;
+  }
+#endif
+  if (!stale)
+    return TRUE;
+
+  if (!table->Multi) {
+    table->Multi = LeaderboardNew();
+    table->Antique = LeaderboardNew();
+  }
+  if (!table->fp || HighScoreReadLock(table->fp) != 0)
+    return FALSE;
+  ok = SyncHighScores(table);
+  ReleaseLock(table->fp);
+#ifdef SERVER_WORKERS
+  if (ok && table == &ServerScores)
+    ScoreChangesSeen = changes;
+#endif
+  return ok;
+}
+
+/* 
+ * Appends any new high scores in "table" to its file, compacting it if
+ * enough have built up. Anything written to the file by other processes
+ * since it was last read is picked up first. Returns FALSE on failure,
+ * in which case the new scores are kept, to be tried again when the
+ * next one is added (or the file is closed).
+ */
+static gboolean FlushHighScores(ScoreTable *table)
+{
+  GSList *list;
+  gboolean ok;
+
+  if (!table->Pending)
+    return TRUE;
+
+  ok = (table->fp && WriteLock(table->fp) == 0);
+  if (ok) {
+    ok = SyncHighScores(table) && AppendScoreRecords(table);
+    /* The new scores are safely on disk even if this fails */
+    if (ok && table->Journal.Adds >= MAX(MAXJOURNALADDS,
+                                         LeaderboardSize(table->Multi)
+                                         + LeaderboardSize(table->Antique))
+        && !CompactScoreJournal(table)) {
+      dopelog(1, LF_SERVER, _("Unable to compact high score file %s"),
+              table->FileName);
+    }
+#ifdef SERVER_WORKERS
+    if (ok && table == &ServerScores && ScoreChanges) {
+      ScoreChangesSeen = ++(*ScoreChanges);
+    }
+#endif
+    ReleaseLock(table->fp);
+  }
+  if (!ok) {
+    g_warning(_("Unable to write high score file %s"), table->FileName);
+    return FALSE;
+  }
+
+  for (list = table->Pending; list; list = g_slist_next(list)) {
+    PendingScore *pend = (PendingScore *)list->data;
+
+    g_free(pend->Score.Name);
+    g_free(pend->Score.Time);
+    g_free(pend);
+  }
+  g_slist_free(table->Pending);
+  table->Pending = NULL;
+  PendingTables = g_slist_remove(PendingTables, table);
+  return TRUE;
+}
+
+/* 
+ * Writes out the new scores in all of the PendingTables (see
+ * FlushHighScores). Returns FALSE if any of them could not be written.
+ */
+static gboolean FlushAllHighScores(void)
+{
+  GSList *list, *next;
+  gboolean ok = TRUE;
+
+  TimerCancel(&ScoreFlushTimer);
+  for (list = PendingTables; list; list = next) {
+    next = g_slist_next(list);
+    if (!FlushHighScores((ScoreTable *)list->data))
+      ok = FALSE;
+  }
+  return ok;
+}
+
+/* 
+ * Adds "Score" to the high scores in "table" in memory (every game is
+ * kept, not just those that make the table), and returns its position
+ * in the table (or -1 if it is not high enough). On the server, new
+ * scores are written to the file in batches, ScoreFlushDelay seconds
+ * after the first of them; otherwise, they are written right away.
+ */
+static int AddHighScore(ScoreTable *table, const struct HISCORE *Score,
+                        gboolean Antique)
+{
+  Leaderboard *board;
+  PendingScore *pend;
+  int pos;
+
+  if (!LoadHighScores(table))
+    g_warning(_("Unable to read high score file %s"), table->FileName);
+  board = Antique ? table->Antique : table->Multi;
+  pos = LeaderboardAdd(board, Score);
+  if (pos >= NUMHISCORE)
+    pos = -1;
+
+  pend = g_new(PendingScore, 1);
+  pend->Score.Name = g_strdup(Score->Name);
+  pend->Score.Time = g_strdup(Score->Time);
+  pend->Score.Money = Score->Money;
+  pend->Score.Dead = Score->Dead;
+  pend->Antique = Antique;
+  if (!table->Pending)
+    PendingTables = g_slist_append(PendingTables, table);
+  table->Pending = g_slist_append(table->Pending, pend);
+
+  if (Server && ScoreFlushDelay > 0) {
+    if (ScoreFlushTimer.expiry == 0)
+      SetPlayerTimeout(&ScoreFlushTimer, ScoreFlushDelay);
+  } else if (FlushHighScores(table)) {
+    /* Scores from other processes may have moved this one */
+    pos = FindHighScore(board, Score);
+  }
+  return pos;
 }
 
 /* 
@@ -2117,8 +4337,10 @@ gboolean HighScoreWrite(FILE *fp, struct HISCORE *MultiScore,
  */
 void SendHighScores(Player *Play, gboolean EndGame, char *Message)
 {
-  struct HISCORE MultiScore[NUMHISCORE], AntiqueScore[NUMHISCORE], Score;
-  struct HISCORE *HiScore;
+  struct HISCORE Score;
+  ScoreTable *table;
+  Leaderboard *board;
+  LeaderEntry *entry;
   struct tm *timep;
 #ifdef HAVE_GMTIME_R
   struct tm tmbuf;
@@ -2129,18 +4351,20 @@ void SendHighScores(Player *Play, gboolean EndGame, char *Message)
   int i, j, InList = -1;
 
   text = g_string_new("");
-  if (!HighScoreRead(ScoreFP, MultiScore, AntiqueScore, TRUE)) {
-    g_warning(_("Unable to read high score file %s"), HiScoreFile);
+
+  /* Players in a game room with its own scores only see those */
+  table = (Play->Room && Play->Room->Scores) ? Play->Room->Scores
+                                             : &ServerScores;
+
+  /* (When a score is added, AddHighScore reads the scores itself) */
+  if (!EndGame && !LoadHighScores(table)) {
+    g_warning(_("Unable to read high score file %s"), table->FileName);
   }
   if (Message) {
     g_string_assign(text, Message);
     if (strlen(text->str) > 0)
       g_string_append_c(text, '^');
   }
-  if (WantAntique)
-    HiScore = AntiqueScore;
-  else
-    HiScore = MultiScore;
   if (EndGame) {
     Score.Money = Play->Cash + Play->Bank - Play->Debt;
     Score.Name = g_strdup(GetPlayerName(Play));
@@ -2155,52 +4379,35 @@ void SendHighScores(Player *Play, gboolean EndGame, char *Message)
 
     strftime(Score.Time, 80, "%d-%m-%Y", timep);
     Score.Time[79] = '\0';
-    for (i = 0; i < NUMHISCORE; i++) {
-      if (InList == -1 && (Score.Money > HiScore[i].Money ||
-                           !HiScore[i].Time || HiScore[i].Time[0] == 0)) {
-        InList = i;
-        g_string_append(text,
-                        _("Congratulations! You made the high scores!"));
-        SendPrintMessage(NULL, C_NONE, Play, text->str);
-        g_free(HiScore[NUMHISCORE - 1].Name);
-        g_free(HiScore[NUMHISCORE - 1].Time);
-        for (j = NUMHISCORE - 1; j > i; j--) {
-          memcpy(&HiScore[j], &HiScore[j - 1], sizeof(struct HISCORE));
-        }
-        memcpy(&HiScore[i], &Score, sizeof(struct HISCORE));
-        break;
-      }
-    }
+    InList = AddHighScore(table, &Score, WantAntique);
     if (InList == -1) {
       g_string_append(text,
                       _("You didn't even make the high score table..."));
-      SendPrintMessage(NULL, C_NONE, Play, text->str);
+    } else {
+      g_string_append(text,
+                      _("Congratulations! You made the high scores!"));
     }
+    SendPrintMessage(NULL, C_NONE, Play, text->str);
   }
   SendServerMessage(NULL, C_NONE, C_STARTHISCORE, Play, NULL);
 
+  board = WantAntique ? table->Antique : table->Multi;
   j = 0;
   for (i = 0; i < NUMHISCORE; i++) {
-    if (SendSingleHighScore(Play, &HiScore[i], j, InList == i))
+    entry = LeaderboardNth(board, i);
+    if (entry && SendSingleHighScore(Play, &entry->Score, j, InList == i))
       j++;
   }
   if (InList == -1 && EndGame) {
     SendSingleHighScore(Play, &Score, j, TRUE);
-    g_free(Score.Name);
-    g_free(Score.Time);
   }
   SendServerMessage(NULL, C_NONE, C_ENDHISCORE, Play,
                     EndGame ? "end" : NULL);
   if (!EndGame)
     SendDrugsHere(Play, FALSE);
-  if (EndGame && !HighScoreWrite(ScoreFP, MultiScore, AntiqueScore)) {
-    g_warning(_("Unable to write high score file %s"), HiScoreFile);
-  }
-  for (i = 0; i < NUMHISCORE; i++) {
-    g_free(MultiScore[i].Name);
-    g_free(MultiScore[i].Time);
-    g_free(AntiqueScore[i].Name);
-    g_free(AntiqueScore[i].Time);
+  if (EndGame) {
+    g_free(Score.Name);
+    g_free(Score.Time);
   }
   g_string_free(text, TRUE);
 }
@@ -2266,7 +4473,7 @@ void SendEvent(Player *To)
       for (i = 0; i < To->TipList.Number; i++) {
         dopelog(3, LF_SERVER, _("%s: Tipoff from %s"), GetPlayerName(To),
                 GetPlayerName(To->TipList.Data[i].Play));
-        To->OnBehalfOf = To->TipList.Data[i].Play;
+        SetOnBehalfOf(To, To->TipList.Data[i].Play);
         SendCopOffer(To, FORCECOPS);
         return;
       }
@@ -2274,7 +4481,7 @@ void SendEvent(Player *To)
         if (To->SpyList.Data[i].Turns < 0) {
           dopelog(3, LF_SERVER, _("%s: Spy offered by %s"), GetPlayerName(To),
                   GetPlayerName(To->SpyList.Data[i].Play));
-          To->OnBehalfOf = To->SpyList.Data[i].Play;
+          SetOnBehalfOf(To, To->SpyList.Data[i].Play);
           SendCopOffer(To, FORCEBITCH);
           return;
         }
@@ -2392,17 +4599,17 @@ void SendEvent(Player *To)
       }
       break;
     case E_ARRIVE:
-      for (list = FirstServer; list; list = g_slist_next(list)) {
+      for (list = To->Room->Players; list; list = g_slist_next(list)) {
         Play = (Player *)list->data;
-        if (IsConnectedPlayer(Play) && Play != To
-            && NumGun > 0 && Play->IsAt == To->IsAt
-            && Play->EventNum == E_NONE && TotalGunsCarried(To) > 0) {
+        if (IsConnectedPlayer(Play) && Play != To && NumGun > 0
+            && Play->IsAt == To->IsAt && Play->EventNum == E_NONE
+            && TotalGunsCarried(To) > 0) {
           text = g_strdup_printf(_("%s^%s is already here!^"
                                    "Do you Attack, or Evade?"),
                                  attackquestiontr,
                                  GetPlayerName(Play));
           /* Steal this to keep track of the potential defender */
-          To->OnBehalfOf = Play;
+          SetOnBehalfOf(To, Play);
 
           SendDrugsHere(To, TRUE);
           SendQuestion(NULL, C_MEETPLAYER, To, text);
@@ -2480,6 +4687,9 @@ void CopsAttackPlayer(Player *Play)
   Cops = g_new(Player, 1);
 
   FirstServer = AddPlayer(0, Cops, FirstServer);
+  /* The cops stay in the room (and so its settings) of the player */
+  if (Play->Room)
+    JoinGameRoom(Cops, Play->Room->Name);
   SetPlayerName(Cops, Cop[CopIndex - 1].Name);
   Cops->CopIndex = CopIndex;
   Cops->Cash = brandom(100, 2000);
@@ -2544,6 +4754,7 @@ void AttackPlayer(Player *Play, Player *Attacked)
   Play->EventNum = Attacked->EventNum = E_FIGHT;
 
   Play->Attacking = Attacked;
+  Play->AttackingSerial = Attacked->Serial;
 
   SendFightMessage(Attacked, Play, 0, F_ARRIVED, (price_t)0, TRUE, NULL);
 
@@ -2639,7 +4850,7 @@ void AllowNextShooter(Player *Play)
   if (FightTimeout) {
     NextShooter = GetNextShooter(Play);
     if (NextShooter && !CanPlayerFire(NextShooter)) {
-      NextShooter->FightTimeout = 0;
+      ClearFightTimeout(NextShooter);
     }
   }
 }
@@ -2799,8 +5010,7 @@ static Player *GetFireTarget(Player *Play)
   Player *Defend;
   guint ArrayInd;
 
-  if (Play->Attacking
-      && g_slist_find(FirstServer, (gpointer)Play->Attacking)) {
+  if (IsLivePlayer(Play->Attacking, Play->AttackingSerial, FirstServer)) {
     return Play->Attacking;
   } else {
     Play->Attacking = NULL;
@@ -2846,9 +5056,11 @@ void Fire(Player *Play)
   price_t Loot;
   FightPoint fp;
   Player *Defend;
+  guint Serial;
 
   if (!Play->FightArray)
     return;
+  Serial = Play->Serial;
   if (!CanPlayerFire(Play))
     return;
 
@@ -2882,17 +5094,17 @@ void Fire(Player *Play)
   CheckForKilledPlayers(Play);
 
   /* Careful, as we might have killed Player "Play" */
-  if (g_slist_find(FirstServer, (gpointer)Play))
+  if (IsLivePlayer(Play, Serial, FirstServer))
     DoReturnFire(Play);
 
-  if (g_slist_find(FirstServer, (gpointer)Play))
+  if (IsLivePlayer(Play, Serial, FirstServer))
     CheckCopsIntervene(Play);
 }
 
 gboolean CanPlayerFire(Player *Play)
 {
-  return (FightTimeout == 0 || Play->FightTimeout == 0 ||
-          Play->FightTimeout <= time(NULL));
+  return (FightTimeout == 0 || Play->FightTimer.expiry == 0 ||
+          Play->FightTimer.expiry <= TimerNow());
 }
 
 gboolean CanRunHere(Player *Play)
@@ -2910,7 +5122,7 @@ gboolean CanRunHere(Player *Play)
 Player *GetNextShooter(Player *Play)
 {
   Player *MinPlay, *Defend;
-  time_t MinTimeout;
+  gint64 MinTimeout;
   guint mintie;
   guint ArrayInd;
 
@@ -2924,12 +5136,13 @@ Player *GetNextShooter(Player *Play)
     Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
     if (Defend == Play)
       continue;
-    if (Defend->FightTimeout == 0)
+    if (Defend->FightTimer.expiry == 0)
       return NULL;
-    if (MinTimeout == 0 || Defend->FightTimeout < MinTimeout
-        || (Defend->FightTimeout == MinTimeout && Defend->tiebreak < mintie)) {
+    if (MinTimeout == 0 || Defend->FightTimer.expiry < MinTimeout
+        || (Defend->FightTimer.expiry == MinTimeout
+            && Defend->tiebreak < mintie)) {
       MinPlay = Defend;
-      MinTimeout = Defend->FightTimeout;
+      MinTimeout = Defend->FightTimer.expiry;
       mintie = Defend->tiebreak;
     }
   }
@@ -2944,7 +5157,7 @@ void ResolveTipoff(Player *Play)
   if (IsCop(Play) || !CanRunHere(Play))
     return;
 
-  if (g_slist_find(FirstServer, (gpointer)Play->OnBehalfOf)) {
+  if (IsLivePlayer(Play->OnBehalfOf, Play->OnBehalfOfSerial, FirstServer)) {
     dopelog(4, LF_SERVER, _("%s: tipoff by %s finished OK."),
             GetPlayerName(Play), GetPlayerName(Play->OnBehalfOf));
     RemoveListPlayer(&(Play->TipList), Play->OnBehalfOf);
@@ -3322,7 +5535,8 @@ void HandleAnswer(Player *From, Player *To, char *answer)
   } else if (answer[0] == 'Y')
     switch (From->EventNum) {
     case E_OFFOBJECT:
-      if (g_slist_find(FirstServer, (gpointer)From->OnBehalfOf)) {
+      if (IsLivePlayer(From->OnBehalfOf, From->OnBehalfOfSerial,
+                       FirstServer)) {
         dopelog(3, LF_SERVER, _("%s: offer was on behalf of %s"),
                 GetPlayerName(From), GetPlayerName(From->OnBehalfOf));
         if (From->Bitches.Price) {
@@ -3394,8 +5608,9 @@ void HandleAnswer(Player *From, Player *To, char *answer)
       break;
   } else if (From->EventNum == E_ARRIVE) {
     if ((answer[0] == 'A' || answer[0] == 'T') &&
-        IsConnectedPlayer(From->OnBehalfOf) &&
-        g_slist_find(FirstServer, (gpointer)From->OnBehalfOf)) {
+        IsLivePlayer(From->OnBehalfOf, From->OnBehalfOfSerial,
+                     FirstServer) &&
+        IsConnectedPlayer(From->OnBehalfOf)) {
       Defender = From->OnBehalfOf;
       From->OnBehalfOf = NULL;  /* So we don't think it was a tipoff */
       if (Defender->IsAt == From->IsAt) {
@@ -3432,7 +5647,8 @@ void HandleAnswer(Player *From, Player *To, char *answer)
     case E_LOANSHARK:
     case E_OFFOBJECT:
     case E_WEED:
-      if (g_slist_find(FirstServer, (gpointer)From->OnBehalfOf)) {
+      if (IsLivePlayer(From->OnBehalfOf, From->OnBehalfOfSerial,
+                       FirstServer)) {
         dopelog(3, LF_SERVER, _("%s: offer was on behalf of %s"),
                 GetPlayerName(From), GetPlayerName(From->OnBehalfOf));
         if (From->Bitches.Price && From->EventNum == E_OFFOBJECT) {
@@ -3631,26 +5847,27 @@ int LoseBitch(Player *Play, Inventory *Guns, Inventory *Drugs)
 void SetFightTimeout(Player *Play)
 {
   if (FightTimeout) {
-    Play->FightTimeout = time(NULL) + (time_t) FightTimeout;
+    SetPlayerTimeout(&Play->FightTimer, FightTimeout);
 
-    /* Make sure we have a higher tiebreak value than any other player with
-     * the same fight timeout (since FightTimeout only has second resolution,
-     * and possibly only microseconds have elapsed) */
+    /* Make sure we have a higher tiebreak value than any other player in
+     * the same fight with the same fight timeout (since possibly less
+     * than a millisecond has elapsed) */
     Play->tiebreak = 0;
-    if (Play->FightTimeout) {
-      GSList *listpt;
+    if (Play->FightArray) {
+      guint ArrayInd;
 
-      for (listpt = FirstServer; listpt; listpt = g_slist_next(listpt)) {
-        Player *listplay = (Player *)listpt->data;
+      for (ArrayInd = 0; ArrayInd < Play->FightArray->len; ArrayInd++) {
+        Player *listplay = (Player *)g_ptr_array_index(Play->FightArray,
+                                                       ArrayInd);
 
         if (listplay && listplay != Play
-            && listplay->FightTimeout == Play->FightTimeout) {
+            && listplay->FightTimer.expiry == Play->FightTimer.expiry) {
           Play->tiebreak = MAX(Play->tiebreak, listplay->tiebreak + 1);
         }
       }
     }
   } else {
-    Play->FightTimeout = 0;
+    ClearFightTimeout(Play);
   }
 }
 
@@ -3659,16 +5876,17 @@ void SetFightTimeout(Player *Play)
  */
 void ClearFightTimeout(Player *Play)
 {
-  Play->FightTimeout = 0;
+  TimerCancel(&Play->FightTimer);
 }
 
 /* 
  * Given the time of a pending event in "timeout" and the current time in
- * "timenow", updates "mintime" with the number of seconds to that event,
- * unless "mintime" is already smaller (as long as it's not -1, which
- * means "uninitialized"). Returns 1 if the timeout has already expired.
+ * "timenow" (both in milliseconds), updates "mintime" with the number of
+ * milliseconds to that event, unless "mintime" is already smaller (as
+ * long as it's not -1, which means "uninitialized"). Returns 1 if the
+ * timeout has already expired.
  */
-long AddTimeout(time_t timeout, time_t timenow, long *mintime)
+long AddTimeout(gint64 timeout, gint64 timenow, long *mintime)
 {
   if (timeout == 0)
     return 0;
@@ -3676,38 +5894,32 @@ long AddTimeout(time_t timeout, time_t timenow, long *mintime)
     return 1;
   else {
     if (*mintime < 0 || timeout - timenow < *mintime)
-      *mintime = timeout - timenow;
+      *mintime = (long)(timeout - timenow);
     return 0;
   }
 }
 
 /* 
- * Returns the number of seconds until the next scheduled event. If such
- * an event has already expired, returns 0. If no events are pending,
- * returns -1. "First" should point to a list of valid players.
+ * Returns the number of milliseconds until the next scheduled event. If
+ * such an event has already expired, returns 0. If no events are
+ * pending, returns -1. Player timeouts are kept in a heap, so this does
+ * not depend on the number of players in "First".
  */
 long GetMinimumTimeout(GSList *First)
 {
-  Player *Play;
-  GSList *list;
   long mintime = -1;
-  time_t timenow;
+  gint64 timenow;
 
-  timenow = time(NULL);
 #ifdef NETWORKING
   curl_multi_timeout(MetaConn.multi, &mintime);
 #endif
-  if (AddTimeout(MetaMinTimeout, timenow, &mintime))
+  timenow = (gint64)time(NULL) * 1000;
+  if (AddTimeout((gint64)MetaMinTimeout * 1000, timenow, &mintime))
     return 0;
-  if (AddTimeout(MetaUpdateTimeout, timenow, &mintime))
+  if (AddTimeout((gint64)MetaUpdateTimeout * 1000, timenow, &mintime))
+    return 0;
+  if (AddTimeout(TimerHeapNextExpiry(PlayerTimers), TimerNow(), &mintime))
     return 0;
-  for (list = First; list; list = g_slist_next(list)) {
-    Play = (Player *)list->data;
-    if (AddTimeout(Play->FightTimeout, timenow, &mintime) ||
-        AddTimeout(Play->IdleTimeout, timenow, &mintime) ||
-        AddTimeout(Play->ConnectTimeout, timenow, &mintime))
-      return 0;
-  }
   return mintime;
 }
 
@@ -3715,13 +5927,15 @@ long GetMinimumTimeout(GSList *First)
  * Given a list of players in "First", checks to see if any events
  * have timed out, and if so, performs the necessary actions. The
  * new start of the list is returned, since a player may be removed
- * if their ConnectTimeout has expired.
+ * if their ConnectTimeout has expired. Only players with expired
+ * timers are examined.
  */
 GSList *HandleTimeouts(GSList *First)
 {
-  GSList *list, *nextlist;
   Player *Play;
+  Timer *timer;
   time_t timenow;
+  gint64 msnow;
 
   timenow = time(NULL);
   if (MetaMinTimeout <= timenow) {
@@ -3735,36 +5949,46 @@ GSList *HandleTimeouts(GSList *First)
     dopelog(3, LF_SERVER, _("Sending reminder message to the metaserver..."));
     RegisterWithMetaServer(TRUE, FALSE, FALSE);
   }
-  list = First;
-  while (list) {
-    nextlist = g_slist_next(list);
-    Play = (Player *)list->data;
-    if (Play->IdleTimeout != 0 && Play->IdleTimeout <= timenow) {
-      Play->IdleTimeout = 0;
+
+  /* Any timer rescheduled while we do this will expire after "msnow",
+   * so this loop always terminates */
+  msnow = TimerNow();
+  while ((timer = TimerHeapPopExpired(PlayerTimers, msnow)) != NULL) {
+#ifdef NETWORKING
+    if (timer == &AcceptTimer) {
+      ResumeAccept();
+      continue;
+    }
+#endif
+    if (timer == &ScoreFlushTimer) {
+      FlushAllHighScores();
+      continue;
+    }
+    Play = (Player *)timer->data;
+    UseGameRoom(Play->Room);
+    if (timer == &Play->IdleTimer) {
       dopelog(1, LF_SERVER, _("Player removed due to idle timeout"));
       SendPrintMessage(NULL, C_NONE, Play,
                        "Disconnected due to idle timeout");
+      SaveServerGame(Play);
+      ReleaseServerGame(Play);
       ClientLeftServer(Play);
       /* Blank the name, so that CountPlayers ignores this player */
       SetPlayerName(Play, NULL);
       /* Make sure they do actually disconnect, eventually! */
       if (ConnectTimeout) {
-        Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+        SetPlayerTimeout(&Play->ConnectTimer, ConnectTimeout);
       }
-    } else if (Play->ConnectTimeout != 0
-               && Play->ConnectTimeout <= timenow) {
-      Play->ConnectTimeout = 0;
+    } else if (timer == &Play->ConnectTimer) {
       dopelog(1, LF_SERVER, _("Player removed due to connect timeout"));
-      First = RemovePlayer(Play, First);
-    } else if (IsConnectedPlayer(Play) &&
-               Play->FightTimeout != 0 && Play->FightTimeout <= timenow) {
-      ClearFightTimeout(Play);
+      First = RemoveServerPlayer(Play, First);
+    } else if (timer == &Play->FightTimer && IsConnectedPlayer(Play)) {
       if (IsCop(Play))
         Fire(Play);
       else
         SendFightReload(Play);
     }
-    list = nextlist;
   }
+  FlushAllPlayerData();
   return First;
 }
@@ -36,7 +36,7 @@ void CleanUpServer(void);
 void BreakHandle(int sig);
 void ClientLeftServer(Player *Play);
 void StopServer(void);
-Player *HandleNewConnection(void);
+gboolean HandleNewConnection(Player **NewPlayer);
 void ServerLoop(struct CMDLINE *cmdline);
 void HandleServerPlayer(Player *Play);
 void HandleServerMessage(gchar *buf, Player *ReallyFrom);
@@ -58,6 +58,8 @@ void ConvertHighScoreFile(const gchar *convertfile);
 void OpenHighScoreFile(void);
 gboolean CheckHighScoreFileConfig(void);
 void CloseHighScoreFile(void);
+ScoreTable *OpenScoreTable(const gchar *FileName);
+void CloseScoreTable(ScoreTable *table);
 gboolean HighScoreRead(FILE *fp, struct HISCORE *MultiScore,
                        struct HISCORE *AntiqueScore, gboolean ReadHeader);
 void CopsAttackPlayer(Player *Play);
@@ -0,0 +1,207 @@
+/************************************************************************
+ * timers.c       A binary heap of timers, for server timeouts          *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "timers.h"
+
+/* The timers, ordered such that each timer expires no later than its
+ * children (those at 2i+1 and 2i+2), so the root expires first */
+struct _TimerHeap {
+  GPtrArray *timers;
+};
+
+#define HEAP_TIMER(heap, i) ((Timer *)g_ptr_array_index((heap)->timers, i))
+
+/* 
+ * Returns the current time, in milliseconds. This is taken from a
+ * monotonic clock, so is unaffected by changes to the system time, and
+ * is only useful for comparison with other values from this function.
+ */
+gint64 TimerNow(void)
+{
+  return g_get_monotonic_time() / 1000;
+}
+
+TimerHeap *TimerHeapNew(void)
+{
+  TimerHeap *heap;
+
+  heap = g_new(TimerHeap, 1);
+  heap->timers = g_ptr_array_new();
+  return heap;
+}
+
+/* 
+ * Frees the heap. Any timers still in the heap are cancelled.
+ */
+void TimerHeapFree(TimerHeap *heap)
+{
+  guint i;
+
+  for (i = 0; i < heap->timers->len; i++) {
+    Timer *timer = HEAP_TIMER(heap, i);
+
+    timer->expiry = 0;
+    timer->heap = NULL;
+  }
+  g_ptr_array_free(heap->timers, TRUE);
+  g_free(heap);
+}
+
+/* 
+ * Initializes a timer, which is not yet scheduled.
+ */
+void TimerInit(Timer *timer, gpointer data)
+{
+  timer->expiry = 0;
+  timer->heap = NULL;
+  timer->index = 0;
+  timer->data = data;
+}
+
+static void PlaceTimer(TimerHeap *heap, Timer *timer, guint index)
+{
+  g_ptr_array_index(heap->timers, index) = timer;
+  timer->index = index;
+}
+
+static void SiftUp(TimerHeap *heap, Timer *timer, guint index)
+{
+  while (index > 0) {
+    guint parent = (index - 1) / 2;
+    Timer *ptimer = HEAP_TIMER(heap, parent);
+
+    if (ptimer->expiry <= timer->expiry)
+      break;
+    PlaceTimer(heap, ptimer, index);
+    index = parent;
+  }
+  PlaceTimer(heap, timer, index);
+}
+
+static void SiftDown(TimerHeap *heap, Timer *timer, guint index)
+{
+  guint len = heap->timers->len;
+
+  while (2 * index + 1 < len) {
+    guint child = 2 * index + 1;
+    Timer *ctimer = HEAP_TIMER(heap, child);
+
+    if (child + 1 < len && HEAP_TIMER(heap, child + 1)->expiry
+        < ctimer->expiry) {
+      child++;
+      ctimer = HEAP_TIMER(heap, child);
+    }
+    if (timer->expiry <= ctimer->expiry)
+      break;
+    PlaceTimer(heap, ctimer, index);
+    index = child;
+  }
+  PlaceTimer(heap, timer, index);
+}
+
+/* 
+ * Schedules "timer" to expire at time "expiry" (see TimerNow). If the
+ * timer is already scheduled, it is moved to the new time. O(log n).
+ */
+void TimerSchedule(TimerHeap *heap, Timer *timer, gint64 expiry)
+{
+  gint64 oldexpiry;
+
+  if (expiry <= 0)
+    expiry = 1;                 /* 0 is reserved for "not scheduled" */
+  if (timer->heap && timer->heap != heap)
+    TimerCancel(timer);
+
+  oldexpiry = timer->expiry;
+  timer->expiry = expiry;
+  if (!timer->heap) {
+    timer->heap = heap;
+    g_ptr_array_add(heap->timers, timer);
+    SiftUp(heap, timer, heap->timers->len - 1);
+  } else if (expiry < oldexpiry) {
+    SiftUp(heap, timer, timer->index);
+  } else {
+    SiftDown(heap, timer, timer->index);
+  }
+}
+
+/* 
+ * Removes "timer" from its heap, if it is scheduled. O(log n).
+ */
+void TimerCancel(Timer *timer)
+{
+  TimerHeap *heap = timer->heap;
+  Timer *last;
+  guint index;
+
+  timer->expiry = 0;
+  if (!heap)
+    return;
+  timer->heap = NULL;
+
+  index = timer->index;
+  last = (Timer *)g_ptr_array_remove_index(heap->timers,
+                                           heap->timers->len - 1);
+  if (last != timer) {
+    /* Fill the hole with the last timer, and restore the heap order */
+    if (index > 0
+        && last->expiry < HEAP_TIMER(heap, (index - 1) / 2)->expiry)
+      SiftUp(heap, last, index);
+    else
+      SiftDown(heap, last, index);
+  }
+}
+
+/* 
+ * Returns the time at which the next timer expires, or 0 if no timers
+ * are scheduled. O(1).
+ */
+gint64 TimerHeapNextExpiry(TimerHeap *heap)
+{
+  if (!heap || heap->timers->len == 0)
+    return 0;
+  return HEAP_TIMER(heap, 0)->expiry;
+}
+
+/* 
+ * If any timer has expired by time "now", removes it from the heap and
+ * returns it; otherwise, returns NULL. The owner would normally call
+ * this repeatedly until it returns NULL.
+ */
+Timer *TimerHeapPopExpired(TimerHeap *heap, gint64 now)
+{
+  Timer *timer;
+
+  if (!heap || heap->timers->len == 0)
+    return NULL;
+  timer = HEAP_TIMER(heap, 0);
+  if (timer->expiry > now)
+    return NULL;
+  TimerCancel(timer);
+  return timer;
+}
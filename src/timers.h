@@ -0,0 +1,53 @@
+/************************************************************************
+ * timers.h       Header file for the server's timer heap               *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_TIMERS_H__
+#define __DP_TIMERS_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+typedef struct _TimerHeap TimerHeap;
+
+/* A single timer. This is usually embedded in the structure that it
+ * belongs to, and must be cancelled before that structure is freed. */
+typedef struct _Timer {
+  gint64 expiry;                /* Time (see TimerNow) at which the timer
+                                 * expires, or 0 if it is not scheduled */
+  TimerHeap *heap;              /* The heap the timer is scheduled in */
+  guint index;                  /* Position of the timer in the heap */
+  gpointer data;                /* Data for the owner of the timer */
+} Timer;
+
+gint64 TimerNow(void);
+TimerHeap *TimerHeapNew(void);
+void TimerHeapFree(TimerHeap *heap);
+void TimerInit(Timer *timer, gpointer data);
+void TimerSchedule(TimerHeap *heap, Timer *timer, gint64 expiry);
+void TimerCancel(Timer *timer);
+gint64 TimerHeapNextExpiry(TimerHeap *heap);
+Timer *TimerHeapPopExpired(TimerHeap *heap, gint64 now);
+
+#endif /* __DP_TIMERS_H__ */
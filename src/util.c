@@ -185,6 +185,11 @@ int WriteLock(FILE * fp)
   return 0;
 }
 
+int TryWriteLock(FILE * fp)
+{
+  return 0;
+}
+
 void ReleaseLock(FILE * fp)
 {
 }
@@ -193,7 +198,7 @@ void ReleaseLock(FILE * fp)
 
 #include <errno.h>
 
-static int DoLock(FILE * fp, int l_type)
+static int DoLock(FILE * fp, int cmd, int l_type)
 {
   struct flock lk;
 
@@ -202,7 +207,7 @@ static int DoLock(FILE * fp, int l_type)
   lk.l_pid = 0;
 
   do {
-    if (fcntl(fileno(fp), F_SETLKW, &lk) == 0) {
+    if (fcntl(fileno(fp), cmd, &lk) == 0) {
       return 0;
     }
   } while (errno == EINTR);
@@ -211,17 +216,26 @@ static int DoLock(FILE * fp, int l_type)
 
 int ReadLock(FILE * fp)
 {
-  return DoLock(fp, F_RDLCK);
+  return DoLock(fp, F_SETLKW, F_RDLCK);
 }
 
 int WriteLock(FILE * fp)
 {
-  return DoLock(fp, F_WRLCK);
+  return DoLock(fp, F_SETLKW, F_WRLCK);
+}
+
+/* 
+ * Like WriteLock, but returns non-zero at once, rather than waiting, if
+ * another process holds a lock on the file.
+ */
+int TryWriteLock(FILE * fp)
+{
+  return DoLock(fp, F_SETLK, F_WRLCK);
 }
 
 void ReleaseLock(FILE * fp)
 {
-  (void)DoLock(fp, F_UNLCK);
+  (void)DoLock(fp, F_SETLK, F_UNLCK);
 }
 
 #endif /* CYGWIN */
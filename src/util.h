@@ -64,6 +64,7 @@ void MicroSleep(int microsec);
 
 int ReadLock(FILE *fp);
 int WriteLock(FILE *fp);
+int TryWriteLock(FILE *fp);
 void ReleaseLock(FILE *fp);
 
 /* Now make definitions if they haven't been done properly */